@@ -139,5 +139,17 @@ to exclude the API function. */
 
 /* A header file that defines trace macro can be included here. */
 
+/* Lets cpu_usage.c measure the load of each core. The macro is expanded in tasks.c once the next task has been selected,
+ * so cpu_usage_task_switched_in() checks whether it is one of the idle tasks via xTaskGetCurrentTaskHandle(). */
+#ifndef __ASSEMBLER__
+void cpu_usage_task_switched_in(int core);
+#endif
+
+#if FREE_RTOS_KERNEL_SMP
+#define traceTASK_SWITCHED_IN() cpu_usage_task_switched_in(portGET_CORE_ID())
+#else
+#define traceTASK_SWITCHED_IN() cpu_usage_task_switched_in(0)
+#endif
+
 #endif /* FREERTOS_CONFIG_H */
 
@@ -0,0 +1,65 @@
+#include <pico/stdlib.h>
+#include <FreeRTOS.h>
+#include <task.h>
+#include "cpu_usage.h"
+
+/* Each entry is only updated by its own core. The sampling task can read it while the other core is switching the tasks,
+ * that can be off by one switch in the worst case. The 32-bit microsecond counters wrap around after ~71 minutes,
+ * which is fine as long as the samples are taken more often than that. */
+static struct
+{
+	volatile uint32_t last_switch;
+	volatile uint32_t busy_time;
+	volatile bool idle;
+	uint32_t sampled_time, sampled_busy_time;	//Only used by cpu_usage_sample()
+} s_Cores[CPU_USAGE_MAX_CORES];
+
+/* The task selected by the scheduler is compared with the idle tasks, rather than checking its priority via pxCurrentTCB
+ * (that is an array on the SMP kernel). The SMP kernel has an idle task per core, so the task is compared with all of them. */
+static bool __not_in_flash_func(is_idle_task)(TaskHandle_t task)
+{
+#if FREE_RTOS_KERNEL_SMP
+	for (int i = 0; i < configNUM_CORES; i++)
+	{
+#if tskKERNEL_VERSION_MAJOR >= 11
+		if (task == xTaskGetIdleTaskHandleForCore(i))
+#else
+		if (task == xTaskGetIdleTaskHandle()[i])	//The SMP branch returns the array of the idle task handles
+#endif
+			return true;
+	}
+	
+	return false;
+#else
+	return task == xTaskGetIdleTaskHandle();
+#endif
+}
+
+void __not_in_flash_func(cpu_usage_task_switched_in)(int core)
+{
+	uint32_t now = time_us_32();
+	bool idle = is_idle_task(xTaskGetCurrentTaskHandle());
+	if (!s_Cores[core].idle)
+		s_Cores[core].busy_time += now - s_Cores[core].last_switch;
+	
+	s_Cores[core].last_switch = now;
+	s_Cores[core].idle = idle;
+}
+
+void cpu_usage_sample(int percent[CPU_USAGE_MAX_CORES])
+{
+	uint32_t now = time_us_32();
+	for (int i = 0; i < CPU_USAGE_MAX_CORES; i++)
+	{
+		uint32_t busy_time = s_Cores[i].busy_time;
+		if (!s_Cores[i].idle)
+			busy_time += now - s_Cores[i].last_switch;	//The task running right now
+		
+		uint32_t elapsed = now - s_Cores[i].sampled_time;
+		percent[i] = elapsed ? (int)((uint64_t)(busy_time - s_Cores[i].sampled_busy_time) * 100 / elapsed) : 0;
+		percent[i] = MIN(percent[i], 100);
+		
+		s_Cores[i].sampled_time = now;
+		s_Cores[i].sampled_busy_time = busy_time;
+	}
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Measures the load of each core, based on the time spent in the tasks other than the idle ones. The time is tracked
+ * by the traceTASK_SWITCHED_IN() hook (see FreeRTOSConfig.h), so it does not need a separate task or timer. */
+
+#define CPU_USAGE_MAX_CORES 2
+
+//Called by the hook on the core switching the tasks, with the interrupts disabled
+void cpu_usage_task_switched_in(int core);
+
+//Returns the load of each core in percent, averaged since the previous call
+void cpu_usage_sample(int percent[CPU_USAGE_MAX_CORES]);
@@ -10,6 +10,11 @@
 #include "../debug_printf.h"
 #include "../server_settings.h"
 
+//Cores the DNS server task can run on with the SMP kernel
+#ifndef DNS_SERVER_CORE_AFFINITY
+#define DNS_SERVER_CORE_AFFINITY tskNO_AFFINITY
+#endif
+
 static struct
 {
 	uint32_t primary_ip;
@@ -196,5 +201,9 @@ void dns_server_init(uint32_t primary_ip,
 	s_DNSServerSettings.ignore_network_suffix = dns_ignores_network_suffix;
 	
 	TaskHandle_t task;
+#if FREE_RTOS_KERNEL_SMP
+	xTaskCreateAffinitySet(dns_server_thread, "DNS server", configMINIMAL_STACK_SIZE, NULL, tskIDLE_PRIORITY + 2, DNS_SERVER_CORE_AFFINITY, &task);
+#else
 	xTaskCreate(dns_server_thread, "DNS server", configMINIMAL_STACK_SIZE, NULL, tskIDLE_PRIORITY + 2, &task);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include <string.h>
+#include "flash_writer.h"
+
+//CRC32 (reflected 0xEDB88320 polynomial) processed 4 bits at a time, so the table only takes 64 bytes
+static const uint32_t s_CRC32Table[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+uint32_t flash_writer_crc32(uint32_t crc, const void *data, uint32_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	crc = ~crc;
+	while (size--)
+	{
+		crc ^= *p++;
+		crc = (crc >> 4) ^ s_CRC32Table[crc & 15];
+		crc = (crc >> 4) ^ s_CRC32Table[crc & 15];
+	}
+	return ~crc;
+}
+
+void flash_writer_begin(flash_writer *writer, const flash_writer_backend *backend, uint32_t base, uint32_t capacity, void *buffers)
+{
+	memset(writer, 0, sizeof(*writer));
+	writer->backend = backend;
+	writer->base = writer->next_offset = base;
+	writer->capacity = capacity;
+	writer->buffers[0] = (uint8_t *)buffers;
+	writer->buffers[1] = writer->buffers[0] + FLASH_WRITER_SECTOR_SIZE;
+	writer->pending = -1;
+}
+
+//Waits for the sector handed over to the backend (even if the writer has already failed, as the buffer is still in use) and verifies it
+static void complete_pending_sector(flash_writer *writer)
+{
+	if (writer->pending < 0)
+		return;
+	
+	writer->backend->wait(writer->backend->context);
+	if (memcmp(writer->backend->map(writer->backend->context, writer->pending_offset), writer->buffers[writer->pending], FLASH_WRITER_SECTOR_SIZE))
+		writer->failed = true;
+	
+	writer->pending = -1;
+}
+
+static void submit_active_sector(flash_writer *writer)
+{
+	memset(writer->buffers[writer->active] + writer->fill, 0xFF, FLASH_WRITER_SECTOR_SIZE - writer->fill);
+	
+	//The other buffer will be filled next, so the sector in it must be written by now
+	complete_pending_sector(writer);
+	if (writer->failed)
+		return;
+	
+	writer->pending = writer->active;
+	writer->pending_offset = writer->next_offset;
+	writer->backend->write_sector(writer->backend->context, writer->pending_offset, writer->buffers[writer->pending]);
+	
+	writer->next_offset += FLASH_WRITER_SECTOR_SIZE;
+	writer->active ^= 1;
+	writer->fill = 0;
+}
+
+bool flash_writer_write(flash_writer *writer, const void *data, uint32_t size)
+{
+	if (size > writer->capacity - writer->written)
+		writer->failed = true;
+	if (writer->failed)
+		return false;
+	
+	writer->crc = flash_writer_crc32(writer->crc, data, size);
+	writer->written += size;
+	
+	const uint8_t *p = (const uint8_t *)data;
+	while (size)
+	{
+		uint32_t todo = FLASH_WRITER_SECTOR_SIZE - writer->fill;
+		if (todo > size)
+			todo = size;
+		
+		memcpy(writer->buffers[writer->active] + writer->fill, p, todo);
+		writer->fill += todo;
+		p += todo;
+		size -= todo;
+		
+		if (writer->fill == FLASH_WRITER_SECTOR_SIZE)
+		{
+			submit_active_sector(writer);
+			if (writer->failed)
+				return false;
+		}
+	}
+	
+	return true;
+}
+
+bool flash_writer_finish(flash_writer *writer)
+{
+	if (writer->fill && !writer->failed)
+		submit_active_sector(writer);
+	
+	complete_pending_sector(writer);
+	return !writer->failed;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Streams data into a FLASH region sector by sector, using 2 sector buffers: while one sector is being programmed by the backend,
+ * the next one can be received into the other buffer. Every programmed sector is read back and compared with the buffer.
+ * The writer does not depend on the Pico SDK, so it can be used on the host with a simulated backend. */
+
+#define FLASH_WRITER_SECTOR_SIZE 4096
+
+typedef struct
+{
+	//Erases the sector at the specified offset and programs it. Can return before the sector is written, as long as wait() waits for it.
+	void (*write_sector)(void *context, uint32_t offset, const void *data);
+	//Waits until the sector passed to write_sector() has been written
+	void (*wait)(void *context);
+	//Returns the memory-mapped contents of the FLASH at the specified offset
+	const void *(*map)(void *context, uint32_t offset);
+	void *context;
+} flash_writer_backend;
+
+typedef struct
+{
+	const flash_writer_backend *backend;
+	uint32_t base, capacity;
+	uint32_t written;	//Total amount of data passed to flash_writer_write()
+	uint32_t crc;	//CRC32 of the written data
+	uint8_t *buffers[2];
+	int active, fill;	//Buffer being filled
+	int pending;	//Buffer being written by the backend, -1 if none
+	uint32_t next_offset, pending_offset;
+	bool failed;
+} flash_writer;
+
+//'buffers' must hold 2 sectors and stay valid until flash_writer_finish() returns
+void flash_writer_begin(flash_writer *writer, const flash_writer_backend *backend, uint32_t base, uint32_t capacity, void *buffers);
+bool flash_writer_write(flash_writer *writer, const void *data, uint32_t size);
+
+//Writes the last (partial) sector padded with 0xFF and waits for the backend. Returns false if any sector failed to program.
+bool flash_writer_finish(flash_writer *writer);
+
+//Same CRC32 as used by zlib/gzip. Pass 0 as the initial value.
+uint32_t flash_writer_crc32(uint32_t crc, const void *data, uint32_t size);
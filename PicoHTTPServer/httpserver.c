@@ -1,142 +1,716 @@
+#include <ctype.h>
 #include <stdarg.h>
 #include <pico/cyw43_arch.h>
 #include <pico/stdlib.h>
+#include <hardware/regs/addressmap.h>
 
 #include <lwip/ip4_addr.h>
 #include <lwip/netif.h>
 #include <lwip/sockets.h>
+#include <lwip/tcp.h>
+#include <lwip/tcpip.h>
 
 #include <FreeRTOS.h>
+#include <queue.h>
 #include <semphr.h>
 #include <task.h>
 
 #include "debug_printf.h"
 #include "httpserver.h"
 
+//How long an idle persistent connection is kept open while waiting for the next request
+#ifndef HTTP_SERVER_KEEPALIVE_TIMEOUT_MS
+#define HTTP_SERVER_KEEPALIVE_TIMEOUT_MS 5000
+#endif
+
+/* Browsers keep several idle connections open, each of them holding a worker. Once other connections are waiting for a worker,
+ * an idle connection is closed if it does not send the next request within this time (see wait_for_next_request()). */
+#ifndef HTTP_SERVER_BUSY_KEEPALIVE_TIMEOUT_MS
+#define HTTP_SERVER_BUSY_KEEPALIVE_TIMEOUT_MS 250
+#endif
+
+/* Once the first byte of a request has arrived, the rest of the request line and the headers must arrive within this time.
+ * A new connection must also send its first request within this time. Trickling the headers does not extend it. */
+#ifndef HTTP_SERVER_HEADER_TIMEOUT_MS
+#define HTTP_SERVER_HEADER_TIMEOUT_MS 5000
+#endif
+
+/* Each part of the request body must arrive within HTTP_SERVER_BODY_TIMEOUT_MS after the previous one. On top of that, the client
+ * gets HTTP_SERVER_BODY_TIMEOUT_MS plus 1 second per HTTP_SERVER_MIN_BODY_RATE bytes actually received for the entire body,
+ * so trickling the body does not extend the deadline, regardless of the declared Content-Length. */
+#ifndef HTTP_SERVER_BODY_TIMEOUT_MS
+#define HTTP_SERVER_BODY_TIMEOUT_MS 5000
+#endif
+
+#ifndef HTTP_SERVER_MIN_BODY_RATE
+#define HTTP_SERVER_MIN_BODY_RATE 4096
+#endif
+
+//Sending fails if the client does not accept any data (i.e. keeps its receive window closed) for this long
+#ifndef HTTP_SERVER_SEND_TIMEOUT_MS
+#define HTTP_SERVER_SEND_TIMEOUT_MS 10000
+#endif
+
+//WebSocket clients that send nothing for this long get pinged, and are disconnected if they do not answer within the same time
+#ifndef HTTP_SERVER_WEBSOCKET_PING_INTERVAL_MS
+#define HTTP_SERVER_WEBSOCKET_PING_INTERVAL_MS 30000
+#endif
+
+//Requests with a larger body are rejected with '413 Payload Too Large', unless the zone allows more (see http_server_set_zone_max_body_size())
+#ifndef HTTP_SERVER_MAX_BODY_SIZE
+#define HTTP_SERVER_MAX_BODY_SIZE 16384
+#endif
+
+//Maximum number of requests served over one connection before the server closes it
+#ifndef HTTP_SERVER_MAX_REQUESTS_PER_CONNECTION
+#define HTTP_SERVER_MAX_REQUESTS_PER_CONNECTION 100
+#endif
+
+//Stack size and priority of the worker tasks created by http_server_create()
+#ifndef HTTP_SERVER_WORKER_STACK_SIZE
+#define HTTP_SERVER_WORKER_STACK_SIZE configMINIMAL_STACK_SIZE
+#endif
+
+#ifndef HTTP_SERVER_WORKER_PRIORITY
+#define HTTP_SERVER_WORKER_PRIORITY (tskIDLE_PRIORITY + 2)
+#endif
+
+/* Cores the HTTP tasks can run on with the SMP kernel (e.g. 0x2 keeps them off core 0 running the network stack).
+ * With HTTP_SERVER_PIN_WORKERS, each worker is pinned to one of these cores in turn, instead of migrating between them. */
+#ifndef HTTP_SERVER_CORE_AFFINITY
+#define HTTP_SERVER_CORE_AFFINITY tskNO_AFFINITY
+#endif
+
+#ifndef HTTP_SERVER_PIN_WORKERS
+#define HTTP_SERVER_PIN_WORKERS 0
+#endif
+
+/* If the queue of accepted connections stays full (i.e. all workers are busy) for this long, new connections are answered
+ * with '503 Service Unavailable' and closed, so that the clients fail fast instead of waiting in the listen backlog.
+ * The time is counted from the first connection that found the queue full, so the following ones are shed without waiting.
+ * Set to -1 to wait forever. The raw API backend accepts connections on the tcpip thread, so it never waits. */
+#ifndef HTTP_SERVER_ADMISSION_TIMEOUT_MS
+#define HTTP_SERVER_ADMISSION_TIMEOUT_MS 1000
+#endif
+
+/* Requests whose lane has no free slot (see http_server_set_lane_limits()) wait in the queue of the lane without holding a worker.
+ * Each waiting request keeps the connection object it was parsed into, so this many spare objects (including the buffers) are allocated
+ * by http_server_create() in addition to the ones owned by the workers. Requests that find all of them taken get '503 Service Unavailable'. */
+#ifndef HTTP_SERVER_MAX_QUEUED_REQUESTS
+#define HTTP_SERVER_MAX_QUEUED_REQUESTS 4
+#endif
+
+//Value of the Retry-After header (in seconds) sent with the 503 replies
+#ifndef HTTP_SERVER_RETRY_AFTER
+#define HTTP_SERVER_RETRY_AFTER "2"
+#endif
+
+/* When enabled, all clients are served by a single task multiplexing the sockets via select()
+ * instead of the worker pool. The max_thread_count argument of http_server_create() is ignored in this mode. */
+#ifndef HTTP_SERVER_MULTIPLEXED
+#define HTTP_SERVER_MULTIPLEXED 0
+#endif
+
+#if HTTP_SERVER_MULTIPLEXED
+//Maximum number of simultaneously connected clients
+#ifndef HTTP_SERVER_MAX_CONNECTIONS
+#define HTTP_SERVER_MAX_CONNECTIONS 16
+#endif
+
+//Per-client buffer holding the path and the header line being received. Longer header lines are skipped.
+#ifndef HTTP_SERVER_CLIENT_BUFFER_SIZE
+#define HTTP_SERVER_CLIENT_BUFFER_SIZE 384
+#endif
+
+#ifndef HTTP_SERVER_SEND_CHUNK_SIZE
+#define HTTP_SERVER_SEND_CHUNK_SIZE (2 * TCP_MSS)
+#endif
+#endif
+
+//Extra headers that can be added to a single reply via http_server_add_reply_header()
+#ifndef HTTP_SERVER_MAX_REPLY_HEADERS
+#define HTTP_SERVER_MAX_REPLY_HEADERS 6
+#endif
+
+//RFC 2046 limits the multipart boundary to 70 characters
+#define HTTP_MULTIPART_MAX_BOUNDARY 70
+
+//Request headers that can be declared via http_server_capture_request_headers() (in total for the server)
+#ifndef HTTP_SERVER_MAX_CAPTURED_HEADERS
+#define HTTP_SERVER_MAX_CAPTURED_HEADERS 4
+#endif
+
+//Maximum size of a single server-sent event, including the 'event:' and 'data:' prefixes
+#ifndef HTTP_SERVER_EVENT_BUFFER_SIZE
+#define HTTP_SERVER_EVENT_BUFFER_SIZE 1024
+#endif
+
+//Connections held by event sources in addition to the ones served by the workers (only used to size the raw API link pool)
+#ifndef HTTP_SERVER_MAX_EVENT_SUBSCRIBERS
+#define HTTP_SERVER_MAX_EVENT_SUBSCRIBERS 4
+#endif
+
+/* When enabled, the server uses the lwIP raw TCP API (tcp_accept()/tcp_recv()/tcp_write()) instead of sockets,
+ * parsing the request headers directly from the received pbufs. Requests are still handled by the worker pool. */
+#ifndef HTTP_SERVER_USE_RAW_API
+#define HTTP_SERVER_USE_RAW_API 0
+#endif
+
+#if HTTP_SERVER_USE_RAW_API
+#if HTTP_SERVER_MULTIPLEXED
+#error The multiplexed mode requires the socket API
+#endif
+#if !LWIP_TCPIP_CORE_LOCKING
+#error The raw API backend requires LWIP_TCPIP_CORE_LOCKING
+#endif
+typedef struct http_raw_link *http_link;
+#define HTTP_WAKEUP_LINK NULL
+#else
+typedef int http_link;
+#define HTTP_WAKEUP_LINK (-1)
+#endif
+
 struct _http_server_instance
 {
+#if HTTP_SERVER_USE_RAW_API
+	struct tcp_pcb *listen_pcb;
+	struct http_raw_link *links;
+	int link_count;
+#else
 	int socket;
+#endif
 	int buffer_size;
 	const char *hostname;
 	const char *domain_name;
-	xSemaphoreHandle semaphore;
-	http_zone *first_zone;
+#if HTTP_SERVER_MULTIPLEXED
+	struct http_client *clients;
+#else
+	xQueueHandle connection_queue;	//Accepted connections waiting for a free worker (or HTTP_WAKEUP_LINK)
+	int max_workers;
+	bool wakeup_queued;	//HTTP_WAKEUP_LINK is in the connection queue
+	
+	//Protected by a critical section, same as the statistics
+	struct
+	{
+		int limit, running;
+		UBaseType_t priority;
+		struct _http_connection *queue_head, *queue_tail;	//Parsed requests waiting for a free slot
+	} lanes[HTTP_LANE_COUNT];
+	struct _http_connection *spare_connections;	//Connection objects not owned by a worker or a queued request
+#endif
+	
+	//Zones sorted by prefix (see compare_zone_prefix())
+	http_zone **zones;
+	int zone_count, zone_capacity;
+	xSemaphoreHandle zone_lock;
+	
+	//Headers declared via http_server_capture_request_headers(). Only appended to, so the parsers read it without locking.
+	struct
+	{
+		const char *name;
+		int len;
+	} captured_headers[HTTP_SERVER_MAX_CAPTURED_HEADERS];
+	int captured_header_count;
 };
 
 struct _http_connection
 {
 	http_server_instance server;
-	int socket;
+	http_link link;
 	size_t buffered_size;
+	bool keep_alive;
+	bool discard_body;	//Replying to a HEAD request
+	bool chunked_allowed;	//The client understands the chunked transfer encoding (HTTP/1.1)
+	bool chunked;	//The reply being written uses the chunked encoding
+	bool detached;	//The link was handed over to an event source and must not be closed
+	bool nodelay;	//Nagle's algorithm was disabled via http_server_set_nodelay() while handling the current request
+	const char *websocket_key;	//Only valid while handling a HTTP_WEBSOCKET request
+	const struct http_request_headers *request_headers;	//Only valid while the handler is running
+	struct
+	{
+		const char *name, *value;
+	} reply_headers[HTTP_SERVER_MAX_REPLY_HEADERS];
+	int reply_header_count;
+	size_t chunk_start;	//Offset of the chunk size placeholder in the buffer
+#if HTTP_SERVER_MULTIPLEXED
+	struct http_client *client;	//Client whose request is being handled
+#else
+	struct http_request_parser *parser;	//Allocated together with the connection, as it would take a large part of the worker stack
+	struct _http_connection *next;	//Next queued request of the same lane, or the next spare object
+	enum http_lane lane;	//Lane of the request being handled
+	int requests_served;	//Requests received over the current connection so far
+#endif
 	struct
 	{
 		int buffer_used, buffer_pos;
 		int remaining_input_len;
 		int offset_from_main_buffer;
+		TickType_t start_time, last_received;
+		uint32_t received;
 	} post;
 	
 	char buffer[1];
 };
 
-//Receive at least one line into the buffer. Return the total size of received data.
-static int recv_line(int socket, char *buffer, int buffer_size)
+//Data in the XIP FLASH region stays valid after the handler returns, so it can be sent asynchronously
+static inline bool is_persistent_data(const void *data)
+{
+	return (uintptr_t)data >= XIP_BASE && (uintptr_t)data < SRAM_BASE;
+}
+
+static http_server_stats s_Stats;
+
+//The counters are updated by multiple workers (possibly on both cores), so the increments must not interleave
+static void count_event(uint32_t *counter)
+{
+	taskENTER_CRITICAL();
+	(*counter)++;
+	taskEXIT_CRITICAL();
+}
+
+void http_server_get_stats(http_server_stats *stats)
+{
+	taskENTER_CRITICAL();
+	*stats = s_Stats;
+	taskEXIT_CRITICAL();
+}
+
+//Sent as is, so that shedding a connection does not need a worker, a buffer or any formatting
+static const char s_ServiceUnavailableReply[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " HTTP_SERVER_RETRY_AFTER "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+#if !HTTP_SERVER_MULTIPLEXED
+//Hands the connection over to the workers. Returns false if the queue stayed full for the specified time.
+static bool enqueue_connection(xQueueHandle queue, http_link link, TickType_t timeout)
 {
-	int buffer_done = 0;
-	while (buffer_done < buffer_size)
+	count_event(&s_Stats.queued_connections);
+	if (xQueueSend(queue, &link, timeout) != pdTRUE)
 	{
-		int done = recv(socket, buffer, buffer_size - buffer_done, 0);
-		if (done <= 0)
-			return 0;
-		
-		buffer_done += done;
-		char *p = strnstr(buffer, "\r\n", buffer_done);
-		if (p)
-			return buffer_done;
+		taskENTER_CRITICAL();
+		s_Stats.queued_connections--;
+		taskEXIT_CRITICAL();
+		return false;
 	}
 	
-	return 0;
+	taskENTER_CRITICAL();
+	s_Stats.max_queued_connections = MAX(s_Stats.max_queued_connections, s_Stats.queued_connections);
+	taskEXIT_CRITICAL();
+	return true;
 }
+#endif
 
-//Read next line using the buffer (multiple lines can be buffered at once).
-//If the line was too long to fit into the buffer, returned length will be negative, but the next line will still get found correctly.
-static char *recv_next_line_buffered(int socket, char *buffer, int buffer_size, int *buffer_used, int *offset, int *len, int *recv_limit)
+//Returns the time left until the deadline in milliseconds, or 0 if it has passed
+static int ms_until(TickType_t deadline)
 {
-	int skipped_len = 0;
-	if (*offset > *buffer_used)
-		return NULL;
+	int ticks = (int)(deadline - xTaskGetTickCount());
+	return ticks > 0 ? MAX(ticks * portTICK_PERIOD_MS, 1) : 0;
+}
+
+#if HTTP_SERVER_USE_RAW_API
+
+/* With the raw API backend, lwIP invokes the callbacks below directly from the tcpip thread.
+ * Received pbufs are queued in the link and consumed by the worker task, that calls the raw API
+ * while holding the core lock instead of posting a message to the tcpip thread for every operation. */
+struct http_raw_link
+{
+	struct tcp_pcb *pcb;	//NULL once the connection has been closed or reset
+	struct pbuf *rx;	//Received data that has not been consumed yet
+	bool in_use;
+	bool remote_closed;
+	int recv_timeout_ms;	//0 if link_recv() should wait forever
+	xSemaphoreHandle event;	//Given when new data arrives, sent data gets acknowledged, or the connection fails
+};
+
+static err_t raw_link_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+	http_link link = (http_link)arg;
+	if (!p)
+		link->remote_closed = true;
+	else if (link->rx)
+		pbuf_cat(link->rx, p);
+	else
+		link->rx = p;
+	
+	xSemaphoreGive(link->event);
+	return ERR_OK;
+}
+
+static err_t raw_link_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+	http_link link = (http_link)arg;
+	xSemaphoreGive(link->event);
+	return ERR_OK;
+}
+
+static void raw_link_error(void *arg, err_t err)
+{
+	http_link link = (http_link)arg;
+	link->pcb = NULL;	//lwIP has already freed the PCB
+	xSemaphoreGive(link->event);
+}
+
+static void raw_link_detach(http_link link)
+{
+	tcp_arg(link->pcb, NULL);
+	tcp_recv(link->pcb, NULL);
+	tcp_sent(link->pcb, NULL);
+	tcp_err(link->pcb, NULL);
+}
+
+/* Queues the 503 reply and closes the sending side. The request is discarded by the default receive callback (tcp_recv_null()),
+ * that also closes the PCB once the client closes its side. Until then, lwIP can reclaim the PCB before any others if it runs out of them. */
+static err_t raw_shed_connection(struct tcp_pcb *pcb)
+{
+	count_event(&s_Stats.shed_connections);
+	tcp_setprio(pcb, TCP_PRIO_MIN);
+	
+	u8_t write_flags = is_persistent_data(s_ServiceUnavailableReply) ? 0 : TCP_WRITE_FLAG_COPY;
+	if (tcp_write(pcb, s_ServiceUnavailableReply, sizeof(s_ServiceUnavailableReply) - 1, write_flags) != ERR_OK || tcp_shutdown(pcb, 0, 1) != ERR_OK)
+	{
+		tcp_abort(pcb);
+		return ERR_ABRT;
+	}
+	
+	return ERR_OK;
+}
+
+static err_t raw_link_accept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+	http_server_instance server = (http_server_instance)arg;
+	if (err != ERR_OK || !pcb)
+		return ERR_VAL;
+	
+	http_link link = NULL;
+	for (int i = 0; i < server->link_count && !link; i++)
+		if (!server->links[i].in_use)
+			link = &server->links[i];
+	
+	if (!link)
+		return raw_shed_connection(pcb);
+	
+	link->in_use = true;
+	link->pcb = pcb;
+	link->rx = NULL;
+	link->remote_closed = false;
+	link->recv_timeout_ms = HTTP_SERVER_KEEPALIVE_TIMEOUT_MS;
+	xSemaphoreTake(link->event, 0);
+	
+	tcp_arg(pcb, link);
+	tcp_recv(pcb, raw_link_recv);
+	tcp_sent(pcb, raw_link_sent);
+	tcp_err(pcb, raw_link_error);
+	
+	if (!enqueue_connection(server->connection_queue, link, 0))
+	{
+		raw_link_detach(link);
+		link->pcb = NULL;
+		link->in_use = false;
+		return raw_shed_connection(pcb);
+	}
+	
+	return ERR_OK;
+}
+
+static bool raw_link_listen(http_server_instance server, int backlog)
+{
+	LOCK_TCPIP_CORE();
+	struct tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+	err_t err = pcb ? tcp_bind(pcb, IP_ANY_TYPE, 80) : ERR_MEM;
+	if (err == ERR_OK)
+		server->listen_pcb = tcp_listen_with_backlog(pcb, backlog);
+	if (pcb && !server->listen_pcb)
+		tcp_close(pcb);	//tcp_listen() only frees the original PCB when it succeeds
+	
+	if (server->listen_pcb)
+	{
+		tcp_arg(server->listen_pcb, server);
+		tcp_accept(server->listen_pcb, raw_link_accept);
+	}
+	
+	UNLOCK_TCPIP_CORE();
+	
+	if (!server->listen_pcb)
+		debug_printf("Unable to listen on HTTP port: error %d\n", err);
+	
+	return server->listen_pcb != NULL;
+}
+
+//Waits until the link has some unread data. Returns false if the connection was closed or the timeout expired.
+static bool raw_link_wait_for_data(http_link link, int timeout_ms)
+{
+	TimeOut_t timeout;
+	TickType_t ticks_left = timeout_ms ? pdMS_TO_TICKS(timeout_ms) : portMAX_DELAY;
+	vTaskSetTimeOutState(&timeout);
 	
 	for (;;)
 	{
-		char *start = buffer + *offset;
-		char *limit = buffer + *buffer_used;
-		char *p = strnstr(start, "\r\n", limit - start);
-		if (p)
+		if (link->rx)
+			return true;
+		if (!link->pcb || link->remote_closed)
+			return false;
+		
+		//The event is also given when sent data is acknowledged, so the time left is tracked across the wakeups
+		if (xTaskCheckForTimeOut(&timeout, &ticks_left) != pdFALSE || xSemaphoreTake(link->event, ticks_left) != pdTRUE)
+			return false;
+	}
+}
+
+//Returns 1 if the link has some unread data, 0 if the timeout expired, or -1 if the connection was closed
+static int link_wait_for_data(http_link link, int timeout_ms)
+{
+	if (raw_link_wait_for_data(link, timeout_ms))
+		return 1;
+	return (!link->pcb || link->remote_closed) ? -1 : 0;
+}
+
+//Detaches the received data from the link, so that it can be processed without holding the core lock
+static struct pbuf *raw_link_take_data(http_link link)
+{
+	LOCK_TCPIP_CORE();
+	struct pbuf *p = link->rx;
+	link->rx = NULL;
+	UNLOCK_TCPIP_CORE();
+	return p;
+}
+
+//Puts the unprocessed part of the data back and lets lwIP reopen the receive window for the processed part
+static void raw_link_return_data(http_link link, struct pbuf *p, int consumed)
+{
+	LOCK_TCPIP_CORE();
+	p = pbuf_free_header(p, consumed);
+	if (p)
+	{
+		if (link->rx)
+			pbuf_cat(p, link->rx);
+		link->rx = p;
+	}
+	
+	if (link->pcb && consumed)
+		tcp_recved(link->pcb, consumed);
+	UNLOCK_TCPIP_CORE();
+}
+
+static int raw_link_copy_data(http_link link, char *buffer, int size)
+{
+	struct pbuf *p = raw_link_take_data(link);
+	int done = pbuf_copy_partial(p, buffer, MIN(size, p->tot_len), 0);
+	raw_link_return_data(link, p, done);
+	return done;
+}
+
+static int link_recv(http_link link, char *buffer, int size)
+{
+	if (!raw_link_wait_for_data(link, link->recv_timeout_ms))
+		return 0;
+	
+	return raw_link_copy_data(link, buffer, size);
+}
+
+//Returns false if the connection was closed, or the deadline has passed (that gets counted as a timeout)
+static bool raw_link_wait_until(http_link link, TickType_t deadline, uint32_t *timeouts)
+{
+	int timeout_ms = ms_until(deadline);
+	if (timeout_ms && raw_link_wait_for_data(link, timeout_ms))
+		return true;
+	
+	if (link->pcb && !link->remote_closed)
+		count_event(timeouts);
+	return false;
+}
+
+//Same as link_recv(), but fails once the deadline passes and counts it as a timeout
+static int link_recv_until(http_link link, char *buffer, int size, TickType_t deadline, uint32_t *timeouts)
+{
+	if (!raw_link_wait_until(link, deadline, timeouts))
+		return -1;
+	
+	return raw_link_copy_data(link, buffer, size);
+}
+
+//Passing MSG_MORE only queues the data, so that it can go out in the same segment as the data sent next
+static bool send_all(http_link link, const char *buf, int size, int flags)
+{
+	while (size > 0)
+	{
+		int todo = 0;
+		err_t err = ERR_CLSD;
+		
+		LOCK_TCPIP_CORE();
+		if (link->pcb)
 		{
-			*p = 0;
-			*offset = p + 2 - buffer;
-			if (skipped_len)
-				*len = -(p - start + skipped_len);
-			else
-				*len = p - start;
-			return start;
+			/* Data in the FLASH memory stays valid until the remote side acknowledges it, so the segments can reference it
+			 * directly instead of copying it into the lwIP heap (see LWIP_NETIF_TX_SINGLE_PBUF in lwipopts.h). */
+			u8_t write_flags = is_persistent_data(buf) ? 0 : TCP_WRITE_FLAG_COPY;
+			if (flags & MSG_MORE)
+				write_flags |= TCP_WRITE_FLAG_MORE;
+			
+			todo = MIN(size, tcp_sndbuf(link->pcb));
+			err = todo ? tcp_write(link->pcb, buf, todo, write_flags) : ERR_MEM;
+			if (err != ERR_OK || !(flags & MSG_MORE))
+				tcp_output(link->pcb);	//Also sends out the queued data before waiting for the buffer space
 		}
+		UNLOCK_TCPIP_CORE();
 		
-		if (*offset == 0 && buffer_size == *buffer_used)
+		if (err == ERR_OK)
 		{
-			/* The length of this line exceeds the entire buffer.
-			 * Discard the buffer contents and continue searching for the end-of-line.*/
-
-			buffer[0] = buffer[buffer_size - 1];
-			*buffer_used = (buffer[0] == '\r') ? 1 : 0;
-			skipped_len = buffer_size - *buffer_used;
-			*offset = 0;	
+			buf += todo;
+			size -= todo;
 		}
-		else if (start < limit && start > buffer)
+		else if (err != ERR_MEM)
+			return false;
+		else if (xSemaphoreTake(link->event, pdMS_TO_TICKS(HTTP_SERVER_SEND_TIMEOUT_MS)) != pdTRUE)
 		{
-			memmove(buffer, start, limit - start);
-			*buffer_used -= *offset;
-			*offset = 0;
+			/* No buffer space got freed up within the timeout. Unlike the socket API (see the comment in the socket-based send_all()),
+			 * this cannot stall the connection forever: the worker gives up and closing the connection releases its memory. */
+			count_event(&s_Stats.send_timeouts);
+			return false;
 		}
-		
-		int buffer_avail = buffer_size - *buffer_used;
-		if (recv_limit)
-			buffer_avail = MIN(buffer_avail, *recv_limit);
-		
-		if (buffer_avail <= 0)
-			return NULL;
-		
-		int done = recv(socket, buffer + *buffer_used, buffer_avail, 0);
-		if (done <= 0)
-			return NULL;
-		
-		if (recv_limit)
-			*recv_limit -= done;
-		
-		*buffer_used += done;		
 	}
+	
+	return true;
 }
 
-static bool host_name_matches(http_connection ctx, char *host)
+//Queues the header before sending the content, so that small replies fit into a single segment. Returns the number of bytes sent.
+//Replies without content (e.g. HEAD or 304) are flushed right after the header.
+static int send_header_and_content(http_link link, const char *header, int header_size, const char *content, int size, int flags)
 {
-	int len = strlen(ctx->server->hostname);
-	if (strncasecmp(host, ctx->server->hostname, len))
-		return false;
-	
-	if (!host[len])
-		return true;	//Host name without domain
+	if (!send_all(link, header, header_size, size ? MSG_MORE : flags) || !send_all(link, content, size, flags))
+		return -1;
+	return header_size + size;
+}
+
+static void set_receive_timeout(http_link link, int timeout_ms)
+{
+	link->recv_timeout_ms = timeout_ms;
+}
+
+//Sends all data without waiting, or nothing if there is not enough buffer space
+static bool link_try_send(http_link link, const char *buf, int size)
+{
+	bool done = false;
+	LOCK_TCPIP_CORE();
+	if (link->pcb && tcp_sndbuf(link->pcb) >= size && tcp_write(link->pcb, buf, size, TCP_WRITE_FLAG_COPY) == ERR_OK)
+	{
+		tcp_output(link->pcb);
+		done = true;
+	}
+	UNLOCK_TCPIP_CORE();
+	return done;
+}
+
+static void set_nodelay(http_link link, bool nodelay)
+{
+	LOCK_TCPIP_CORE();
+	if (link->pcb)
+	{
+		if (nodelay)
+			tcp_nagle_disable(link->pcb);
+		else
+			tcp_nagle_enable(link->pcb);
+	}
+	UNLOCK_TCPIP_CORE();
+}
+
+static void link_close(http_link link)
+{
+	LOCK_TCPIP_CORE();
+	if (link->pcb)
+	{
+		raw_link_detach(link);
+		if (tcp_close(link->pcb) != ERR_OK)
+			tcp_abort(link->pcb);
+		link->pcb = NULL;
+	}
 	
-	if (host[len] == '.' && !strcasecmp(host + len + 1, ctx->server->domain_name))
-		return true;	//Host name with domain
+	if (link->rx)
+		pbuf_free(link->rx);
+	link->rx = NULL;
+	link->in_use = false;
+	UNLOCK_TCPIP_CORE();
+}
+
+#else
+
+static inline int link_recv(http_link link, char *buffer, int size)
+{
+	return recv(link, buffer, size, 0);
+}
+
+static inline void link_close(http_link link)
+{
+	closesocket(link);
+}
+
+static void set_socket_timeout(int socket, int option, int timeout_ms)
+{
+	struct timeval timeout = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_usec = (timeout_ms % 1000) * 1000,
+	};
 	
-	return false;
+	setsockopt(socket, SOL_SOCKET, option, &timeout, sizeof(timeout));
 }
 
-static bool send_all(int socket, const char *buf, int size)
+#if !HTTP_SERVER_MULTIPLEXED
+//Returns 1 if the socket has some unread data, 0 if the timeout expired, or -1 if the connection was closed. The data is left in the socket.
+static int link_wait_for_data(int socket, int timeout_ms)
 {
-	while (size > 0)
-	{
-#if MEM_SIZE < 16384
-		/*	As of SDK 1.4.0, lwIP running out of memory to allocate a network buffer on TCP send
+	char tmp;
+	set_socket_timeout(socket, SO_RCVTIMEO, timeout_ms);
+	int done = recv(socket, &tmp, 1, MSG_PEEK);
+	if (done > 0)
+		return 1;
+	return (done < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) ? 0 : -1;
+}
+#endif
+
+static void set_receive_timeout(int socket, int timeout_ms)
+{
+	set_socket_timeout(socket, SO_RCVTIMEO, timeout_ms);
+}
+
+//Answers the connection with the 503 reply without waiting for anything
+static void shed_connection(int socket)
+{
+	//Reading the part of the request that has already arrived lets lwIP close the connection gracefully instead of resetting it
+	char discarded[64];
+	while (recv(socket, discarded, sizeof(discarded), MSG_DONTWAIT) > 0)
+	{
+	}
+	
+	send(socket, s_ServiceUnavailableReply, sizeof(s_ServiceUnavailableReply) - 1, MSG_DONTWAIT);
+	closesocket(socket);
+	count_event(&s_Stats.shed_connections);
+}
+
+//Limits blocking sends, so that a client that stops reading the reply does not hold the worker forever
+static void set_send_timeout(int socket, int timeout_ms)
+{
+	set_socket_timeout(socket, SO_SNDTIMEO, timeout_ms);
+}
+
+//Same as link_recv(), but fails once the deadline passes and counts it as a timeout
+static int link_recv_until(http_link link, char *buffer, int size, TickType_t deadline, uint32_t *timeouts)
+{
+	int timeout_ms = ms_until(deadline);
+	if (timeout_ms)
+	{
+		set_receive_timeout(link, timeout_ms);
+		int done = recv(link, buffer, size, 0);
+		if (done >= 0 || (errno != EWOULDBLOCK && errno != EAGAIN))
+			return done;
+	}
+	
+	count_event(timeouts);
+	return -1;
+}
+
+//MSG_MORE is forwarded to lwIP, so that the segment is not pushed to the application on the remote side yet
+static bool send_all(int socket, const char *buf, int size, int flags)
+{
+	while (size > 0)
+	{
+#if MEM_SIZE < 16384
+		/*	As of SDK 1.4.0, lwIP running out of memory to allocate a network buffer on TCP send
 		 *	permanently stalls the entire netconn. As it doesn't free up the resources taken by
 		 *	that netconn, the effect quickly snowballs, rendering the entire network stack unusable:
 		 *	
@@ -156,319 +730,2890 @@ static bool send_all(int socket, const char *buf, int size)
 		 **/
 #error Too little memory allocated for lwIP buffers.
 #endif
-		int done = send(socket, buf, size, 0);
+		int done = send(socket, buf, size, flags);
+		if (done <= 0)
+		{
+			if (done < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+				count_event(&s_Stats.send_timeouts);	//SO_SNDTIMEO expired
+			return false;
+		}
+		
+		buf += done;
+		size -= done;
+	}
+	
+	return true;
+}
+
+/* Sends the header and the content with one call, so that lwIP can put small replies into a single segment
+ * instead of sending the header on its own. Returns the number of bytes sent, that can be less than requested
+ * with MSG_DONTWAIT. */
+static int send_header_and_content(int socket, const char *header, int header_size, const char *content, int size, int flags)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = (void *)header, .iov_len = header_size },
+		{ .iov_base = (void *)content, .iov_len = size },
+	};
+	
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = size ? 2 : 1,
+	};
+	
+	return sendmsg(socket, &msg, flags);
+}
+
+//Sends the data without waiting. Returns false if it could not be sent in full, leaving the stream in an undefined state.
+static bool link_try_send(int socket, const char *buf, int size)
+{
+	return send(socket, buf, size, MSG_DONTWAIT) == size;
+}
+
+static void set_nodelay(int socket, bool nodelay)
+{
+	int value = nodelay;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+}
+
+#endif
+
+/* Returns the first '\n' between p and end, or NULL. Most of the request is header text without line breaks,
+ * so we check 4 bytes at a time (a byte of x is 0 iff the corresponding byte of the word equals '\n'). */
+static char *find_newline(char *p, char *end)
+{
+	for (; p < end && ((uintptr_t)p & 3); p++)
+		if (*p == '\n')
+			return p;
+	
+	for (; (end - p) >= 4; p += 4)
+	{
+		uint32_t x;
+		memcpy(&x, p, 4);
+		x ^= 0x0A0A0A0A;
+		if ((x - 0x01010101) & ~x & 0x80808080)
+			break;
+	}
+	
+	for (; p < end; p++)
+		if (*p == '\n')
+			return p;
+	
+	return NULL;
+}
+
+//Receives the next part of the request body, failing if the client is sending it too slowly (see HTTP_SERVER_BODY_TIMEOUT_MS)
+static int recv_body(http_connection conn, char *buffer, int size)
+{
+	//The received amount is limited by the zone's maximum body size, so the credit it earns cannot overflow
+	TickType_t earned = conn->post.start_time + pdMS_TO_TICKS(HTTP_SERVER_BODY_TIMEOUT_MS) + (TickType_t)((uint64_t)conn->post.received * configTICK_RATE_HZ / HTTP_SERVER_MIN_BODY_RATE);
+	TickType_t idle = conn->post.last_received + pdMS_TO_TICKS(HTTP_SERVER_BODY_TIMEOUT_MS);
+	
+	int done = link_recv_until(conn->link, buffer, size, (int)(earned - idle) < 0 ? earned : idle, &s_Stats.body_timeouts);
+	if (done > 0)
+	{
+		conn->post.received += done;
+		conn->post.last_received = xTaskGetTickCount();
+	}
+	
+	return done;
+}
+
+//Read next line using the buffer (multiple lines can be buffered at once).
+//If the line was too long to fit into the buffer, returned length will be negative, but the next line will still get found correctly.
+static char *recv_next_line_buffered(http_connection conn, char *buffer, int buffer_size, int *buffer_used, int *offset, int *len, int *recv_limit)
+{
+	int skipped_len = 0;
+	if (*offset > *buffer_used)
+		return NULL;
+	
+	int scanned = *offset;	//Only the newly received data needs to be searched for the end of line
+	for (;;)
+	{
+		char *start = buffer + *offset;
+		char *limit = buffer + *buffer_used;
+		char *p = find_newline(buffer + scanned, limit);
+		if (p)
+		{
+			*offset = p + 1 - buffer;
+			if (p > start && p[-1] == '\r')
+				p--;
+			*p = 0;
+			if (skipped_len)
+				*len = -(p - start + skipped_len);
+			else
+				*len = p - start;
+			return start;
+		}
+		
+		scanned = *buffer_used;
+		if (*offset == 0 && buffer_size == *buffer_used)
+		{
+			/* The length of this line exceeds the entire buffer.
+			 * Discard the buffer contents and continue searching for the end-of-line.*/
+			skipped_len += buffer_size;
+			*buffer_used = scanned = 0;
+		}
+		else if (start == limit)
+			*buffer_used = *offset = scanned = 0;
+		else if (*buffer_used == buffer_size && start > buffer)
+		{
+			//The incomplete line is only moved once the buffer fills up, so each byte gets moved at most once
+			memmove(buffer, start, limit - start);
+			*buffer_used -= *offset;
+			scanned -= *offset;
+			*offset = 0;
+		}
+		
+		int buffer_avail = buffer_size - *buffer_used;
+		if (recv_limit)
+			buffer_avail = MIN(buffer_avail, *recv_limit);
+		
+		if (buffer_avail <= 0)
+		{
+			if (recv_limit && *recv_limit <= 0 && !skipped_len && *buffer_used > *offset && *buffer_used < buffer_size)
+			{
+				//The last line of a request body does not need to end with a line break (e.g. a URL-encoded form)
+				start = buffer + *offset;
+				*len = *buffer_used - *offset;
+				start[*len] = 0;
+				*offset = *buffer_used;
+				return start;
+			}
+			
+			return NULL;
+		}
+		
+		int done = recv_body(conn, buffer + *buffer_used, buffer_avail);
+		if (done <= 0)
+			return NULL;
+		
+		if (recv_limit)
+			*recv_limit -= done;
+		
+		*buffer_used += done;		
+	}
+}
+
+//Fields extracted from the request headers
+struct http_request_headers
+{
+	char host[32];
+	int content_length;
+	bool keep_alive;
+	bool http11;
+	bool upgrade_websocket;
+	char websocket_key[32];
+	char if_none_match[64];	//Left empty if the header is too long, so that the cached copy is considered stale
+	int accepted_encodings;	//HTTP_ENCODING_xxx
+	bool has_range;	//Only a single 'bytes' range is supported. Multiple ranges are ignored, so the entire entity gets sent.
+	bool range_suffix;	//'bytes=-N' (last N bytes), range_first is N
+	uint32_t range_first, range_last;	//range_last is UINT32_MAX for an open-ended range
+	char if_range[64];
+	char multipart_boundary[HTTP_MULTIPART_MAX_BOUNDARY + 1];	//Only set for multipart request bodies
+	const char *captured[HTTP_SERVER_MAX_CAPTURED_HEADERS];	//Values of the headers declared via http_server_capture_request_headers(), NULL if missing
+};
+
+//Parses the '<method> <path> HTTP/1.x' line (without the CRLF). Returns the path, or NULL if the line is malformed.
+static char *parse_request_line(char *line, enum http_request_type *type, struct http_request_headers *headers)
+{
+	char *p1 = strchr(line, ' '), *p2 = NULL;
+	if (p1)
+		p2 = strchr(++p1, ' ');
+	
+	if (!p2)
+		return NULL;
+	
+	if (!strncasecmp(line, "POST ", 5))
+		*type = HTTP_POST;
+	else if (!strncasecmp(line, "HEAD ", 5))
+		*type = HTTP_HEAD;
+	else
+		*type = HTTP_GET;
+	headers->http11 = !strncmp(p2 + 1, "HTTP/1.1", 8);
+	headers->keep_alive = headers->http11;	//HTTP/1.1 connections are persistent by default
+	*p2 = 0;
+	return p1;
+}
+
+//Parses a list like 'gzip, deflate;q=0.5, br;q=0'. Encodings with a zero quality value are explicitly refused by the client.
+static int parse_accept_encoding(const char *list, const char *end)
+{
+	int result = 0;
+	while (list < end)
+	{
+		while (list < end && (*list == ' ' || *list == ','))
+			list++;
+		
+		const char *name = list;
+		while (list < end && *list != ',' && *list != ';' && *list != ' ')
+			list++;
+		int name_len = list - name;
+		
+		bool refused = false;
+		while (list < end && *list != ',')
+		{
+			if (*list == '=' && list[-1] == 'q')
+			{
+				float q = strtof(list + 1, NULL);
+				refused = q <= 0;
+			}
+			list++;
+		}
+		
+		if (refused)
+			continue;
+		else if (name_len == 4 && !strncasecmp(name, "gzip", 4))
+			result |= HTTP_ENCODING_GZIP;
+		else if (name_len == 2 && !strncasecmp(name, "br", 2))
+			result |= HTTP_ENCODING_BROTLI;
+	}
+	
+	return result;
+}
+
+//Parses 'bytes=first-last', 'bytes=first-' or 'bytes=-suffix'
+static void parse_range(struct http_request_headers *headers, const char *spec, const char *end)
+{
+	char *p;
+	headers->has_range = false;
+	if (strncasecmp(spec, "bytes=", 6) || memchr(spec, ',', end - spec))
+		return;
+	
+	spec += 6;
+	headers->range_suffix = *spec == '-';
+	if (headers->range_suffix)
+		spec++;
+	if (*spec < '0' || *spec > '9')
+		return;
+	
+	headers->range_first = strtoul(spec, &p, 10);
+	headers->range_last = UINT32_MAX;
+	if (headers->range_suffix)
+	{
+		headers->has_range = p == end;
+		return;
+	}
+	
+	if (*p++ != '-')
+		return;
+	if (p < end)
+	{
+		headers->range_last = strtoul(p, &p, 10);
+		if (headers->range_last < headers->range_first)
+			return;
+	}
+	headers->has_range = p == end;
+}
+
+enum http_header_id
+{
+	HTTP_HEADER_HOST,
+	HTTP_HEADER_CONTENT_LENGTH,
+	HTTP_HEADER_CONNECTION,
+	HTTP_HEADER_UPGRADE,
+	HTTP_HEADER_IF_NONE_MATCH,
+	HTTP_HEADER_ACCEPT_ENCODING,
+	HTTP_HEADER_RANGE,
+	HTTP_HEADER_IF_RANGE,
+	HTTP_HEADER_SEC_WEBSOCKET_KEY,
+	HTTP_HEADER_CONTENT_TYPE,
+	HTTP_HEADER_UNKNOWN,
+};
+
+/* Names of the headers parsed by the server, already folded to lowercase. Header names are tokens,
+ * so OR-ing each received character with 0x20 folds it the same way without affecting '-' or digits. */
+static const struct
+{
+	char name[20];
+	uint8_t len;
+} s_KnownHeaders[HTTP_HEADER_UNKNOWN] = {
+	[HTTP_HEADER_HOST] = { "host", 4 },
+	[HTTP_HEADER_CONTENT_LENGTH] = { "content-length", 14 },
+	[HTTP_HEADER_CONNECTION] = { "connection", 10 },
+	[HTTP_HEADER_UPGRADE] = { "upgrade", 7 },
+	[HTTP_HEADER_IF_NONE_MATCH] = { "if-none-match", 13 },
+	[HTTP_HEADER_ACCEPT_ENCODING] = { "accept-encoding", 15 },
+	[HTTP_HEADER_RANGE] = { "range", 5 },
+	[HTTP_HEADER_IF_RANGE] = { "if-range", 8 },
+	[HTTP_HEADER_SEC_WEBSOCKET_KEY] = { "sec-websocket-key", 17 },
+	[HTTP_HEADER_CONTENT_TYPE] = { "content-type", 12 },
+};
+
+static bool header_name_equals(const char *name1, const char *name2, int len)
+{
+	for (int i = 0; i < len; i++)
+		if ((name1[i] | 0x20) != (name2[i] | 0x20))
+			return false;
+	return true;
+}
+
+static enum http_header_id lookup_header_name(const char *name, int len)
+{
+	for (int i = 0; i < HTTP_HEADER_UNKNOWN; i++)
+	{
+		if (s_KnownHeaders[i].len != len)
+			continue;
+		
+		int j = 0;
+		while (j < len && (name[j] | 0x20) == s_KnownHeaders[i].name[j])
+			j++;
+		
+		if (j == len)
+			return (enum http_header_id)i;
+	}
+	
+	return HTTP_HEADER_UNKNOWN;
+}
+
+//Values that don't fit are left empty, so e.g. an overly long If-None-Match never matches
+static void copy_header_value(char *buffer, int buffer_size, const char *value, int len)
+{
+	if (len < (buffer_size - 1))
+	{
+		memcpy(buffer, value, len);
+		buffer[len] = 0;
+	}
+}
+
+//Splits the 'Name: value' line, trimming the whitespace around the value. Returns the length of the name, or -1 if there is no colon.
+static int split_header_line(char *line, int len, char **value, char **end)
+{
+	char *colon = memchr(line, ':', len);
+	if (!colon)
+		return -1;
+	
+	*value = colon + 1;
+	*end = line + len;
+	while (*value < *end && (**value == ' ' || **value == '\t'))
+		(*value)++;
+	while (*end > *value && ((*end)[-1] == ' ' || (*end)[-1] == '\t'))
+		(*end)--;
+	
+	return colon - line;
+}
+
+bool http_server_get_header_param(const char *value, const char *param, char *buffer, int size)
+{
+	int len = strlen(param);
+	for (const char *p = strchr(value, ';'); p; p = strchr(p, ';'))
+	{
+		for (p++; *p == ' ' || *p == '\t'; p++)
+			;
+		
+		if (strncasecmp(p, param, len) || p[len] != '=')
+			continue;
+		
+		p += len + 1;
+		bool quoted = *p == '"';
+		if (quoted)
+			p++;
+		
+		int i = 0;
+		while (*p && (quoted ? (*p != '"') : (*p != ';' && *p != ' ' && *p != '\t')))
+		{
+			if (i == (size - 1))
+			{
+				buffer[0] = 0;
+				return false;	//Does not fit
+			}
+			buffer[i++] = *p++;
+		}
+		
+		buffer[i] = 0;
+		return true;
+	}
+	
+	return false;
+}
+
+static void parse_header_line(struct http_request_headers *headers, const char *name, int name_len, const char *value, const char *end)
+{
+	switch (lookup_header_name(name, name_len))
+	{
+	case HTTP_HEADER_HOST:
+		copy_header_value(headers->host, sizeof(headers->host), value, end - value);
+		break;
+	case HTTP_HEADER_CONTENT_LENGTH:
+		headers->content_length = atoi(value);
+		break;
+	case HTTP_HEADER_CONNECTION:
+		if (!strncasecmp(value, "close", 5))
+			headers->keep_alive = false;
+		else if (!strncasecmp(value, "keep-alive", 10))
+			headers->keep_alive = true;
+		break;
+	case HTTP_HEADER_UPGRADE:
+		headers->upgrade_websocket = !strncasecmp(value, "websocket", 9);
+		break;
+	case HTTP_HEADER_IF_NONE_MATCH:
+		copy_header_value(headers->if_none_match, sizeof(headers->if_none_match), value, end - value);
+		break;
+	case HTTP_HEADER_ACCEPT_ENCODING:
+		headers->accepted_encodings = parse_accept_encoding(value, end);
+		break;
+	case HTTP_HEADER_RANGE:
+		parse_range(headers, value, end);
+		break;
+	case HTTP_HEADER_IF_RANGE:
+		copy_header_value(headers->if_range, sizeof(headers->if_range), value, end - value);
+		break;
+	case HTTP_HEADER_SEC_WEBSOCKET_KEY:
+		copy_header_value(headers->websocket_key, sizeof(headers->websocket_key), value, end - value);
+		break;
+	case HTTP_HEADER_CONTENT_TYPE:
+		if (!strncasecmp(value, "multipart/", 10))
+			http_server_get_header_param(value, "boundary", headers->multipart_boundary, sizeof(headers->multipart_boundary));
+		break;
+	default:
+		break;
+	}
+}
+
+enum http_parser_state
+{
+	HTTP_PARSER_REQUEST_LINE,
+	HTTP_PARSER_HEADERS,
+	HTTP_PARSER_DONE,
+	HTTP_PARSER_ERROR,
+};
+
+/* Incremental request parser. The request can be received in fragments of any size, either directly into
+ * the free part of the parser buffer (http_parser_get_free_space() + http_parser_commit()) or via http_parser_feed().
+ * Each byte is scanned for the end of line only once, and complete lines are parsed in place. Only the path is kept
+ * after the request line has been parsed, and the partial line is moved next to it once the buffer fills up.
+ * Header lines that don't fit into the buffer are skipped, same as in recv_next_line_buffered(). */
+typedef struct http_request_parser
+{
+	enum http_parser_state state;
+	enum http_request_type type;
+	struct http_request_headers headers;
+	char *path;
+	int header_start;	//Header lines are stored after the path
+	int line_start, scan_pos, data_end;	//After the headers have been parsed, the data between line_start and data_end is the beginning of the body
+	bool line_truncated;
+	int buffer_size;
+	char *buffer;
+	http_server_instance server;
+} http_request_parser;
+
+static void http_parser_reset(http_request_parser *parser, http_server_instance server, char *buffer, int buffer_size)
+{
+	memset(parser, 0, sizeof(*parser));
+	parser->server = server;
+	parser->buffer = buffer;
+	parser->buffer_size = buffer_size;
+}
+
+/* Moves the value of a header declared via http_server_capture_request_headers() next to the path (i.e. before header_start),
+ * where it stays until the request has been handled. The headers nobody asked for are not stored at all. */
+static void http_parser_capture_header(http_request_parser *parser, const char *name, int name_len, char *value, char *end)
+{
+	http_server_instance server = parser->server;
+	for (int i = 0; i < server->captured_header_count; i++)
+	{
+		if (server->captured_headers[i].len != name_len || !header_name_equals(server->captured_headers[i].name, name, name_len))
+			continue;
+		
+		int len = end - value;
+		if ((parser->buffer_size - parser->header_start - len - 1) < 32)
+			return;	//Not enough space left for the subsequent header lines
+		
+		char *stored = parser->buffer + parser->header_start;	//The line starts at or after header_start, so this never overwrites unparsed data
+		memmove(stored, value, len);
+		stored[len] = 0;
+		parser->header_start += len + 1;
+		parser->headers.captured[i] = stored;
+		return;
+	}
+}
+
+static void http_parser_end_line(http_request_parser *parser, int eol)
+{
+	char *line = parser->buffer + parser->line_start;
+	int len = eol - parser->line_start;
+	if (len && line[len - 1] == '\r')
+		len--;
+	line[len] = 0;
+	parser->line_start = eol + 1;
+	
+	if (parser->state == HTTP_PARSER_REQUEST_LINE)
+	{
+		parser->path = parser->line_truncated ? NULL : parse_request_line(line, &parser->type, &parser->headers);
+		if (parser->path)
+			parser->header_start = parser->path + strlen(parser->path) + 1 - parser->buffer;
+		
+		if (!parser->path || (parser->buffer_size - parser->header_start) < 32)
+			parser->state = HTTP_PARSER_ERROR;
+		else
+			parser->state = HTTP_PARSER_HEADERS;
+	}
+	else if (!parser->line_truncated)
+	{
+		char *value, *end;
+		int name_len;
+		if (!len)
+			parser->state = HTTP_PARSER_DONE;	//Proper end of headers
+		else if ((name_len = split_header_line(line, len, &value, &end)) >= 0)
+		{
+			parse_header_line(&parser->headers, line, name_len, value, end);
+			http_parser_capture_header(parser, line, name_len, value, end);
+		}
+	}
+	
+	parser->line_truncated = false;
+}
+
+static char *http_parser_get_free_space(http_request_parser *parser, int *size)
+{
+	*size = parser->buffer_size - parser->data_end;
+	return parser->buffer + parser->data_end;
+}
+
+//Parses the data that was placed into the buffer returned by http_parser_get_free_space()
+static void http_parser_commit(http_request_parser *parser, int size)
+{
+	parser->data_end += size;
+	while (parser->state < HTTP_PARSER_DONE)
+	{
+		char *eol = find_newline(parser->buffer + parser->scan_pos, parser->buffer + parser->data_end);
+		if (!eol)
+		{
+			parser->scan_pos = parser->data_end;
+			break;
+		}
+		
+		parser->scan_pos = eol + 1 - parser->buffer;
+		http_parser_end_line(parser, eol - parser->buffer);
+	}
+	
+	if (parser->state < HTTP_PARSER_DONE && parser->data_end == parser->buffer_size)
+	{
+		int len = parser->data_end - parser->line_start;
+		if (parser->line_start > parser->header_start)
+			memmove(parser->buffer + parser->header_start, parser->buffer + parser->line_start, len);
+		else
+		{
+			parser->line_truncated = true;	//Drop the contents of the line, but keep looking for its end
+			len = 0;
+		}
+		
+		parser->line_start = parser->header_start;
+		parser->scan_pos = parser->data_end = parser->header_start + len;
+	}
+}
+
+//Copies the request data into the parser buffer up to the end of the headers. Returns the number of bytes consumed.
+static int http_parser_feed(http_request_parser *parser, const char *data, int size)
+{
+	int done = 0;
+	while (done < size && parser->state < HTTP_PARSER_DONE)
+	{
+		int avail;
+		char *p = http_parser_get_free_space(parser, &avail);
+		int todo = MIN(avail, size - done);
+		memcpy(p, data + done, todo);
+		done += todo;
+		http_parser_commit(parser, todo);
+	}
+	
+	if (parser->state == HTTP_PARSER_DONE)
+		done -= parser->data_end - parser->line_start;	//Data after the headers was copied, but not consumed
+	
+	return done;
+}
+
+static bool host_name_matches(http_connection ctx, char *host)
+{
+	int len = strlen(ctx->server->hostname);
+	if (strncasecmp(host, ctx->server->hostname, len))
+		return false;
+	
+	if (!host[len])
+		return true;	//Host name without domain
+	
+	if (host[len] == '.' && !strcasecmp(host + len + 1, ctx->server->domain_name))
+		return true;	//Host name with domain
+	
+	return false;
+}
+
+static inline void append(char *buf, int *offset, const char *data, int len)
+{
+	memcpy(buf + *offset, data, len);
+	*offset += len;
+}
+
+/* Sets up http_server_read_post_line() to return the request body, starting with the part
+ * that was received together with the headers (located between 'pos' and 'used' of the buffer at 'offset'). */
+static void begin_request_body(http_connection ctx, enum http_request_type reqtype, int content_length, int offset, int pos, int used)
+{
+	ctx->post.remaining_input_len = ctx->post.buffer_used = ctx->post.buffer_pos = 0;
+	
+	if (reqtype == HTTP_POST && content_length)
+	{
+		ctx->post.buffer_pos = pos;
+		ctx->post.buffer_used = used;
+		ctx->post.remaining_input_len = content_length - (used - pos);
+		ctx->post.offset_from_main_buffer = offset;
+		ctx->post.start_time = ctx->post.last_received = xTaskGetTickCount();
+		ctx->post.received = used - pos;
+		
+		if (ctx->post.remaining_input_len < 0)
+		{
+			//The client has already sent the next request after the body. We don't support pipelining, so drop it and close the connection.
+			ctx->post.buffer_used += ctx->post.remaining_input_len;
+			ctx->post.remaining_input_len = 0;
+			ctx->keep_alive = false;
+		}
+	}
+	else if (content_length || pos < used)
+		ctx->keep_alive = false;	//Unexpected request body or a pipelined request
+}
+
+//Orders zones by their prefixes, so that the zones with the same prefix are adjacent
+static int compare_zone_prefix(const http_zone *zone, const char *prefix, int len)
+{
+	int result = strncasecmp(zone->prefix, prefix, len);
+	return result ? result : zone->prefix_len - len;
+}
+
+//Returns the index of the first zone with the prefix not less than the given one
+static int lower_bound_zone(http_server_instance server, const char *prefix, int len)
+{
+	int first = 0, count = server->zone_count;
+	while (count > 0)
+	{
+		int step = count / 2;
+		if (compare_zone_prefix(server->zones[first + step], prefix, len) < 0)
+		{
+			first += step + 1;
+			count -= step + 1;
+		}
+		else
+			count = step;
+	}
+	
+	return first;
+}
+
+/* Returns the next zone (starting at *index, or at the first zone with this prefix if *index is -1) that has exactly
+ * the first 'len' characters of the path as the prefix and accepts the request. Zones can be added while the server
+ * is running, so the table is only accessed while holding the lock. */
+static http_zone *find_zone(http_server_instance server, const char *path, int len, enum http_request_type reqtype, int *index)
+{
+	http_zone *result = NULL;
+	xSemaphoreTake(server->zone_lock, portMAX_DELAY);
+	if (*index < 0)
+		*index = lower_bound_zone(server, path, len);
+	
+	for (; *index < server->zone_count && !result && !compare_zone_prefix(server->zones[*index], path, len); (*index)++)
+	{
+		http_zone *zone = server->zones[*index];
+		int methods = zone->methods;
+		if (methods & HTTP_METHOD_GET)
+			methods |= HTTP_METHOD_HEAD;
+		
+		if ((methods & (1 << reqtype)) && (!zone->exact || !path[len]))
+			result = zone;
+	}
+	
+	xSemaphoreGive(server->zone_lock);
+	return result;
+}
+
+static bool run_zone_handler(http_connection ctx, http_zone *zone, enum http_request_type reqtype, char *path)
+{
+	if (reqtype == HTTP_POST && (unsigned)ctx->request_headers->content_length > (unsigned)zone->max_body_size)
+	{
+		ctx->keep_alive = false;	//The body is not read
+		http_server_send_reply(ctx, "413 Payload Too Large", "text/plain", "Request body too large", -1);
+		return true;
+	}
+	
+	return zone->handler(ctx, reqtype, path, zone->context);
+}
+
+static void dispatch_request(http_connection ctx, enum http_request_type reqtype, char *path, struct http_request_headers *headers)
+{
+	char *host = headers->host;
+	debug_printf("HTTP: %s%s\n", host, path);
+	count_event(&s_Stats.requests);
+	ctx->discard_body = reqtype == HTTP_HEAD;
+	ctx->chunked_allowed = headers->http11;
+	ctx->request_headers = headers;
+	ctx->reply_header_count = 0;
+	ctx->websocket_key = NULL;
+	if (reqtype == HTTP_GET && headers->upgrade_websocket && headers->websocket_key[0])
+	{
+		reqtype = HTTP_WEBSOCKET;
+		ctx->websocket_key = headers->websocket_key;
+	}
+	
+	if (!host_name_matches(ctx, host))
+	{
+		ctx->keep_alive = false;
+		static const char header[] = "HTTP/1.0 302 Found\r\nLocation: http://";
+		static const char footer[] = "\r\nConnection: Close\r\n\r\n";
+		int host_len = strlen(ctx->server->hostname), domain_len = strlen(ctx->server->domain_name);
+		
+		int len = sizeof(header) + sizeof(footer) + host_len + domain_len + 2;
+		if (len < ctx->server->buffer_size)
+		{
+			int off = 0;
+			append(ctx->buffer, &off, header, sizeof(header) - 1);
+			append(ctx->buffer, &off, ctx->server->hostname, host_len);
+			if (domain_len)
+			{
+				append(ctx->buffer, &off, ".", 1);
+				append(ctx->buffer, &off, ctx->server->domain_name, domain_len);
+			}
+			append(ctx->buffer, &off, footer, sizeof(footer) - 1);
+			send_all(ctx->link, ctx->buffer, off, 0);
+		}
+	}
+	else
+	{
+		bool handled = false;
+		for (int len = strlen(path); len >= 0 && !handled; len--)
+		{
+			//Zone prefixes always end at a path component boundary
+			if (path[len] && path[len] != '/')
+				continue;
+			
+			http_zone *zone;
+			int index = -1;
+			while (!handled && (zone = find_zone(ctx->server, path, len, reqtype, &index)))
+			{
+				int off = len;
+				while (path[off] == '/')
+					off++;
+				
+				handled = run_zone_handler(ctx, zone, reqtype, path + off);
+			}
+		}
+		
+		if (!handled)
+			http_server_send_reply(ctx, "404 Not Found", "text/plain", "File not found", -1);
+	}
+	
+	//The reply has been queued by now, so the next requests on this connection get the default behavior again
+	if (ctx->nodelay)
+	{
+		ctx->nodelay = false;
+		if (!ctx->detached)
+			set_nodelay(ctx->link, false);
+	}
+	
+	if (ctx->post.remaining_input_len > 0 || ctx->post.buffer_pos < ctx->post.buffer_used)
+		ctx->keep_alive = false;	//The handler did not read the entire request body
+}
+
+/* Waiting for the next request on a persistent connection is limited by the keep-alive timeout. Once the request starts arriving
+ * (or right away for the first request on a new connection), the rest of the headers must arrive within HTTP_SERVER_HEADER_TIMEOUT_MS.
+ * Returns the counter to increment if the deadline passes. */
+static uint32_t *begin_request_timer(TickType_t *deadline, bool first_request)
+{
+	*deadline = xTaskGetTickCount() + pdMS_TO_TICKS(first_request ? HTTP_SERVER_HEADER_TIMEOUT_MS : HTTP_SERVER_KEEPALIVE_TIMEOUT_MS);
+	return first_request ? &s_Stats.header_timeouts : &s_Stats.idle_timeouts;
+}
+
+//Called after receiving a part of the request. Trickling the headers does not extend the deadline.
+static uint32_t *continue_request_timer(TickType_t *deadline, uint32_t *timeouts)
+{
+	if (timeouts != &s_Stats.idle_timeouts)
+		return timeouts;
+	
+	*deadline = xTaskGetTickCount() + pdMS_TO_TICKS(HTTP_SERVER_HEADER_TIMEOUT_MS);
+	return &s_Stats.header_timeouts;
+}
+
+#if HTTP_SERVER_MULTIPLEXED
+
+/* In the multiplexed mode, a single task waits for all clients using select(). Clients that are idle or are
+ * still sending the request headers only take a small http_client structure. Once the headers have been received,
+ * the handler runs synchronously on the multiplexer task, using the shared connection object and its buffer.
+ * Replies with FLASH-resident content (e.g. files from the SimpleFS image) are sent asynchronously,
+ * so a slow download does not block other clients. */
+struct http_client
+{
+	int socket;	//-1 if the slot is free
+	bool sending;	//Waiting for the socket to become writable to send pending_data
+	bool keep_alive;
+	int requests_served;
+	TickType_t deadline;
+	uint32_t *timeouts;	//Incremented if the client gets disconnected at the deadline
+	const char *pending_data;
+	int pending_size;
+	http_request_parser parser;
+	char buffer[HTTP_SERVER_CLIENT_BUFFER_SIZE];
+};
+
+static void close_client(struct http_client *client)
+{
+	closesocket(client->socket);
+	client->socket = -1;
+}
+
+static void wait_for_next_request(http_server_instance server, struct http_client *client)
+{
+	http_parser_reset(&client->parser, server, client->buffer, sizeof(client->buffer));
+	client->sending = false;
+	client->pending_size = 0;
+	client->timeouts = begin_request_timer(&client->deadline, client->requests_served == 0);
+}
+
+static void finish_client_request(http_server_instance server, struct http_client *client)
+{
+	if (client->keep_alive)
+		wait_for_next_request(server, client);
+	else
+		close_client(client);
+}
+
+static void accept_client(http_server_instance sctx)
+{
+	struct sockaddr_storage remote_addr;
+	socklen_t len = sizeof(remote_addr);
+	int conn_sock = accept(sctx->socket, (struct sockaddr *)&remote_addr, &len);
+	if (conn_sock < 0)
+		return;
+	
+	for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++)
+	{
+		struct http_client *client = &sctx->clients[i];
+		if (client->socket < 0)
+		{
+			client->socket = conn_sock;
+			client->requests_served = 0;
+			set_send_timeout(conn_sock, HTTP_SERVER_SEND_TIMEOUT_MS);	//Limits blocking sends by handlers
+			wait_for_next_request(sctx, client);
+			count_event(&s_Stats.connections);
+			return;
+		}
+	}
+	
+	shed_connection(conn_sock);	//All client slots are taken
+}
+
+static void handle_client_request(http_connection ctx, struct http_client *client, int body_size)
+{
+	http_request_parser *parser = &client->parser;
+	ctx->link = client->socket;
+	ctx->client = client;
+	ctx->detached = false;
+	ctx->nodelay = false;
+	
+	//The last request allowed on this connection will be answered with 'Connection: close'
+	ctx->keep_alive = parser->headers.keep_alive && ++client->requests_served < HTTP_SERVER_MAX_REQUESTS_PER_CONNECTION;
+	
+	begin_request_body(ctx, parser->type, parser->headers.content_length, 0, 0, body_size);
+	dispatch_request(ctx, parser->type, parser->path, &parser->headers);
+	
+	ctx->client = NULL;
+	client->keep_alive = ctx->keep_alive;
+	
+	if (ctx->detached)
+	{
+		client->socket = -1;	//The socket is now owned by an event source
+		return;
+	}
+	
+	if (client->pending_size)
+	{
+		client->sending = true;
+		client->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(HTTP_SERVER_SEND_TIMEOUT_MS);
+		client->timeouts = &s_Stats.send_timeouts;
+	}
+	else
+		finish_client_request(ctx->server, client);
+}
+
+static void receive_from_client(http_connection ctx, struct http_client *client)
+{
+	//The shared buffer is free between requests, so we use it as a temporary receive buffer
+	int done = recv(client->socket, ctx->buffer, ctx->server->buffer_size, MSG_DONTWAIT);
+	if (done < 0 && errno == EWOULDBLOCK)
+		return;
+	
+	if (done <= 0)
+	{
+		close_client(client);
+		return;
+	}
+	
+	client->timeouts = continue_request_timer(&client->deadline, client->timeouts);
+	int consumed = http_parser_feed(&client->parser, ctx->buffer, done);
+	if (client->parser.state == HTTP_PARSER_ERROR)
+	{
+		debug_printf("HTTP: invalid request\n");
+		close_client(client);
+	}
+	else if (client->parser.state == HTTP_PARSER_DONE)
+	{
+		memmove(ctx->buffer, ctx->buffer + consumed, done - consumed);	//The beginning of the request body (if any)
+		handle_client_request(ctx, client, done - consumed);
+	}
+}
+
+static void continue_sending(http_server_instance server, struct http_client *client)
+{
+	//Sending the data in smaller portions prevents many simultaneous downloads from exhausting the lwIP heap
+	int done = send(client->socket, client->pending_data, MIN(client->pending_size, HTTP_SERVER_SEND_CHUNK_SIZE), MSG_DONTWAIT);
+	if (done < 0 && errno != EWOULDBLOCK)
+	{
+		close_client(client);
+		return;
+	}
+	
+	if (done > 0)
+	{
+		client->pending_data += done;
+		client->pending_size -= done;
+		client->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(HTTP_SERVER_SEND_TIMEOUT_MS);
+	}
+	
+	if (!client->pending_size)
+		finish_client_request(server, client);
+}
+
+static void http_server_multiplexer_thread(void *arg)
+{
+	http_connection ctx = (http_connection)arg;
+	http_server_instance sctx = ctx->server;
+	
+	for (;;)
+	{
+		fd_set read_set, write_set;
+		FD_ZERO(&read_set);
+		FD_ZERO(&write_set);
+		FD_SET(sctx->socket, &read_set);
+		int max_socket = sctx->socket;
+		
+		TickType_t now = xTaskGetTickCount(), timeout = pdMS_TO_TICKS(HTTP_SERVER_KEEPALIVE_TIMEOUT_MS);
+		for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++)
+		{
+			struct http_client *client = &sctx->clients[i];
+			if (client->socket < 0)
+				continue;
+			
+			if ((int)(client->deadline - now) <= 0)
+			{
+				count_event(client->timeouts);
+				close_client(client);	//Idle or stalled connection
+				continue;
+			}
+			
+			timeout = MIN(timeout, client->deadline - now);
+			FD_SET(client->socket, client->sending ? &write_set : &read_set);
+			max_socket = MAX(max_socket, client->socket);
+		}
+		
+		int timeout_ms = timeout * portTICK_PERIOD_MS;
+		struct timeval tv = {
+			.tv_sec = timeout_ms / 1000,
+			.tv_usec = (timeout_ms % 1000) * 1000,
+		};
+		
+		if (select(max_socket + 1, &read_set, &write_set, NULL, &tv) <= 0)
+			continue;
+		
+		for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++)
+		{
+			struct http_client *client = &sctx->clients[i];
+			if (client->socket < 0)
+				continue;
+			
+			if (FD_ISSET(client->socket, &read_set))
+				receive_from_client(ctx, client);
+			else if (FD_ISSET(client->socket, &write_set))
+				continue_sending(sctx, client);
+		}
+		
+		//New clients are accepted last, so that their sockets are not confused with the ones from the previous select() call.
+		if (FD_ISSET(sctx->socket, &read_set))
+			accept_client(sctx);
+	}
+}
+
+#elif HTTP_SERVER_USE_RAW_API
+
+//Feeds the received pbufs directly to the parser, without copying them into the connection buffer first
+static bool raw_link_parse(http_link link, http_request_parser *parser, bool first_request)
+{
+	TickType_t deadline;
+	uint32_t *timeouts = begin_request_timer(&deadline, first_request);
+	while (parser->state < HTTP_PARSER_DONE)
+	{
+		if (!raw_link_wait_until(link, deadline, timeouts))
+			return false;
+		
+		timeouts = continue_request_timer(&deadline, timeouts);
+		struct pbuf *p = raw_link_take_data(link);
+		int consumed = 0;
+		for (struct pbuf *q = p; q && parser->state < HTTP_PARSER_DONE; q = q->next)
+			consumed += http_parser_feed(parser, (char *)q->payload, q->len);
+		
+		raw_link_return_data(link, p, consumed);
+	}
+	
+	return parser->state == HTTP_PARSER_DONE;
+}
+
+//Receives the request headers into ctx->parser. Returns false if the connection must be closed.
+static bool parse_http_request(http_connection ctx, bool first_request)
+{
+	http_request_parser *parser = ctx->parser;
+	http_parser_reset(parser, ctx->server, ctx->buffer, ctx->server->buffer_size);
+	
+	if (!raw_link_parse(ctx->link, parser, first_request))
+	{
+		if (parser->state == HTTP_PARSER_ERROR)
+			debug_printf("HTTP: invalid request\n");
+		return false;
+	}
+	
+	ctx->keep_alive = ctx->keep_alive && parser->headers.keep_alive;
+	return true;
+}
+
+#else
+
+//Receives the request headers into ctx->parser. Returns false if the connection must be closed.
+static bool parse_http_request(http_connection ctx, bool first_request)
+{
+	http_request_parser *parser = ctx->parser;
+	http_parser_reset(parser, ctx->server, ctx->buffer, ctx->server->buffer_size);
+	
+	//The data is received directly into the parser buffer, so it is only copied once
+	TickType_t deadline;
+	uint32_t *timeouts = begin_request_timer(&deadline, first_request);
+	while (parser->state < HTTP_PARSER_DONE)
+	{
+		int avail;
+		char *p = http_parser_get_free_space(parser, &avail);
+		int done = link_recv_until(ctx->link, p, avail, deadline, timeouts);
+		if (done <= 0)
+			return false;	//Connection closed or timed out
+		
+		timeouts = continue_request_timer(&deadline, timeouts);
+		http_parser_commit(parser, done);
+	}
+	
+	if (parser->state == HTTP_PARSER_ERROR)
+	{
+		debug_printf("HTTP: invalid request\n");
+		return false;
+	}
+	
+	ctx->keep_alive = ctx->keep_alive && parser->headers.keep_alive;
+	return true;
+}
+
+#endif
+
+#if !HTTP_SERVER_MULTIPLEXED
+
+/* Waits for the next request on a persistent connection. While other connections are waiting for a worker, the client only gets
+ * HTTP_SERVER_BUSY_KEEPALIVE_TIMEOUT_MS, so a few idle browser connections cannot keep all workers to themselves. */
+static bool wait_for_next_request(http_connection ctx)
+{
+	TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(HTTP_SERVER_KEEPALIVE_TIMEOUT_MS);
+	for (;;)
+	{
+		int timeout_ms = ms_until(deadline);
+		if (!timeout_ms)
+		{
+			count_event(&s_Stats.idle_timeouts);
+			return false;
+		}
+		
+		int result = link_wait_for_data(ctx->link, MIN(timeout_ms, HTTP_SERVER_BUSY_KEEPALIVE_TIMEOUT_MS));
+		if (result)
+			return result > 0;
+		
+		if (uxQueueMessagesWaiting(ctx->server->connection_queue))
+		{
+			count_event(&s_Stats.idle_released);
+			return false;
+		}
+	}
+}
+
+//Must be called from a critical section, same as need_wakeup()
+static bool lane_can_resume(http_server_instance server, enum http_lane lane)
+{
+	return server->lanes[lane].queue_head && server->lanes[lane].running < server->lanes[lane].limit;
+}
+
+//Returns true if the caller should queue HTTP_WAKEUP_LINK (at most one is queued at a time)
+static bool need_wakeup(http_server_instance server)
+{
+	bool resumable = false;
+	for (int lane = 0; lane < HTTP_LANE_COUNT; lane++)
+		resumable = resumable || lane_can_resume(server, lane);
+	
+	if (!resumable || server->wakeup_queued)
+		return false;
+	
+	server->wakeup_queued = true;
+	return true;
+}
+
+/* Wakes up a worker to resume a queued request once its lane has a free slot. If the queue is full, nothing is lost:
+ * the workers check the lanes before taking each connection from the queue (see http_server_worker()). */
+static void wake_up_worker(http_server_instance server)
+{
+	http_link link = HTTP_WAKEUP_LINK;
+	if (xQueueSendToFront(server->connection_queue, &link, 0) != pdTRUE)
+	{
+		taskENTER_CRITICAL();
+		server->wakeup_queued = false;
+		taskEXIT_CRITICAL();
+	}
+}
+
+//Returns the lane of the zone that gets the request first (see dispatch_request()). Redirects and 404 replies use the default lane.
+static enum http_lane find_request_lane(http_connection ctx)
+{
+	http_request_parser *parser = ctx->parser;
+	enum http_request_type reqtype = parser->type;
+	if (reqtype == HTTP_GET && parser->headers.upgrade_websocket && parser->headers.websocket_key[0])
+		reqtype = HTTP_WEBSOCKET;
+	
+	if (!host_name_matches(ctx, parser->headers.host))
+		return HTTP_LANE_DEFAULT;
+	
+	for (int len = strlen(parser->path); len >= 0; len--)
+	{
+		if (parser->path[len] && parser->path[len] != '/')
+			continue;
+		
+		int index = -1;
+		http_zone *zone = find_zone(ctx->server, parser->path, len, reqtype, &index);
+		if (zone)
+			return zone->lane;
+	}
+	
+	return HTTP_LANE_DEFAULT;
+}
+
+enum http_admission
+{
+	HTTP_ADMITTED,	//The request has a slot in its lane
+	HTTP_QUEUED,	//The connection object waits in the lane queue, and the worker continues with a spare one
+	HTTP_REJECTED,	//No spare connection object was left to queue the request
+};
+
+/* Admits the parsed request to its lane. If the lane has no free slot, the connection object (holding the request)
+ * is queued in the lane, so the worker can serve other connections until a worker of the lane resumes it. */
+static enum http_admission admit_request(http_connection ctx, http_connection *spare)
+{
+	http_server_instance server = ctx->server;
+	enum http_admission result = HTTP_ADMITTED;
+	
+	taskENTER_CRITICAL();
+	if (server->lanes[ctx->lane].running < server->lanes[ctx->lane].limit)
+		server->lanes[ctx->lane].running++;
+	else if (!server->spare_connections)
+		result = HTTP_REJECTED;
+	else
+	{
+		*spare = server->spare_connections;
+		server->spare_connections = (*spare)->next;
+		
+		ctx->next = NULL;
+		if (server->lanes[ctx->lane].queue_tail)
+			server->lanes[ctx->lane].queue_tail->next = ctx;
+		else
+			server->lanes[ctx->lane].queue_head = ctx;
+		server->lanes[ctx->lane].queue_tail = ctx;
+		result = HTTP_QUEUED;
+	}
+	taskEXIT_CRITICAL();
+	
+	return result;
+}
+
+/* Takes the oldest queued request from a lane with a free slot (trying the default lane first).
+ * The unused connection object of the worker becomes a spare one instead. */
+static http_connection resume_queued_request(http_connection ctx)
+{
+	http_server_instance server = ctx->server;
+	http_connection resumed = NULL;
+	
+	taskENTER_CRITICAL();
+	for (int lane = 0; lane < HTTP_LANE_COUNT && !resumed; lane++)
+	{
+		if (lane_can_resume(server, lane))
+		{
+			resumed = server->lanes[lane].queue_head;
+			server->lanes[lane].queue_head = resumed->next;
+			if (!resumed->next)
+				server->lanes[lane].queue_tail = NULL;
+			server->lanes[lane].running++;
+			
+			ctx->next = server->spare_connections;
+			server->spare_connections = ctx;
+		}
+	}
+	
+	bool wakeup = resumed && need_wakeup(server);	//Another worker can resume the next one
+	taskEXIT_CRITICAL();
+	
+	if (wakeup)
+		wake_up_worker(server);
+	return resumed;
+}
+
+static void release_lane(http_server_instance server, enum http_lane lane)
+{
+	taskENTER_CRITICAL();
+	server->lanes[lane].running--;
+	bool wakeup = need_wakeup(server);
+	taskEXIT_CRITICAL();
+	
+	if (wakeup)
+		wake_up_worker(server);
+}
+
+static void handle_http_request(http_connection ctx)
+{
+	http_server_instance server = ctx->server;
+	http_request_parser *parser = ctx->parser;
+#if HTTP_SERVER_USE_RAW_API
+	/* The request body (as well as a pipelined request) stays in the pbufs until it is read.
+	 * The part of the buffer after the path is free, so we use it for reading the body lines. */
+	begin_request_body(ctx, parser->type, parser->headers.content_length, parser->header_start, 0, 0);
+#else
+	begin_request_body(ctx, parser->type, parser->headers.content_length, parser->header_start, parser->line_start - parser->header_start, parser->data_end - parser->header_start);
+#endif
+	
+	UBaseType_t priority = server->lanes[ctx->lane].priority;
+	if (priority != HTTP_SERVER_WORKER_PRIORITY)
+		vTaskPrioritySet(NULL, priority);
+	
+	dispatch_request(ctx, parser->type, parser->path, &parser->headers);
+	
+	if (priority != HTTP_SERVER_WORKER_PRIORITY)
+		vTaskPrioritySet(NULL, HTTP_SERVER_WORKER_PRIORITY);
+	release_lane(server, ctx->lane);
+}
+
+/* Serves the requests on the connection until it is closed, or until a request has to wait for its lane. In the latter case,
+ * the connection object stays queued with the request, and the function returns the spare object the worker continues with. */
+static http_connection serve_connection(http_connection ctx, bool resumed)
+{
+	for (;;)
+	{
+		if (!resumed)
+		{
+			//The last request allowed on this connection will be answered with 'Connection: close'
+			ctx->keep_alive = ++ctx->requests_served < HTTP_SERVER_MAX_REQUESTS_PER_CONNECTION;
+			if (ctx->requests_served > 1 && !wait_for_next_request(ctx))
+				break;
+			if (!parse_http_request(ctx, ctx->requests_served == 1))
+				break;
+			
+			http_connection spare = NULL;
+			ctx->lane = find_request_lane(ctx);
+			enum http_admission admission = admit_request(ctx, &spare);
+			if (admission == HTTP_QUEUED)
+			{
+				count_event(&s_Stats.queued_requests);
+				return spare;
+			}
+			
+			if (admission == HTTP_REJECTED)
+			{
+				count_event(&s_Stats.shed_requests);
+				send_all(ctx->link, s_ServiceUnavailableReply, sizeof(s_ServiceUnavailableReply) - 1, 0);
+				break;
+			}
+		}
+		
+		resumed = false;
+		handle_http_request(ctx);
+		if (!ctx->keep_alive)
+			break;
+	}
+	
+	if (!ctx->detached)
+		link_close(ctx->link);
+	return ctx;
+}
+
+/* Each connection object (including the buffer) is allocated once by http_server_create(), so serving a request
+ * does not involve any heap allocations or task creation. A worker owns one object at a time, and exchanges it
+ * with a spare one when a request has to wait for its lane (see admit_request() and resume_queued_request()). */
+static void http_server_worker(void *arg)
+{
+	http_connection ctx = (http_connection)arg;
+	http_server_instance server = ctx->server;
+	
+	for (;;)
+	{
+		//The queued requests were received before the connections still waiting for a worker
+		http_connection resumed = resume_queued_request(ctx);
+		if (resumed)
+		{
+			ctx = serve_connection(resumed, true);
+			continue;
+		}
+		
+		http_link link;
+		if (xQueueReceive(server->connection_queue, &link, portMAX_DELAY) != pdTRUE)
+			continue;
+		
+		taskENTER_CRITICAL();
+		if (link == HTTP_WAKEUP_LINK)
+			server->wakeup_queued = false;
+		else
+			s_Stats.queued_connections--;
+		taskEXIT_CRITICAL();
+		
+		if (link == HTTP_WAKEUP_LINK)
+			continue;
+		
+#if !HTTP_SERVER_USE_RAW_API
+		set_send_timeout(link, HTTP_SERVER_SEND_TIMEOUT_MS);
+#endif
+		count_event(&s_Stats.connections);
+		ctx->link = link;
+		ctx->detached = false;
+		ctx->nodelay = false;
+		ctx->requests_served = 0;
+		ctx = serve_connection(ctx, false);
+	}
+}
+
+#if !HTTP_SERVER_USE_RAW_API
+static void http_server_thread(void *arg)
+{
+	http_server_instance sctx = (http_server_instance)arg;
+	bool full = false;	//No connection could be queued since full_since
+	TickType_t full_since = 0;
+	
+	while (true)
+	{
+		struct sockaddr_storage remote_addr;
+		socklen_t len = sizeof(remote_addr);
+		int conn_sock = accept(sctx->socket, (struct sockaddr *)&remote_addr, &len);
+		if (conn_sock >= 0)
+		{
+			TickType_t timeout = portMAX_DELAY;
+			if (HTTP_SERVER_ADMISSION_TIMEOUT_MS >= 0)
+			{
+				TickType_t now = xTaskGetTickCount(), budget = pdMS_TO_TICKS(HTTP_SERVER_ADMISSION_TIMEOUT_MS);
+				if (!full)
+					full_since = now;
+				timeout = now - full_since < budget ? budget - (now - full_since) : 0;
+			}
+			
+			full = !enqueue_connection(sctx->connection_queue, conn_sock, timeout);
+			if (full)
+				shed_connection(conn_sock);
+		}
+	}
+}
+#endif
+
+#endif
+
+#if !HTTP_SERVER_MULTIPLEXED
+static http_connection alloc_connection(http_server_instance server)
+{
+	http_connection cctx = pvPortMalloc(sizeof(struct _http_connection) + server->buffer_size);
+	http_request_parser *parser = pvPortMalloc(sizeof(http_request_parser));
+	if (!cctx || !parser)
+	{
+		vPortFree(cctx);
+		vPortFree(parser);
+		return NULL;
+	}
+	
+	cctx->server = server;
+	cctx->parser = parser;
+	return cctx;
+}
+#endif
+
+//The index selects the core for HTTP_SERVER_PIN_WORKERS. Pass -1 for the tasks other than the workers.
+static BaseType_t create_server_task(TaskFunction_t func, const char *name, uint32_t stack_size, void *arg, UBaseType_t priority, int index)
+{
+#if FREE_RTOS_KERNEL_SMP
+	UBaseType_t affinity = HTTP_SERVER_CORE_AFFINITY;
+	UBaseType_t cores = affinity & ((1 << configNUM_CORES) - 1);
+	if (HTTP_SERVER_PIN_WORKERS && index >= 0 && cores)
+	{
+		//Pick the (index % count)-th core from the mask
+		for (int n = index % __builtin_popcount(cores); n; n--)
+			cores &= cores - 1;
+		affinity = cores & -cores;
+	}
+	
+	return xTaskCreateAffinitySet(func, name, stack_size, arg, priority, affinity, NULL);
+#else
+	return xTaskCreate(func, name, stack_size, arg, priority, NULL);
+#endif
+}
+
+http_server_instance http_server_create(const char *main_host, const char *main_domain, int max_thread_count, int buffer_size)
+{
+#if HTTP_SERVER_USE_RAW_API
+	http_server_instance ctx = (http_server_instance)pvPortMalloc(sizeof(struct _http_server_instance));
+	if (!ctx)
+		return NULL;
+	
+	//Enough links for the connections handled by the workers, the ones waiting in the queue, and the event subscribers
+	ctx->listen_pcb = NULL;
+	ctx->link_count = max_thread_count * 2 + HTTP_SERVER_MAX_EVENT_SUBSCRIBERS;
+	ctx->links = (struct http_raw_link *)pvPortMalloc(sizeof(struct http_raw_link) * ctx->link_count);
+	if (!ctx->links)
+	{
+		vPortFree(ctx);
+		return NULL;
+	}
+	
+	for (int i = 0; i < ctx->link_count; i++)
+	{
+		ctx->links[i].in_use = false;
+		ctx->links[i].pcb = NULL;
+		ctx->links[i].rx = NULL;
+		ctx->links[i].event = xSemaphoreCreateBinary();
+	}
+#else
+	int server_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+	struct sockaddr_in listen_addr =
+	{
+		.sin_len = sizeof(struct sockaddr_in),
+		.sin_family = AF_INET,
+		.sin_port = htons(80),
+		.sin_addr = 0,
+	};
+    
+	if (server_sock < 0)
+	{
+		debug_printf("Unable to create HTTP socket: error %d", errno);
+		return NULL;
+	}
+
+	if (bind(server_sock, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0)
+	{
+		closesocket(server_sock);
+		debug_printf("Unable to bind HTTP socket: error %d\n", errno);
+		return NULL;
+	}
+
+	if (listen(server_sock, max_thread_count * 2) < 0)
+	{
+		closesocket(server_sock);
+		debug_printf("Unable to listen on HTTP socket: error %d\n", errno);
+		return NULL;
+	}
+	
+	http_server_instance ctx = (http_server_instance)pvPortMalloc(sizeof(struct _http_server_instance));
+	if (!ctx)
+	{
+		closesocket(server_sock);
+		return NULL;
+	}
+
+	ctx->socket = server_sock;
+#endif
+	ctx->hostname = main_host;
+	ctx->domain_name = main_domain;
+	ctx->buffer_size = buffer_size;
+	ctx->zones = NULL;
+	ctx->zone_count = ctx->zone_capacity = 0;
+	ctx->captured_header_count = 0;
+	ctx->zone_lock = xSemaphoreCreateMutex();
+	
+#if HTTP_SERVER_MULTIPLEXED
+	ctx->clients = pvPortMalloc(sizeof(struct http_client) * HTTP_SERVER_MAX_CONNECTIONS);
+	http_connection cctx = pvPortMalloc(sizeof(struct _http_connection) + buffer_size);
+	if (ctx->clients && cctx)
+	{
+		for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++)
+			ctx->clients[i].socket = -1;
+		
+		cctx->server = ctx;
+		cctx->client = NULL;
+	}
+	
+	if (!ctx->clients || !cctx || create_server_task(http_server_multiplexer_thread, "HTTP Server", HTTP_SERVER_WORKER_STACK_SIZE, cctx, HTTP_SERVER_WORKER_PRIORITY, -1) != pdTRUE)
+	{
+		debug_printf("HTTP: not enough memory for the multiplexer\n");
+		vPortFree(ctx->clients);
+		vPortFree(cctx);
+		vSemaphoreDelete(ctx->zone_lock);
+		closesocket(ctx->socket);
+		vPortFree(ctx);
+		return NULL;
+	}
+#else
+	ctx->connection_queue = xQueueCreate(max_thread_count + 1, sizeof(http_link));	//One more for HTTP_WAKEUP_LINK
+	ctx->max_workers = max_thread_count;
+	ctx->wakeup_queued = false;
+	ctx->spare_connections = NULL;
+	for (int i = 0; i < HTTP_LANE_COUNT; i++)
+	{
+		ctx->lanes[i].limit = max_thread_count;
+		ctx->lanes[i].running = 0;
+		ctx->lanes[i].priority = HTTP_SERVER_WORKER_PRIORITY;
+		ctx->lanes[i].queue_head = ctx->lanes[i].queue_tail = NULL;
+	}
+	
+#if HTTP_SERVER_USE_RAW_API
+	//Start listening before creating the workers, so that a failure does not leave them running with a freed instance.
+	//The connections accepted in the meantime wait in the queue.
+	if (!raw_link_listen(ctx, max_thread_count * 2))
+	{
+		for (int i = 0; i < ctx->link_count; i++)
+			vSemaphoreDelete(ctx->links[i].event);
+		vQueueDelete(ctx->connection_queue);
+		vSemaphoreDelete(ctx->zone_lock);
+		vPortFree(ctx->links);
+		vPortFree(ctx);
+		return NULL;
+	}
+#endif
+	
+	//The spare objects hold the requests waiting for their lanes (see admit_request())
+	int spare_count = 0;
+	for (http_connection cctx; spare_count < HTTP_SERVER_MAX_QUEUED_REQUESTS && (cctx = alloc_connection(ctx)); spare_count++)
+	{
+		cctx->next = ctx->spare_connections;
+		ctx->spare_connections = cctx;
+	}
+	
+	if (spare_count < HTTP_SERVER_MAX_QUEUED_REQUESTS)
+		debug_printf("HTTP: only %d of %d requests can wait for their lanes\n", spare_count, HTTP_SERVER_MAX_QUEUED_REQUESTS);
+	
+	int worker_count = 0;
+	for (int i = 0; i < max_thread_count; i++)
+	{
+		http_connection cctx = alloc_connection(ctx);
+		if (!cctx)
+			break;
+		
+		if (create_server_task(http_server_worker, "HTTP Worker", HTTP_SERVER_WORKER_STACK_SIZE, cctx, HTTP_SERVER_WORKER_PRIORITY, i) != pdTRUE)
+		{
+			vPortFree(cctx->parser);
+			vPortFree(cctx);
+			break;
+		}
+		
+		worker_count++;
+	}
+	
+	if (worker_count < max_thread_count)
+		debug_printf("HTTP: only %d of %d worker tasks could be created\n", worker_count, max_thread_count);
+	
+#if !HTTP_SERVER_USE_RAW_API
+	create_server_task(http_server_thread, "HTTP Server", configMINIMAL_STACK_SIZE, ctx, tskIDLE_PRIORITY + 2, -1);
+#endif
+#endif
+	return ctx;
+}
+
+void http_server_add_zone(http_server_instance server, http_zone *zone, const char *prefix, http_request_handler handler, void *context)
+{
+	http_server_add_zone_ex(server, zone, prefix, HTTP_METHOD_ANY, false, handler, context);
+}
+
+void http_server_set_zone_lane(http_zone *zone, enum http_lane lane)
+{
+	zone->lane = lane;
+}
+
+void http_server_set_zone_max_body_size(http_zone *zone, int size)
+{
+	zone->max_body_size = size;
+}
+
+void http_server_set_lane_limits(http_server_instance server, enum http_lane lane, int max_workers, int priority)
+{
+#if !HTTP_SERVER_MULTIPLEXED
+	//Lowering the limit lets the handlers over the new limit finish, but does not admit new requests until they do
+	taskENTER_CRITICAL();
+	server->lanes[lane].limit = MAX(1, MIN(max_workers, server->max_workers));
+	server->lanes[lane].priority = priority;
+	bool wakeup = need_wakeup(server);
+	taskEXIT_CRITICAL();
+	
+	if (wakeup)
+		wake_up_worker(server);
+#endif
+}
+
+void http_server_capture_request_headers(http_server_instance server, const char *const *names)
+{
+	xSemaphoreTake(server->zone_lock, portMAX_DELAY);
+	for (; *names; names++)
+	{
+		int len = strlen(*names), i;
+		for (i = 0; i < server->captured_header_count; i++)
+			if (server->captured_headers[i].len == len && header_name_equals(server->captured_headers[i].name, *names, len))
+				break;
+		
+		if (i < server->captured_header_count)
+			continue;	//Already declared by another handler
+		
+		if (server->captured_header_count == HTTP_SERVER_MAX_CAPTURED_HEADERS)
+		{
+			debug_printf("HTTP: too many request headers declared, '%s' will not be captured\n", *names);
+			break;
+		}
+		
+		server->captured_headers[i].name = *names;
+		server->captured_headers[i].len = len;
+		server->captured_header_count++;	//Parsers running on other threads will only see the header once it has been filled in
+	}
+	xSemaphoreGive(server->zone_lock);
+}
+
+const char *http_server_get_request_header(http_connection conn, const char *name)
+{
+	http_server_instance server = conn->server;
+	int len = strlen(name);
+	for (int i = 0; i < server->captured_header_count; i++)
+		if (server->captured_headers[i].len == len && header_name_equals(server->captured_headers[i].name, name, len))
+			return conn->request_headers->captured[i];
+	
+	return NULL;
+}
+
+void http_server_add_zone_ex(http_server_instance server, http_zone *zone, const char *prefix, int methods, bool exact, http_request_handler handler, void *context)
+{
+	zone->prefix = prefix;
+	zone->prefix_len = strlen(prefix);
+	zone->methods = methods;
+	zone->exact = exact;
+	zone->lane = HTTP_LANE_DEFAULT;
+	zone->max_body_size = HTTP_SERVER_MAX_BODY_SIZE;
+	zone->handler = handler;
+	zone->context = context;
+	
+	xSemaphoreTake(server->zone_lock, portMAX_DELAY);
+	if (server->zone_count == server->zone_capacity)
+	{
+		int capacity = server->zone_capacity ? server->zone_capacity * 2 : 4;
+		http_zone **zones = (http_zone **)pvPortMalloc(capacity * sizeof(http_zone *));
+		if (!zones)
+		{
+			xSemaphoreGive(server->zone_lock);
+			debug_printf("HTTP: not enough memory to add zone '%s'\n", prefix);
+			return;
+		}
+		
+		memcpy(zones, server->zones, server->zone_count * sizeof(http_zone *));
+		vPortFree(server->zones);
+		server->zones = zones;
+		server->zone_capacity = capacity;
+	}
+	
+	//Zones with the same prefix are tried in the order of registration
+	int index = lower_bound_zone(server, prefix, zone->prefix_len);
+	while (index < server->zone_count && !compare_zone_prefix(server->zones[index], prefix, zone->prefix_len))
+		index++;
+	
+	memmove(server->zones + index + 1, server->zones + index, (server->zone_count - index) * sizeof(http_zone *));
+	server->zones[index] = zone;
+	server->zone_count++;
+	xSemaphoreGive(server->zone_lock);
+}
+
+//Appends formatted text to the connection buffer, truncating it if the buffer is full
+static void buffer_printf(http_connection conn, int *offset, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int written = vsnprintf(conn->buffer + *offset, conn->server->buffer_size - *offset, format, args);
+	va_end(args);
+	*offset = MIN(*offset + MAX(written, 0), conn->server->buffer_size - 1);
+}
+
+//Formats the status line and the headers common to all replies. The caller appends the framing headers and the empty line.
+static int format_reply_header(http_connection conn, const char *code, const char *contentType)
+{
+	int len = 0;
+	buffer_printf(conn, &len, "HTTP/1.1 %s\r\n", code);
+	if (contentType)
+		buffer_printf(conn, &len, "Content-Type: %s\r\n", contentType);
+	
+	for (int i = 0; i < conn->reply_header_count; i++)
+		buffer_printf(conn, &len, "%s: %s\r\n", conn->reply_headers[i].name, conn->reply_headers[i].value);
+	
+	return len;
+}
+
+void http_server_add_reply_header(http_connection conn, const char *name, const char *value)
+{
+	if (conn->reply_header_count < HTTP_SERVER_MAX_REPLY_HEADERS)
+	{
+		conn->reply_headers[conn->reply_header_count].name = name;
+		conn->reply_headers[conn->reply_header_count].value = value;
+		conn->reply_header_count++;
+	}
+	else
+		debug_printf("HTTP: too many reply headers\n");
+}
+
+bool http_server_etag_matches(http_connection conn, const char *etag)
+{
+	const char *list = conn->request_headers->if_none_match;
+	if (!strcmp(list, "*"))
+		return true;
+
+	//The header is a comma-separated list of quoted tags. Each one is compared as a whole, including the W/ prefix,
+	//so neither a tag that is a part of another one, nor a weak tag matches our strong tags.
+	int etag_len = strlen(etag);
+	for (const char *p = list; *p;)
+	{
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+
+		const char *start = p;
+		if (!strncmp(p, "W/", 2))
+			p += 2;
+		if (*p != '"')
+			return false;	//Malformed list
+
+		const char *end = strchr(p + 1, '"');
+		if (!end)
+			return false;
+
+		end++;
+		if (end - start == etag_len && !memcmp(start, etag, etag_len))
+			return true;
+		p = end;
+	}
+
+	return false;
+}
+
+int http_server_get_content_length(http_connection conn)
+{
+	return conn->request_headers->content_length;
+}
+
+int http_server_get_accepted_encodings(http_connection conn)
+{
+	return conn->request_headers->accepted_encodings;
+}
+
+enum http_range_status http_server_get_range(http_connection conn, const char *etag, uint32_t size, uint32_t *offset, uint32_t *length)
+{
+	const struct http_request_headers *headers = conn->request_headers;
+	if (!headers->has_range)
+		return HTTP_RANGE_NONE;
+	
+	//If-Range requires a strong match, otherwise the client could combine parts of different versions of the file.
+	//We don't send Last-Modified, so a date in If-Range never matches either.
+	if (headers->if_range[0] && (!etag || !strncmp(etag, "W/", 2) || strcmp(headers->if_range, etag)))
+		return HTTP_RANGE_NONE;
+	
+	if (headers->range_suffix)
+	{
+		if (!headers->range_first || !size)
+			return HTTP_RANGE_UNSATISFIABLE;
+		*length = MIN(headers->range_first, size);
+		*offset = size - *length;
+		return HTTP_RANGE_PARTIAL;
+	}
+	
+	if (headers->range_first >= size)
+		return HTTP_RANGE_UNSATISFIABLE;
+	
+	*offset = headers->range_first;
+	*length = MIN(headers->range_last, size - 1) - headers->range_first + 1;
+	return HTTP_RANGE_PARTIAL;
+}
+
+void http_server_send_partial_reply(http_connection conn, enum http_range_status status, const char *contentType, const char *content, uint32_t offset, uint32_t length, uint32_t total_size)
+{
+	char content_range[48];
+	if (status == HTTP_RANGE_PARTIAL)
+	{
+		snprintf(content_range, sizeof(content_range), "bytes %u-%u/%u", (unsigned)offset, (unsigned)(offset + length - 1), (unsigned)total_size);
+		http_server_add_reply_header(conn, "Content-Range", content_range);
+		http_server_send_reply(conn, "206 Partial Content", contentType, content + offset, length);
+	}
+	else if (status == HTTP_RANGE_UNSATISFIABLE)
+	{
+		snprintf(content_range, sizeof(content_range), "bytes */%u", (unsigned)total_size);
+		http_server_add_reply_header(conn, "Content-Range", content_range);
+		http_server_send_reply(conn, "416 Range Not Satisfiable", "text/plain", "", 0);
+	}
+	else
+		http_server_send_reply(conn, "200 OK", contentType, content, total_size);
+}
+
+void http_server_send_not_modified(http_connection conn)
+{
+	int done = format_reply_header(conn, "304 Not Modified", NULL);
+	buffer_printf(conn, &done, "Connection: %s\r\n\r\n", conn->keep_alive ? "keep-alive" : "close");
+	send_all(conn->link, conn->buffer, done, 0);
+}
+
+void http_server_send_reply(http_connection conn, const char *code, const char *contentType, const char *content, int size)
+{
+	if (size < 0)
+		size = strlen(content);
+	
+	int done = format_reply_header(conn, code, contentType);
+	buffer_printf(conn, &done, "Content-Length: %d\r\nConnection: %s\r\n\r\n", size, conn->keep_alive ? "keep-alive" : "close");
+	
+	int flags = 0, body_size = conn->discard_body ? 0 : size;
+#if HTTP_SERVER_MULTIPLEXED
+	bool deferred = conn->client && is_persistent_data(content);
+	if (deferred)
+		flags = MSG_DONTWAIT;	//Send as much as possible right away and let the multiplexer send the rest once the socket becomes writable
+#endif
+	
+	int sent = send_header_and_content(conn->link, conn->buffer, done, content, body_size, flags);
+	if (sent < 0)
+		sent = 0;	//Not folded into MAX(), that would evaluate the call twice
+	if (sent < done)
+	{
+		//The buffer will be reused for the next request, so the header must be sent in full
+		send_all(conn->link, conn->buffer + sent, done - sent, 0);
+		sent = done;
+	}
+	
+	sent -= done;
+#if HTTP_SERVER_MULTIPLEXED
+	if (deferred)
+	{
+		conn->client->pending_data = content + sent;
+		conn->client->pending_size = body_size - sent;
+		return;
+	}
+#endif
+	
+	send_all(conn->link, content + sent, body_size - sent, 0);
+}
+
+void http_server_set_nodelay(http_connection conn, bool nodelay)
+{
+	conn->nodelay = nodelay;
+	set_nodelay(conn->link, nodelay);
+}
+
+//Placeholder for the size of each chunk: 4 hex digits are enough for any buffer that fits into the RAM, leading zeroes are allowed.
+#define HTTP_CHUNK_PREFIX_SIZE 6
+
+//Fills in the size of the chunk being buffered and terminates it, so that the buffer can be sent as is
+static void close_chunk(http_connection conn)
+{
+	int size = conn->buffered_size - conn->chunk_start - HTTP_CHUNK_PREFIX_SIZE;
+	if (!size)
+	{
+		conn->buffered_size = conn->chunk_start;	//An empty chunk would end the reply
+		return;
+	}
+	
+	char prefix[HTTP_CHUNK_PREFIX_SIZE + 1];
+	snprintf(prefix, sizeof(prefix), "%04x\r\n", size);
+	memcpy(conn->buffer + conn->chunk_start, prefix, HTTP_CHUNK_PREFIX_SIZE);
+	memcpy(conn->buffer + conn->buffered_size, "\r\n", 2);
+	conn->buffered_size += 2;
+}
+
+static void flush_reply_buffer(http_connection conn)
+{
+	if (conn->chunked)
+		close_chunk(conn);
+	
+	if (conn->buffered_size)
+		send_all(conn->link, conn->buffer, conn->buffered_size, MSG_MORE);	//More data will follow
+	
+	conn->chunk_start = 0;
+	conn->buffered_size = conn->chunked ? HTTP_CHUNK_PREFIX_SIZE : 0;
+}
+
+http_write_handle http_server_begin_write_reply(http_connection conn, const char *code, const char *contentType)
+{
+	/* The length of the reply is not known in advance. HTTP/1.1 clients get it split into chunks, one per buffer flush, so that
+	 * the connection can be reused. Otherwise, the end of the reply is indicated by closing the connection. */
+	conn->chunked = conn->chunked_allowed;
+	if (!conn->chunked)
+		conn->keep_alive = false;
+	
+	int done = format_reply_header(conn, code, contentType);
+	buffer_printf(conn,
+		&done,
+		"%sConnection: %s\r\n\r\n",
+		conn->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+		conn->keep_alive ? "keep-alive" : "close");
+	
+	conn->buffered_size = done;
+	conn->chunk_start = conn->buffered_size;
+	if (conn->chunked)
+		conn->buffered_size += HTTP_CHUNK_PREFIX_SIZE;
+	
+	return (http_write_handle)conn;
+}
+
+void http_server_write_reply(http_write_handle handle, const char *format, ...)
+{
+	http_connection conn = (http_connection)handle;
+	if (conn->discard_body)
+		return;
+	
+	int capacity = conn->server->buffer_size - 2;	//Room for terminating the chunk
+	va_list args;
+	va_start(args, format);
+	int written = vsnprintf(conn->buffer + conn->buffered_size, capacity - conn->buffered_size, format, args);
+	va_end(args);
+	if ((conn->buffered_size + written) < (capacity - 16))
+	{
+		conn->buffered_size += written;
+		return;
+	}
+	
+	flush_reply_buffer(conn);
+	va_start(args, format);
+	written = vsnprintf(conn->buffer + conn->buffered_size, capacity - conn->buffered_size, format, args);
+	va_end(args);
+	conn->buffered_size += MIN(written, capacity - conn->buffered_size - 1);
+}
+
+void http_server_end_write_reply(http_write_handle handle, const char *footer)
+{
+	static const char last_chunk[] = "0\r\n\r\n";
+	http_connection conn = (http_connection)handle;
+	int len = (footer && !conn->discard_body) ? strlen(footer) : 0;
+	if (len && len < (conn->server->buffer_size - 2 - conn->buffered_size))
+	{
+		memcpy(conn->buffer + conn->buffered_size, footer, len);
+		conn->buffered_size += len;
+		len = 0;
+	}
+	
+	if (len)
+	{
+		//The footer does not fit into the buffer, so it is sent separately
+		flush_reply_buffer(conn);
+		if (conn->chunked)
+		{
+			char prefix[16];
+			send_all(conn->link, prefix, snprintf(prefix, sizeof(prefix), "%x\r\n", len), MSG_MORE);
+			send_all(conn->link, footer, len, MSG_MORE);
+			send_all(conn->link, "\r\n", 2, MSG_MORE);
+		}
+		else
+			send_all(conn->link, footer, len, MSG_MORE);
+	}
+	
+	if (conn->chunked)
+	{
+		close_chunk(conn);
+		if (!conn->discard_body)
+		{
+			if ((conn->buffered_size + sizeof(last_chunk) - 1) > conn->server->buffer_size)
+			{
+				send_all(conn->link, conn->buffer, conn->buffered_size, MSG_MORE);
+				conn->buffered_size = 0;
+			}
+			
+			memcpy(conn->buffer + conn->buffered_size, last_chunk, sizeof(last_chunk) - 1);
+			conn->buffered_size += sizeof(last_chunk) - 1;
+		}
+	}
+	
+	if (conn->buffered_size)
+		send_all(conn->link, conn->buffer, conn->buffered_size, 0);
+	
+	conn->buffered_size = 0;
+	conn->chunked = false;
+}
+
+void http_server_write_reply_data(http_write_handle handle, const char *data, int size)
+{
+	http_connection conn = (http_connection)handle;
+	if (conn->discard_body)
+		return;
+	
+	int capacity = conn->server->buffer_size - 2;	//Room for terminating the chunk
+	while (size > 0)
+	{
+		int todo = MIN(size, capacity - conn->buffered_size);
+		if (todo <= 0)
+		{
+			flush_reply_buffer(conn);
+			continue;
+		}
+		
+		memcpy(conn->buffer + conn->buffered_size, data, todo);
+		conn->buffered_size += todo;
+		data += todo;
+		size -= todo;
+	}
+}
+
+static int format_int(char *buf, int value)
+{
+	char digits[10];
+	int count = 0, len = 0;
+	unsigned remaining = value < 0 ? -(unsigned)value : (unsigned)value;
+	do
+	{
+		digits[count++] = '0' + remaining % 10;
+		remaining /= 10;
+	} while (remaining);
+	
+	if (value < 0)
+		buf[len++] = '-';
+	while (count)
+		buf[len++] = digits[--count];
+	return len;
+}
+
+//Returns the free part of the reply buffer if it can take 'size' more bytes. Small fragments are then written directly, without a flush check per fragment.
+static char *reserve_reply_space(http_write_handle handle, int size)
+{
+	http_connection conn = (http_connection)handle;
+	if (conn->discard_body || (conn->buffered_size + size) > (conn->server->buffer_size - 2))
+		return NULL;
+	
+	char *result = conn->buffer + conn->buffered_size;
+	conn->buffered_size += size;
+	return result;
+}
+
+static int json_plain_length(const char *str)
+{
+	int len = 0;
+	while ((unsigned char)str[len] >= 0x20 && str[len] != '"' && str[len] != '\\')
+		len++;
+	return len;
+}
+
+//Writes 'prefix' (if not 0), the quoted string and 'suffix' (if not 0)
+static void json_write_string(http_json_writer *writer, char prefix, const char *str, char suffix)
+{
+	static const char hex[] = "0123456789abcdef";
+	int len = json_plain_length(str);
+	char *p;
+	if (!str[len] && (p = reserve_reply_space(writer->reply, len + 2 + (prefix != 0) + (suffix != 0))))
+	{
+		//Nothing to escape, which is the case for all keys and most values
+		if (prefix)
+			*p++ = prefix;
+		*p++ = '"';
+		memcpy(p, str, len);
+		p[len] = '"';
+		if (suffix)
+			p[len + 1] = suffix;
+		return;
+	}
+	
+	if (prefix)
+		http_server_write_reply_data(writer->reply, &prefix, 1);
+	http_server_write_reply_data(writer->reply, "\"", 1);
+	
+	for (;;)
+	{
+		//Characters that need no escaping are written in one piece
+		len = json_plain_length(str);
+		http_server_write_reply_data(writer->reply, str, len);
+		str += len;
+		if (!*str)
+			break;
+		
+		char escaped[6] = { '\\', *str, 0 };
+		if ((unsigned char)*str < 0x20)
+		{
+			memcpy(escaped + 1, "u00", 3);
+			escaped[4] = hex[*str >> 4];
+			escaped[5] = hex[*str & 0x0F];
+			http_server_write_reply_data(writer->reply, escaped, 6);
+		}
+		else
+			http_server_write_reply_data(writer->reply, escaped, 2);
+		str++;
+	}
+	
+	http_server_write_reply_data(writer->reply, "\"", 1);
+	if (suffix)
+		http_server_write_reply_data(writer->reply, &suffix, 1);
+}
+
+//Writes the separator from the previous item and the key (unless inside an array)
+static void json_begin_item(http_json_writer *writer, const char *key)
+{
+	unsigned mask = 1U << writer->depth;
+	char separator = (writer->has_items & mask) ? ',' : 0;
+	writer->has_items |= mask;
+	
+	if (key)
+		json_write_string(writer, separator, key, ':');
+	else if (separator)
+		http_server_write_reply_data(writer->reply, &separator, 1);
+}
+
+static void json_begin_container(http_json_writer *writer, const char *key, char bracket)
+{
+	json_begin_item(writer, key);
+	http_server_write_reply_data(writer->reply, &bracket, 1);
+	writer->has_items &= ~(1U << ++writer->depth);
+}
+
+void http_json_begin(http_json_writer *writer, http_write_handle reply)
+{
+	writer->reply = reply;
+	writer->has_items = 0;
+	writer->depth = 0;
+}
+
+void http_json_begin_object(http_json_writer *writer, const char *key)
+{
+	json_begin_container(writer, key, '{');
+}
+
+void http_json_end_object(http_json_writer *writer)
+{
+	writer->depth--;
+	http_server_write_reply_data(writer->reply, "}", 1);
+}
+
+void http_json_begin_array(http_json_writer *writer, const char *key)
+{
+	json_begin_container(writer, key, '[');
+}
+
+void http_json_end_array(http_json_writer *writer)
+{
+	writer->depth--;
+	http_server_write_reply_data(writer->reply, "]", 1);
+}
+
+void http_json_string(http_json_writer *writer, const char *key, const char *value)
+{
+	json_begin_item(writer, key);
+	json_write_string(writer, 0, value, 0);
+}
+
+void http_json_int(http_json_writer *writer, const char *key, int value)
+{
+	char buf[12];
+	json_begin_item(writer, key);
+	http_server_write_reply_data(writer->reply, buf, format_int(buf, value));
+}
+
+void http_json_bool(http_json_writer *writer, const char *key, bool value)
+{
+	json_begin_item(writer, key);
+	if (value)
+		http_server_write_reply_data(writer->reply, "true", 4);
+	else
+		http_server_write_reply_data(writer->reply, "false", 5);
+}
+
+void http_json_ipv4(http_json_writer *writer, const char *key, uint32_t address)
+{
+	char buf[18];
+	int len = 0;
+	buf[len++] = '"';
+	for (int i = 0; i < 4; i++)
+	{
+		if (i)
+			buf[len++] = '.';
+		len += format_int(buf + len, (address >> (i * 8)) & 0xFF);
+	}
+	buf[len++] = '"';
+	
+	json_begin_item(writer, key);
+	http_server_write_reply_data(writer->reply, buf, len);
+}
+
+/* Event sources keep the subscribed connections after the handler returns, so they don't take up any workers.
+ * The events are sent without blocking, so a stalled subscriber gets dropped instead of delaying the other ones. */
+struct http_event_source
+{
+	xSemaphoreHandle lock;
+	int max_subscribers;
+	int subscriber_count;
+	char buffer[HTTP_SERVER_EVENT_BUFFER_SIZE];	//Protected by the lock
+	http_link subscribers[1];
+};
+
+http_event_source http_server_create_event_source(int max_subscribers)
+{
+	http_event_source source = (http_event_source)pvPortMalloc(sizeof(struct http_event_source) + (max_subscribers - 1) * sizeof(http_link));
+	if (!source)
+		return NULL;
+	
+	source->lock = xSemaphoreCreateMutex();
+	source->max_subscribers = max_subscribers;
+	source->subscriber_count = 0;
+	return source;
+}
+
+bool http_server_subscribe_events(http_connection conn, http_event_source source)
+{
+	static const char header[] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n";
+	
+	xSemaphoreTake(source->lock, portMAX_DELAY);
+	bool accepted = source->subscriber_count < source->max_subscribers && !conn->discard_body;
+	if (accepted)
+		accepted = send_all(conn->link, header, sizeof(header) - 1, 0);
+	if (accepted)
+		source->subscribers[source->subscriber_count++] = conn->link;
+	xSemaphoreGive(source->lock);
+	
+	if (accepted)
+	{
+		//The event stream never ends, so the connection cannot be used for any further requests
+		conn->keep_alive = false;
+		conn->detached = true;
+	}
+	
+	return accepted;
+}
+
+int http_event_source_get_subscriber_count(http_event_source source)
+{
+	return source->subscriber_count;
+}
+
+void http_event_source_send(http_event_source source, const char *event, const char *data)
+{
+	char *buffer = source->buffer;
+	int len = 0;
+	
+	xSemaphoreTake(source->lock, portMAX_DELAY);
+	if (!data)
+		buffer[len++] = ':';	//Comment line keeping the connections alive
+	else
+	{
+		int event_len = event ? strlen(event) : 0, data_len = strlen(data);
+		if ((event_len + data_len + 16) > sizeof(source->buffer))
+		{
+			xSemaphoreGive(source->lock);
+			debug_printf("HTTP: event too long\n");
+			return;
+		}
+		
+		if (event)
+		{
+			append(buffer, &len, "event: ", 7);
+			append(buffer, &len, event, event_len);
+			append(buffer, &len, "\n", 1);
+		}
+		
+		append(buffer, &len, "data: ", 6);
+		append(buffer, &len, data, data_len);
+	}
+	
+	append(buffer, &len, "\n\n", 2);
+	
+	for (int i = 0; i < source->subscriber_count;)
+	{
+		if (link_try_send(source->subscribers[i], buffer, len))
+			i++;
+		else
+		{
+			link_close(source->subscribers[i]);
+			source->subscribers[i] = source->subscribers[--source->subscriber_count];
+		}
+	}
+	xSemaphoreGive(source->lock);
+}
+
+/* WebSocket support (RFC 6455). The handshake needs the SHA-1 hash of the client's key, so a minimal
+ * SHA-1 implementation is included below. It is only used for the handshake, so it is not optimized for speed. */
+#define WEBSOCKET_OPCODE_CONTINUATION	0x0
+#define WEBSOCKET_OPCODE_TEXT			0x1
+#define WEBSOCKET_OPCODE_BINARY			0x2
+#define WEBSOCKET_OPCODE_CLOSE			0x8
+#define WEBSOCKET_OPCODE_PING			0x9
+#define WEBSOCKET_OPCODE_PONG			0xA
+
+static inline uint32_t rotate_left(uint32_t value, int bits)
+{
+	return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_process_block(uint32_t *state, const uint8_t *block)
+{
+	uint32_t w[80];
+	for (int i = 0; i < 16; i++)
+		w[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+	for (int i = 16; i < 80; i++)
+		w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	for (int i = 0; i < 80; i++)
+	{
+		uint32_t f, k;
+		if (i < 20)
+			f = (b & c) | (~b & d), k = 0x5A827999;
+		else if (i < 40)
+			f = b ^ c ^ d, k = 0x6ED9EBA1;
+		else if (i < 60)
+			f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+		else
+			f = b ^ c ^ d, k = 0xCA62C1D6;
+		
+		uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rotate_left(b, 30);
+		b = a;
+		a = temp;
+	}
+	
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+//Computes the SHA-1 hash of 2 concatenated strings
+static void sha1(const char *part1, const char *part2, uint8_t *hash)
+{
+	uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint8_t block[64];
+	int len1 = strlen(part1), len2 = strlen(part2), total = len1 + len2, pos = 0;
+	
+	//The data is followed by 0x80, zero padding and the 64-bit length in bits
+	int padded = (total + 9 + 63) & ~63;
+	for (int offset = 0; offset < padded; offset += 64)
+	{
+		for (int i = 0; i < 64; i++, pos++)
+		{
+			if (pos < len1)
+				block[i] = part1[pos];
+			else if (pos < total)
+				block[i] = part2[pos - len1];
+			else if (pos == total)
+				block[i] = 0x80;
+			else if (pos >= padded - 4)
+				block[i] = (uint8_t)(((uint32_t)total * 8) >> ((padded - 1 - pos) * 8));
+			else
+				block[i] = 0;
+		}
+		
+		sha1_process_block(state, block);
+	}
+	
+	for (int i = 0; i < 20; i++)
+		hash[i] = state[i / 4] >> ((3 - i % 4) * 8);
+}
+
+static int base64_encode(const uint8_t *data, int size, char *out)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	int len = 0;
+	for (int i = 0; i < size; i += 3)
+	{
+		uint32_t value = data[i] << 16;
+		if (i + 1 < size)
+			value |= data[i + 1] << 8;
+		if (i + 2 < size)
+			value |= data[i + 2];
+		
+		out[len++] = alphabet[(value >> 18) & 0x3F];
+		out[len++] = alphabet[(value >> 12) & 0x3F];
+		out[len++] = (i + 1 < size) ? alphabet[(value >> 6) & 0x3F] : '=';
+		out[len++] = (i + 2 < size) ? alphabet[value & 0x3F] : '=';
+	}
+	
+	out[len] = 0;
+	return len;
+}
+
+bool http_server_accept_websocket(http_connection conn)
+{
+#if HTTP_SERVER_MULTIPLEXED
+	//The handler would block all other clients for the entire lifetime of the WebSocket
+	return false;
+#else
+	if (!conn->websocket_key)
+		return false;
+	
+	uint8_t hash[20];
+	char accept_key[32];
+	sha1(conn->websocket_key, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", hash);
+	base64_encode(hash, sizeof(hash), accept_key);
+	
+	int done = snprintf(conn->buffer,
+		conn->server->buffer_size,
+		"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+		accept_key);
+	
+	//WebSocket connections are long-lived, so they are closed once the handler returns, or once the client stops answering pings
+	conn->keep_alive = false;
+	conn->websocket_key = NULL;
+	set_receive_timeout(conn->link, HTTP_SERVER_WEBSOCKET_PING_INTERVAL_MS);
+	return send_all(conn->link, conn->buffer, done, 0);
+#endif
+}
+
+static bool send_websocket_frame(http_connection conn, int opcode, const char *data, int size)
+{
+	uint8_t header[10];
+	int len = 0;
+	header[len++] = 0x80 | opcode;	//Always a final frame, as the messages we send are not fragmented
+	if (size < 126)
+		header[len++] = size;
+	else if (size < 65536)
+	{
+		header[len++] = 126;
+		header[len++] = size >> 8;
+		header[len++] = size;
+	}
+	else
+	{
+		header[len++] = 127;
+		memset(header + len, 0, 4);
+		len += 4;
+		for (int i = 3; i >= 0; i--)
+			header[len++] = size >> (i * 8);
+	}
+	
+	return send_all(conn->link, (const char *)header, len, size ? MSG_MORE : 0) && send_all(conn->link, data, size, 0);
+}
+
+bool http_websocket_send(http_connection conn, bool binary, const char *data, int size)
+{
+	if (size < 0)
+		size = strlen(data);
+	return send_websocket_frame(conn, binary ? WEBSOCKET_OPCODE_BINARY : WEBSOCKET_OPCODE_TEXT, data, size);
+}
+
+static bool recv_exact(http_link link, void *buffer, int size)
+{
+	while (size > 0)
+	{
+		int done = link_recv(link, buffer, size);
 		if (done <= 0)
 			return false;
 		
-		buf += done;
+		buffer = (char *)buffer + done;
 		size -= done;
 	}
 	
 	return true;
 }
 
-static inline void append(char *buf, int *offset, const char *data, int len)
-{
-	memcpy(buf + *offset, data, len);
-	*offset += len;
-}
-
-static void parse_and_handle_http_request(http_connection ctx)
+//Receives the first byte of the next frame, pinging the client if it stays silent. Any frame (e.g. the pong) counts as an answer.
+static bool wait_for_websocket_frame(http_connection conn, uint8_t *first_byte)
 {
-	int len = recv_line(ctx->socket, ctx->buffer, ctx->server->buffer_size);
-	char *path = NULL;
-	char *header_buf = NULL;
-	int header_buf_size = 0, header_buf_pos = 0, header_buf_used = 0;
-	char host[32];
-	host[0] = 0;
-	enum http_request_type reqtype = HTTP_GET;
-	ctx->post.remaining_input_len = ctx->post.buffer_used = ctx->post.buffer_pos = 0;
-	
-	if (len)
+	uint32_t unanswered = 0;
+	while (unanswered < 2)
 	{
-		//Expected request format: GET <path> HTTP/1.0
-		char *p1 = strchr(ctx->buffer, ' '), *p2 = NULL, *p3 = NULL;
-		if (p1)
-			p2 = strchr(++p1, ' ');
-		
-		if (!strncasecmp(ctx->buffer, "POST ", 5))
-			reqtype = HTTP_POST;
-		
-		if (p2)
-			p3 = strstr(p2, "\r\n");
-		
-		if (p3)
-		{
-			path = p1;
-			*p2 = 0;
-			
-			int off = p3 + 2 - ctx->buffer;
-			header_buf = ctx->buffer + off;
-			header_buf_size = ctx->server->buffer_size - off;
-			header_buf_used = len - off;
-		}
+		uint32_t timeouts = unanswered;
+		TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(HTTP_SERVER_WEBSOCKET_PING_INTERVAL_MS);
+		if (link_recv_until(conn->link, (char *)first_byte, 1, deadline, &unanswered) > 0)
+			break;
+		if (unanswered == timeouts)
+			return false;	//The connection got closed
+		if (unanswered == 1 && !send_websocket_frame(conn, WEBSOCKET_OPCODE_PING, NULL, 0))
+			return false;
 	}
 	
-	if (!header_buf || header_buf_size < 32)
-	{
-		debug_printf("HTTP: invalid first line");
-		return;
-	}
+	//link_recv_until() changes the receive timeout in the socket mode, so it is restored for the rest of the frame
+	set_receive_timeout(conn->link, HTTP_SERVER_WEBSOCKET_PING_INTERVAL_MS);
+	if (unanswered < 2)
+		return true;
 	
+	count_event(&s_Stats.websocket_timeouts);
+	return false;
+}
+
+static void close_websocket(http_connection conn, int status)
+{
+	char payload[2] = { status >> 8, status };
+	send_websocket_frame(conn, WEBSOCKET_OPCODE_CLOSE, payload, sizeof(payload));
+}
+
+int http_websocket_recv(http_connection conn, char *buffer, int size, bool *binary)
+{
+	int total = 0;
 	for (;;)
 	{
-		char *line = recv_next_line_buffered(ctx->socket, header_buf, header_buf_size, &header_buf_used, &header_buf_pos, &len, NULL);
-		if (!line)
+		uint8_t header[8];
+		if (!wait_for_websocket_frame(conn, header) || !recv_exact(conn->link, header + 1, 1))
+			return -1;
+		
+		int opcode = header[0] & 0x0F;
+		bool final = (header[0] & 0x80) != 0;
+		uint32_t len = header[1] & 0x7F;
+		if (!(header[1] & 0x80))
 		{
-			debug_printf("HTTP: unexpected end of headers");
-			return;
+			close_websocket(conn, 1002);	//The frames sent by the clients must be masked
+			return -1;
 		}
 		
-		if (!line[0])
-			break;	//Proper end of headers
-		
-		if (len > 0 && !strncasecmp(line, "Host: ", 6) && (len - 6) < (sizeof(host) - 1))
+		if (len == 126)
 		{
-			memcpy(host, line + 6, len - 6);
-			host[len - 6] = 0;
+			if (!recv_exact(conn->link, header, 2))
+				return -1;
+			len = (header[0] << 8) | header[1];
 		}
-		else if (!strncasecmp(line, "Content-length: ", 16))
+		else if (len == 127)
 		{
-			ctx->post.remaining_input_len = atoi(line + 16);
+			if (!recv_exact(conn->link, header, 8))
+				return -1;
+			if (header[0] | header[1] | header[2] | header[3])
+				len = UINT32_MAX;
+			else
+				len = (header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
 		}
-	}
-	
-	if (reqtype == HTTP_POST && ctx->post.remaining_input_len)
-	{
-		ctx->post.buffer_pos = header_buf_pos;
-		ctx->post.buffer_used = header_buf_used;
-		ctx->post.remaining_input_len -= (header_buf_used - header_buf_pos);
-		ctx->post.offset_from_main_buffer = header_buf - ctx->buffer;
-	}
-	
-	debug_printf("HTTP: %s%s\n", host, path);
-	
-	if (!host_name_matches(ctx, host))
-	{
-		static const char header[] = "HTTP/1.0 302 Found\r\nLocation: http://";
-		static const char footer[] = "\r\nConnection: Close\r\n\r\n";
-		int host_len = strlen(ctx->server->hostname), domain_len = strlen(ctx->server->domain_name);
 		
-		int len = sizeof(header) + sizeof(footer) + host_len + domain_len + 2;
-		if (len < ctx->server->buffer_size)
+		uint8_t mask[4];
+		if (!recv_exact(conn->link, mask, sizeof(mask)))
+			return -1;
+		
+		if (opcode & 0x08)
 		{
-			int off = 0;
-			append(ctx->buffer, &off, header, sizeof(header) - 1);
-			append(ctx->buffer, &off, ctx->server->hostname, host_len);
-			if (domain_len)
+			//Control frames can arrive between the fragments of a message and are handled here
+			char payload[125];
+			if (len > sizeof(payload) || !recv_exact(conn->link, payload, len))
+				return -1;
+			for (int i = 0; i < len; i++)
+				payload[i] ^= mask[i & 3];
+			
+			if (opcode == WEBSOCKET_OPCODE_CLOSE)
 			{
-				append(ctx->buffer, &off, ".", 1);
-				append(ctx->buffer, &off, ctx->server->domain_name, domain_len);
+				send_websocket_frame(conn, WEBSOCKET_OPCODE_CLOSE, payload, MIN(len, 2));
+				return -1;
 			}
-			append(ctx->buffer, &off, footer, sizeof(footer) - 1);
-			send_all(ctx->socket, ctx->buffer, off);
+			else if (opcode == WEBSOCKET_OPCODE_PING)
+				send_websocket_frame(conn, WEBSOCKET_OPCODE_PONG, payload, len);
+			continue;
 		}
-	}
-	else
-	{
-		for (http_zone *zone = ctx->server->first_zone; zone; zone = zone->next)
+		
+		if (opcode != WEBSOCKET_OPCODE_CONTINUATION && binary)
+			*binary = opcode == WEBSOCKET_OPCODE_BINARY;
+		
+		if (len > (uint32_t)(size - total))
 		{
-			if (strncasecmp(path, zone->prefix, zone->prefix_len))
-				continue;
-			
-			int off = zone->prefix_len;
-			if (path[off] == 0 || path[off] == '/')
-			{
-				while (path[off] == '/')
-					off++;
-				
-				if (zone->handler(ctx, reqtype, path + off, zone->context))
-					return;
-			}
+			close_websocket(conn, 1009);	//Message too big
+			return -1;
 		}
 		
-		http_server_send_reply(ctx, "404 Not Found", "text/plain", "File not found", -1);
+		if (!recv_exact(conn->link, buffer + total, len))
+			return -1;
+		for (int i = 0; i < len; i++)
+			buffer[total + i] ^= mask[i & 3];
+		
+		total += len;
+		if (final)
+			return total;
 	}
 }
 
-static void do_handle_connection(void *arg)
+char *http_server_read_post_line(http_connection conn)
 {
-	http_connection ctx = (http_connection)arg;
-	parse_and_handle_http_request(ctx);
-	closesocket(ctx->socket);
-	vPortFree(ctx);
-	xSemaphoreGive(ctx->server->semaphore);
-	vTaskDelete(NULL);
+	if (conn->post.remaining_input_len <= 0 && conn->post.buffer_pos >= conn->post.buffer_used)
+		return NULL;
+	
+	int len = 0;
+	char *result = recv_next_line_buffered(conn, 
+		conn->buffer + conn->post.offset_from_main_buffer,
+		conn->server->buffer_size - conn->post.offset_from_main_buffer,
+		&conn->post.buffer_used,
+		&conn->post.buffer_pos, 
+		&len,
+		&conn->post.remaining_input_len);
+	
+	if (!result)
+		return NULL;
+	
+	if (len < 0)
+		return NULL;	//Too long line got truncated
+	
+	result[len] = 0;
+	
+	return result;
 }
 
-static void http_server_thread(void *arg)
+int http_server_read_body(http_connection conn, void *buffer, int size)
 {
-	http_server_instance sctx = (http_server_instance)arg;
-	
-	while (true)
+	//The part of the body received together with the headers (or by http_server_read_post_line()) goes first
+	int buffered = conn->post.buffer_used - conn->post.buffer_pos;
+	if (buffered > 0)
 	{
-		struct sockaddr_storage remote_addr;
-		socklen_t len = sizeof(remote_addr);
-		int conn_sock = accept(sctx->socket, (struct sockaddr *)&remote_addr, &len);
-		if (conn_sock >= 0)
-		{
-			http_connection cctx = pvPortMalloc(sizeof(struct _http_connection) + sctx->buffer_size);
-			if (cctx)
-			{
-				cctx->server = sctx;
-				cctx->socket = conn_sock;
-				TaskHandle_t task;
-				xSemaphoreTake(sctx->semaphore, portMAX_DELAY);
-				if (xTaskCreate(do_handle_connection, "HTTP Connection", configMINIMAL_STACK_SIZE, cctx, tskIDLE_PRIORITY + 2, &task) != pdTRUE)
-				{
-					vPortFree(cctx);
-					xSemaphoreGive(sctx->semaphore);
-					cctx = NULL;
-				}
-			}
-			
-			if (!cctx)
-				closesocket(conn_sock);
-		}
+		int todo = MIN(buffered, size);
+		memcpy(buffer, conn->buffer + conn->post.offset_from_main_buffer + conn->post.buffer_pos, todo);
+		conn->post.buffer_pos += todo;
+		return todo;
 	}
+	
+	if (conn->post.remaining_input_len <= 0)
+		return 0;
+	
+	//The rest is received directly into the caller's buffer
+	int done = recv_body(conn, buffer, MIN(size, conn->post.remaining_input_len));
+	if (done <= 0)
+		return -1;
+	
+	conn->post.remaining_input_len -= done;
+	return done;
 }
 
-http_server_instance http_server_create(const char *main_host, const char *main_domain, int max_thread_count, int buffer_size)
+char *http_server_read_body_chunk(http_connection conn, int *size)
 {
-	int server_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-	struct sockaddr_in listen_addr =
-	{
-		.sin_len = sizeof(struct sockaddr_in),
-		.sin_family = AF_INET,
-		.sin_port = htons(80),
-		.sin_addr = 0,
-	};
-    
-	if (server_sock < 0)
-	{
-		debug_printf("Unable to create HTTP socket: error %d", errno);
-		return NULL;
-	}
-
-	if (bind(server_sock, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0)
+	char *base = conn->buffer + conn->post.offset_from_main_buffer;
+	if (conn->post.buffer_pos >= conn->post.buffer_used)
 	{
-		closesocket(server_sock);
-		debug_printf("Unable to bind HTTP socket: error %d\n", errno);
-		return NULL;
+		if (conn->post.remaining_input_len <= 0)
+			return NULL;
+		
+		//The part of the buffer after the path (and the captured headers) is free while the body is being read
+		int done = recv_body(conn, base, MIN(conn->server->buffer_size - conn->post.offset_from_main_buffer, conn->post.remaining_input_len));
+		if (done <= 0)
+			return NULL;
+		
+		conn->post.remaining_input_len -= done;
+		conn->post.buffer_pos = 0;
+		conn->post.buffer_used = done;
 	}
+	
+	*size = conn->post.buffer_used - conn->post.buffer_pos;
+	char *result = base + conn->post.buffer_pos;
+	conn->post.buffer_pos = conn->post.buffer_used;
+	return result;
+}
 
-	if (listen(server_sock, max_thread_count * 2) < 0)
+//Moves the unread part of the body to the beginning of the post buffer and receives more data after it
+static bool fill_post_buffer(http_connection conn)
+{
+	char *base = conn->buffer + conn->post.offset_from_main_buffer;
+	if (conn->post.buffer_pos)
 	{
-		closesocket(server_sock);
-		debug_printf("Unable to listen on HTTP socket: error %d\n", errno);
-		return NULL;
+		memmove(base, base + conn->post.buffer_pos, conn->post.buffer_used - conn->post.buffer_pos);
+		conn->post.buffer_used -= conn->post.buffer_pos;
+		conn->post.buffer_pos = 0;
 	}
 	
-	http_server_instance ctx = (http_server_instance)pvPortMalloc(sizeof(struct _http_server_instance));
-	if (!ctx)
+	int todo = MIN(conn->server->buffer_size - conn->post.offset_from_main_buffer - conn->post.buffer_used, conn->post.remaining_input_len);
+	if (todo <= 0)
+		return false;
+	
+	int done = recv_body(conn, base + conn->post.buffer_used, todo);
+	if (done <= 0)
+		return false;
+	
+	conn->post.remaining_input_len -= done;
+	conn->post.buffer_used += done;
+	return true;
+}
+
+//Boyer-Moore-Horspool search. On mismatch, the window is shifted based on its last byte, so the body is mostly checked at every len-th byte.
+static int find_delimiter(const char *data, int size, const char *delimiter, int len, const uint8_t *shift)
+{
+	for (int i = 0; i <= size - len; i += shift[(uint8_t)data[i + len - 1]])
 	{
-		closesocket(server_sock);
-		return NULL;
+		if (data[i + len - 1] == delimiter[len - 1] && !memcmp(data + i, delimiter, len - 1))
+			return i;
 	}
-
-	ctx->socket = server_sock;
-	ctx->semaphore = xSemaphoreCreateCounting(max_thread_count, max_thread_count);
-	ctx->hostname = main_host;
-	ctx->domain_name = main_domain;
-	ctx->buffer_size = buffer_size;
-	ctx->first_zone = NULL;
 	
-	TaskHandle_t task;
-	xTaskCreate(http_server_thread, "HTTP Server", configMINIMAL_STACK_SIZE, ctx, tskIDLE_PRIORITY + 2, &task);
-	return ctx;
+	return -1;
 }
 
-void http_server_add_zone(http_server_instance server, http_zone *zone, const char *prefix, http_request_handler handler, void *context)
+enum http_multipart_state
 {
-	zone->next = server->first_zone;
-	zone->prefix = prefix;
-	zone->prefix_len = strlen(prefix);
-	zone->handler = handler;
-	zone->context = context;
-	server->first_zone = zone;
+	HTTP_MULTIPART_PREAMBLE,
+	HTTP_MULTIPART_DELIMITER,	//After a delimiter: either CRLF (next part), or '--' (end of body)
+	HTTP_MULTIPART_HEADERS,
+	HTTP_MULTIPART_BODY,
+};
+
+bool http_server_read_multipart_body(http_connection conn, const http_multipart_handler *handler)
+{
+	const char *boundary = conn->request_headers->multipart_boundary;
+	if (!boundary[0])
+		return false;
+	
+	//Each delimiter except the first one is preceded by CRLF that belongs to it, not to the part body
+	char delimiter[HTTP_MULTIPART_MAX_BOUNDARY + 5];
+	int len = snprintf(delimiter, sizeof(delimiter), "\r\n--%s", boundary);
+	uint8_t shift[256];
+	memset(shift, len, sizeof(shift));
+	for (int i = 0; i < len - 1; i++)
+		shift[(uint8_t)delimiter[i]] = len - 1 - i;
+	
+	enum http_multipart_state state = HTTP_MULTIPART_PREAMBLE;
+	bool at_start = true;
+	for (;;)
+	{
+		char *data = conn->buffer + conn->post.offset_from_main_buffer + conn->post.buffer_pos;
+		int avail = conn->post.buffer_used - conn->post.buffer_pos;
+		int consumed = -1;	//Not enough data to proceed
+		
+		switch (state)
+		{
+		case HTTP_MULTIPART_PREAMBLE:
+			if (at_start)
+			{
+				//The body normally starts with the first delimiter right away
+				if (avail < len - 2)
+					break;
+				
+				at_start = false;
+				if (!memcmp(data, delimiter + 2, len - 2))
+				{
+					consumed = len - 2;
+					state = HTTP_MULTIPART_DELIMITER;
+					break;
+				}
+			}
+			//fall through
+		case HTTP_MULTIPART_BODY:
+		{
+			int pos = find_delimiter(data, avail, delimiter, len, shift);
+			if (pos >= 0)
+			{
+				if (state == HTTP_MULTIPART_BODY && !handler->part_data(handler->context, data, pos, true))
+					return false;
+				
+				consumed = pos + len;
+				state = HTTP_MULTIPART_DELIMITER;
+			}
+			else if (avail >= len)
+			{
+				//Everything except the last len - 1 bytes (that could be the beginning of the delimiter) belongs to the part
+				consumed = avail - len + 1;
+				if (state == HTTP_MULTIPART_BODY && !handler->part_data(handler->context, data, consumed, false))
+					return false;
+			}
+			break;
+		}
+		case HTTP_MULTIPART_DELIMITER:
+			if (avail < 2)
+				break;
+			
+			if (!memcmp(data, "--", 2))
+			{
+				//Final delimiter. Skip the epilogue, so that the connection can be reused.
+				do
+					conn->post.buffer_pos = conn->post.buffer_used;
+				while (fill_post_buffer(conn));
+				return conn->post.remaining_input_len <= 0;
+			}
+			
+			if (memcmp(data, "\r\n", 2))
+				return false;
+			
+			consumed = 2;
+			state = HTTP_MULTIPART_HEADERS;
+			break;
+		case HTTP_MULTIPART_HEADERS:
+		{
+			char *eol = find_newline(data, data + avail), *value, *end;
+			if (!eol)
+				break;
+			
+			consumed = eol + 1 - data;
+			int line_len = eol - data, name_len;
+			if (line_len && data[line_len - 1] == '\r')
+				line_len--;
+			data[line_len] = 0;
+			
+			if (!line_len)
+				state = HTTP_MULTIPART_BODY;
+			else if ((name_len = split_header_line(data, line_len, &value, &end)) >= 0)
+			{
+				data[name_len] = *end = 0;
+				if (handler->part_header && !handler->part_header(handler->context, data, value))
+					return false;
+			}
+			break;
+		}
+		}
+		
+		if (consumed >= 0)
+			conn->post.buffer_pos += consumed;
+		else if (!fill_post_buffer(conn))
+			return false;	//Truncated body, or a part header that doesn't fit into the buffer
+	}
 }
 
-void http_server_send_reply(http_connection conn, const char *code, const char *contentType, const char *content, int size)
+//Decodes '+' and %XX escapes in place. Malformed escapes are kept as is. Returns the length of the decoded string.
+static int url_decode(char *str)
 {
-	if (size < 0)
-		size = strlen(content);
+	char *out = str;
+	for (char *p = str; *p; p++)
+	{
+		if (*p == '+')
+			*out++ = ' ';
+		else if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2]))
+		{
+			char hex[3] = { p[1], p[2], 0 };
+			*out++ = (char)strtoul(hex, NULL, 16);
+			p += 2;
+		}
+		else
+			*out++ = *p;
+	}
 	
-	int done = snprintf(conn->buffer, conn->server->buffer_size, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", code, contentType, size);
-	send_all(conn->socket, conn->buffer, done);
-	send_all(conn->socket, content, size);
+	*out = 0;
+	return out - str;
 }
 
-http_write_handle http_server_begin_write_reply(http_connection conn, const char *code, const char *contentType)
+//32-bit FNV-1a of the lowercase name
+static uint32_t http_form_hash(const char *name, int len)
 {
-	conn->buffered_size = snprintf(conn->buffer, conn->server->buffer_size, "HTTP/1.0 %s\r\nContent-Type: %s\r\nConnection: close\r\n\r\n", code, contentType);
-	return (http_write_handle)conn;
+	uint32_t hash = 2166136261U;
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ (uint8_t)tolower((unsigned char)name[i])) * 16777619U;
+	return hash;
 }
 
-void http_server_write_reply(http_write_handle handle, const char *format, ...)
+char *http_form_split_query(char *path)
 {
-	http_connection conn = (http_connection)handle;
-	va_list args;
-	va_start(args, format);
-	int written = vsnprintf(conn->buffer + conn->buffered_size, conn->server->buffer_size - conn->buffered_size, format, args);
-	va_end(args);
-	if ((conn->buffered_size + written) < (conn->server->buffer_size - 16))
-	{
-		conn->buffered_size += written;
-		return;
-	}
+	char *query = strchr(path, '?');
+	if (!query)
+		return path + strlen(path);
 	
-	send_all(conn->socket, conn->buffer, conn->buffered_size);
-	va_start(args, format);
-	conn->buffered_size = vsnprintf(conn->buffer, conn->server->buffer_size, format, args);
-	va_end(args);
+	*query++ = 0;
+	return query;
 }
 
-void http_server_end_write_reply(http_write_handle handle, const char *footer)
+bool http_form_next_field(char **cursor, http_form_field *field)
 {
-	http_connection conn = (http_connection)handle;
-	int len = footer ? strlen(footer) : 0;
-	if (len && len < (conn->server->buffer_size - conn->buffered_size))
-	{
-		memcpy(conn->buffer + conn->buffered_size, footer, len);
-		conn->buffered_size += len;
-		len = 0;
-	}
+	char *p = *cursor;
+	while (*p == '&')
+		p++;
+	if (!*p)
+		return false;
 	
-	if (conn->buffered_size)
-		send_all(conn->socket, conn->buffer, conn->buffered_size);
+	char *end = strchr(p, '&');
+	if (end)
+		*end++ = 0;
+	else
+		end = p + strlen(p);
 	
-	if (len)
-		send_all(conn->socket, footer, len);
+	char *eq = strchr(p, '=');
+	if (eq)
+		*eq++ = 0;
 	
-	conn->buffered_size = 0;
+	field->name = p;
+	field->value = eq ? eq : p + strlen(p);	//A field without '=' gets an empty value
+	field->hash = http_form_hash(p, url_decode(p));
+	url_decode(field->value);
+	*cursor = end;
+	return true;
 }
 
-char *http_server_read_post_line(http_connection conn)
+int http_form_find_key(http_form_keys *keys, const http_form_field *field)
 {
-	if (conn->post.remaining_input_len <= 0 && conn->post.buffer_pos >= conn->post.buffer_used)
-		return NULL;
-	
-	int len = 0;
-	char *result = recv_next_line_buffered(conn->socket, 
-		conn->buffer + conn->post.offset_from_main_buffer,
-		conn->server->buffer_size - conn->post.offset_from_main_buffer,
-		&conn->post.buffer_used,
-		&conn->post.buffer_pos, 
-		&len,
-		&conn->post.remaining_input_len);
-	
-	if (!result)
-		return NULL;
-	
-	if (len < 0)
-		return NULL;	//Too long line got truncated
+	if (!keys->hashes_ready)
+	{
+		for (int i = 0; i < keys->count; i++)
+			keys->hashes[i] = http_form_hash(keys->names[i], strlen(keys->names[i]));
+		keys->hashes_ready = true;	//Computing the hashes again on another thread is harmless
+	}
 	
-	result[len] = 0;
+	for (int i = 0; i < keys->count; i++)
+		if (keys->hashes[i] == field->hash && !strcasecmp(keys->names[i], field->name))
+			return i;
 	
-	return result;
+	return -1;
 }
@@ -2,11 +2,28 @@
 
 typedef struct _http_server_instance *http_server_instance;
 typedef struct _http_connection *http_connection, *http_write_handle;
+typedef struct http_event_source *http_event_source;
 
 enum http_request_type
 {
 	HTTP_GET  = 0,
 	HTTP_POST = 1,
+	HTTP_HEAD = 2,
+	HTTP_WEBSOCKET = 3,	//GET request asking to upgrade the connection to a WebSocket
+};
+
+#define HTTP_METHOD_GET		(1 << HTTP_GET)
+#define HTTP_METHOD_POST	(1 << HTTP_POST)
+#define HTTP_METHOD_HEAD	(1 << HTTP_HEAD)
+#define HTTP_METHOD_WEBSOCKET	(1 << HTTP_WEBSOCKET)
+#define HTTP_METHOD_ANY		(HTTP_METHOD_GET | HTTP_METHOD_POST | HTTP_METHOD_HEAD)
+
+//Zones in different lanes have separate worker budgets and priorities (see http_server_set_lane_limits())
+enum http_lane
+{
+	HTTP_LANE_DEFAULT = 0,	//API calls and other short requests
+	HTTP_LANE_BULK = 1,	//Large downloads that can hold a worker for a long time on a slow link
+	HTTP_LANE_COUNT,
 };
 
 typedef bool(*http_request_handler)(http_connection conn, enum http_request_type type, char *path, void *context);
@@ -16,19 +33,209 @@ typedef struct http_zone
 	const char *prefix;
 	http_request_handler handler;
 	void *context;
-	struct http_zone *next;
 	int prefix_len;
+	int methods;	//Combination of HTTP_METHOD_xxx flags
+	bool exact;	//Only matches the prefix itself, not the paths below it
+	enum http_lane lane;
+	int max_body_size;
 } http_zone;
 
 
 http_server_instance http_server_create(const char *main_host, const char *main_domain, int max_thread_count, int buffer_size);
 void http_server_add_zone(http_server_instance server, http_zone *instance, const char *prefix, http_request_handler handler, void *context);
+
+/* Requests are routed to the zone with the longest prefix that ends at a '/' in the path (or at its end), regardless of the registration order.
+ * If the handler returns false, the zone with the next shorter matching prefix gets tried. HEAD requests are also routed to the zones
+ * accepting GET, and the body of the reply is discarded automatically. */
+void http_server_add_zone_ex(http_server_instance server, http_zone *instance, const char *prefix, int methods, bool exact, http_request_handler handler, void *context);
+
+/* Declares the request headers the handlers need in addition to the ones parsed by the server itself (e.g. Cookie or Authorization).
+ * The list is NULL-terminated and must stay valid. The declared headers are captured for every request, regardless of the zone
+ * handling it, so any handler can read them via http_server_get_request_header(). Their values are stored in the connection
+ * buffer while the headers are parsed, so the headers that were never declared take no memory. */
+void http_server_capture_request_headers(http_server_instance server, const char *const *names);
+
+typedef struct
+{
+	uint32_t connections;	//Connections accepted for serving
+	uint32_t shed_connections;	//Connections answered with '503 Service Unavailable' because no worker was free
+	uint32_t queued_connections;	//Connections currently waiting for a free worker
+	uint32_t max_queued_connections;
+	uint32_t queued_requests;	//Requests that waited for a free slot of their lane without holding a worker
+	uint32_t shed_requests;	//Requests answered with '503 Service Unavailable' because too many requests were waiting for their lanes
+	uint32_t requests;	//Requests passed to the zone handlers
+	uint32_t idle_timeouts;	//Persistent connections closed while waiting for the next request
+	uint32_t idle_released;	//Idle persistent connections closed early to free the worker for the queued connections
+	uint32_t header_timeouts;	//Clients that did not send the request line and the headers in time
+	uint32_t body_timeouts;	//Clients that did not send the request body in time
+	uint32_t send_timeouts;	//Clients that stopped accepting the reply
+	uint32_t websocket_timeouts;	//WebSocket clients that did not answer a ping
+} http_server_stats;
+
+//Returns the counters accumulated by all server instances since startup
+void http_server_get_stats(http_server_stats *stats);
+
+//Moves the zone to another lane (all zones start in HTTP_LANE_DEFAULT). Call it after http_server_add_zone_ex().
+void http_server_set_zone_lane(http_zone *zone, enum http_lane lane);
+
+//Raises (or lowers) the maximum Content-Length of the POST requests accepted by the zone from HTTP_SERVER_MAX_BODY_SIZE
+void http_server_set_zone_max_body_size(http_zone *zone, int size);
+
+/* Limits the number of workers that can run the handlers of the lane at the same time, and sets their priority while they do.
+ * The lane is picked after the request headers have been parsed, based on the matching zone. If the lane is full, the request
+ * waits in the queue of the lane without holding a worker, so other lanes keep being served, and is resumed by the first worker
+ * that finds a free slot. Only when HTTP_SERVER_MAX_QUEUED_REQUESTS requests are already waiting, it is answered with
+ * '503 Service Unavailable'. By default, each lane can use all workers at HTTP_SERVER_WORKER_PRIORITY.
+ * The lanes are not used in the multiplexed mode, as it has a single task. */
+void http_server_set_lane_limits(http_server_instance server, enum http_lane lane, int max_workers, int priority);
+
+//Returns the value of a header declared via http_server_capture_request_headers(), or NULL if the request didn't have it (or it didn't fit into the buffer)
+const char *http_server_get_request_header(http_connection conn, const char *name);
+
 void http_server_send_reply(http_connection conn, const char *code, const char *contentType, const char *content, int size);
 
+/* Adds a header to the reply sent by the handler (e.g. ETag). The strings are not copied, so they must stay valid until the reply is sent. */
+void http_server_add_reply_header(http_connection conn, const char *name, const char *value);
+
+//Checks whether the If-None-Match header of the request lists the quoted entity tag (or is '*')
+bool http_server_etag_matches(http_connection conn, const char *etag);
+
+enum
+{
+	HTTP_ENCODING_GZIP = 1,
+	HTTP_ENCODING_BROTLI = 2,
+};
+
+int http_server_get_content_length(http_connection conn);
+
+//Returns the content codings accepted by the client (HTTP_ENCODING_xxx mask) according to the Accept-Encoding header
+int http_server_get_accepted_encodings(http_connection conn);
+
+enum http_range_status
+{
+	HTTP_RANGE_NONE,	//No (supported) Range header, or If-Range didn't match: send the entire entity
+	HTTP_RANGE_PARTIAL,
+	HTTP_RANGE_UNSATISFIABLE,
+};
+
+/* Checks the Range header of the request against an entity of the given size and returns the requested part of it.
+ * If-Range is only considered matching if it equals the strong entity tag passed here. Only single ranges are supported. */
+enum http_range_status http_server_get_range(http_connection conn, const char *etag, uint32_t size, uint32_t *offset, uint32_t *length);
+
+/* Sends a '206 Partial Content' reply with the given part of the content ('416 Range Not Satisfiable' or '200 OK' with
+ * the entire content, depending on the status returned by http_server_get_range()). */
+void http_server_send_partial_reply(http_connection conn, enum http_range_status status, const char *contentType, const char *content, uint32_t offset, uint32_t length, uint32_t total_size);
+
+//Sends a '304 Not Modified' reply with the headers added via http_server_add_reply_header(), but without any body
+void http_server_send_not_modified(http_connection conn);
+
+/* Disables the Nagle algorithm while handling the current request, so that the reply is sent out without waiting for the
+ * acknowledgement of the previous ones. Useful for the endpoints polled by the clients with small requests.
+ * The algorithm gets enabled again once the handler returns, so other requests on the same connection are not affected. */
+void http_server_set_nodelay(http_connection conn, bool nodelay);
+
 /* Reads a single line from the POST request using the internal connection buffer. Returns NULL when the entire request has been read. */
 char *http_server_read_post_line(http_connection conn);
 
+/* Reads up to 'size' bytes of the raw request body (e.g. a binary upload), starting with the part received together with the headers.
+ * Returns the number of bytes read, 0 once the entire body has been read, or -1 if the connection was closed or timed out.
+ * Can be mixed with http_server_read_post_line() and http_server_read_body_chunk(). */
+int http_server_read_body(http_connection conn, void *buffer, int size);
+
+/* Zero-copy variant of http_server_read_body(): returns the next part of the body directly from the connection buffer and stores its size in *size.
+ * The data stays valid until the next call to any of the body reading functions. Returns NULL once the entire body has been read. */
+char *http_server_read_body_chunk(http_connection conn, int *size);
+
+typedef struct
+{
+	//Called for each header of a part, e.g. name='Content-Disposition', value='form-data; name="file"; filename="a.bin"'. Return false to abort.
+	bool (*part_header)(void *context, const char *name, const char *value);
+	//Called with consecutive pieces of the part body. 'last' is set for the final piece of the part (that may be empty). Return false to abort.
+	bool (*part_data)(void *context, const char *data, int size, bool last);
+	void *context;
+} http_multipart_handler;
+
+/* Parses a multipart/form-data (or any other multipart) request body, e.g. a file upload from a HTML form. Only the connection buffer
+ * is used, regardless of the size of the parts, and binary parts are passed as is. Returns false if the request is not multipart,
+ * the body is malformed or truncated, or a callback returned false. */
+bool http_server_read_multipart_body(http_connection conn, const http_multipart_handler *handler);
+
+/* Extracts a parameter from a header value like 'form-data; name="file"; filename="a.bin"'.
+ * Returns false if the parameter is missing or doesn't fit into the buffer. */
+bool http_server_get_header_param(const char *value, const char *param, char *buffer, int size);
+
+typedef struct
+{
+	char *name, *value;	//Both are URL-decoded
+	uint32_t hash;	//Hash of the name, see http_form_find_key()
+} http_form_field;
+
+/* Iterates over the fields of a query string or a URL-encoded form (e.g. 'v=1&name=a%20b'), decoding them in place.
+ * Set *cursor to the start of the string before the first call. Returns false once there are no more fields. */
+bool http_form_next_field(char **cursor, http_form_field *field);
+
+//Terminates the path at '?' and returns the query string after it (or an empty string if there is none)
+char *http_form_split_query(char *path);
+
+typedef struct
+{
+	const char *const *names;
+	int count;
+	uint32_t *hashes;	//Must hold 'count' entries. Computed on the first lookup.
+	bool hashes_ready;
+} http_form_keys;
+
+/* Returns the index of the field name in keys->names (ignoring case), or -1 if it is not there.
+ * Only the names with a matching hash are compared, so handlers can look up fields without a chain of strcmp() calls. */
+int http_form_find_key(http_form_keys *keys, const http_form_field *field);
+
 
 http_write_handle http_server_begin_write_reply(http_connection conn, const char *code, const char *contentType);
 void http_server_write_reply(http_write_handle handle, const char *format, ...);
 void http_server_end_write_reply(http_write_handle handle, const char *footer);
+
+/* Appends the data to the reply as is. Unlike http_server_write_reply(), the data can be larger than the buffer:
+ * it is sent out in as many pieces as needed. */
+void http_server_write_reply_data(http_write_handle handle, const char *data, int size);
+
+/* Typed JSON builder on top of a reply started with http_server_begin_write_reply(). It takes care of the separators and
+ * escaping, and writes directly into the connection buffer without going through the printf() formatting.
+ * The key should be NULL for the top-level value and the array items. */
+typedef struct
+{
+	http_write_handle reply;
+	unsigned has_items;	//Bit N is set once the object/array at nesting level N has an item
+	int depth;
+} http_json_writer;
+
+void http_json_begin(http_json_writer *writer, http_write_handle reply);
+void http_json_begin_object(http_json_writer *writer, const char *key);
+void http_json_end_object(http_json_writer *writer);
+void http_json_begin_array(http_json_writer *writer, const char *key);
+void http_json_end_array(http_json_writer *writer);
+void http_json_string(http_json_writer *writer, const char *key, const char *value);
+void http_json_int(http_json_writer *writer, const char *key, int value);
+void http_json_bool(http_json_writer *writer, const char *key, bool value);
+void http_json_ipv4(http_json_writer *writer, const char *key, uint32_t address);	//Written as a "a.b.c.d" string
+
+/* Server-sent events (text/event-stream). A handler can subscribe the connection to an event source instead of replying.
+ * The connection is then released from the worker and stays open until sending an event to it fails. */
+http_event_source http_server_create_event_source(int max_subscribers);
+
+/* Sends the reply header and hands the connection over to the event source. Returns false if the source is full
+ * (the handler should then send a regular reply). */
+bool http_server_subscribe_events(http_connection conn, http_event_source source);
+int http_event_source_get_subscriber_count(http_event_source source);
+
+/* Sends an event to all subscribers. The event name can be NULL, and the data must be a single line.
+ * If the data is NULL, a comment is sent instead, allowing to detect the closed connections. */
+void http_event_source_send(http_event_source source, const char *event, const char *data);
+
+/* WebSocket support. The zones registered with HTTP_METHOD_WEBSOCKET receive the upgrade requests, and can call
+ * http_server_accept_websocket() to complete the handshake. The handler can then exchange messages with the client
+ * until it returns, closing the connection. Not available in the multiplexed mode. */
+bool http_server_accept_websocket(http_connection conn);
+
+//Receives the next message (ping/pong/close frames are handled internally). Returns its size, or -1 if the connection got closed or the message did not fit into the buffer.
+int http_websocket_recv(http_connection conn, char *buffer, int size, bool *binary);
+bool http_websocket_send(http_connection conn, bool binary, const char *data, int size);
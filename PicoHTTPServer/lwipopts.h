@@ -16,10 +16,29 @@
 #define DEFAULT_UDP_RECVMBOX_SIZE TCPIP_MBOX_SIZE
 #define DEFAULT_TCP_RECVMBOX_SIZE TCPIP_MBOX_SIZE
 #define DEFAULT_ACCEPTMBOX_SIZE TCPIP_MBOX_SIZE
+#if HTTP_SERVER_MULTIPLEXED
+// each client of the multiplexed HTTP server keeps its own socket open
+#define MEMP_NUM_NETCONN 24
+#define MEMP_NUM_TCP_PCB 20
+#else
 #define MEMP_NUM_NETCONN (TCPIP_MBOX_SIZE * 2)
+#endif
 
 #define LWIP_TIMEVAL_PRIVATE 0
 
+// needed for the HTTP keep-alive timeout
+#define LWIP_SO_RCVTIMEO 1
+// lets the HTTP server drop clients that stop reading the reply
+#define LWIP_SO_SNDTIMEO 1
+
+#if HTTP_SERVER_USE_RAW_API
+// lets the raw API backend send files straight from the FLASH memory: each queued segment then takes
+// a PBUF_ROM referencing the file contents instead of a copy of it in the heap
+#undef LWIP_NETIF_TX_SINGLE_PBUF
+#define LWIP_NETIF_TX_SINGLE_PBUF 0
+#define MEMP_NUM_PBUF 48
+#endif
+
 // not necessary, can be done either way
 #define LWIP_TCPIP_CORE_LOCKING_INPUT 1
 #endif
@@ -5,6 +5,7 @@
 
 #include <lwip/ip4_addr.h>
 #include <lwip/netif.h>
+#include <lwip/tcpip.h>
 
 #include <FreeRTOS.h>
 #include <semphr.h>
@@ -14,10 +15,21 @@
 #include "dns/dnsserver.h"
 #include "server_settings.h"
 #include "httpserver.h"
+#include "ota.h"
+#include "cpu_usage.h"
 #include "../tools/SimpleFSBuilder/SimpleFS.h"
 
 #define TEST_TASK_PRIORITY (tskIDLE_PRIORITY + 2UL)
 
+//Cores the lwIP tcpip thread can run on with the SMP kernel (the DHCP server runs on it too, as it uses the raw UDP API)
+#ifndef NETWORK_CORE_AFFINITY
+#define NETWORK_CORE_AFFINITY tskNO_AFFINITY
+#endif
+
+#define PIN_EVENT_INTERVAL_MS 100	//Pin changes within this interval are coalesced into one event
+#define PIN_EVENT_PING_INTERVAL_MS 2000	//Lets the page detect a lost connection, and the server detect closed ones
+#define PIN_EVENT_MAX_SUBSCRIBERS 4
+
 struct SimpleFSContext
 {
 	GlobalFSHeader *header;
@@ -42,11 +54,55 @@ static bool do_retrieve_file(http_connection conn, enum http_request_type type,
 	{
 		if (!strcmp(s_SimpleFS.names + s_SimpleFS.entries[i].NameOffset, path))
 		{
-			http_server_send_reply(conn, 
-				"200 OK", 
-				s_SimpleFS.names + s_SimpleFS.entries[i].ContentTypeOffset,
-				s_SimpleFS.data + s_SimpleFS.entries[i].DataOffset,
-				s_SimpleFS.entries[i].FileSize);
+			const StoredFileEntry *entry = &s_SimpleFS.entries[i];
+			const char *etag = s_SimpleFS.names + entry->ETagOffset;
+			const char *cache_control = s_SimpleFS.names + entry->CacheControlOffset;
+			if (cache_control[0])
+				http_server_add_reply_header(conn, "Cache-Control", cache_control);	//Comes from the www_cache_rules.txt file
+			
+			//SimpleFSBuilder stores precompressed variants of the files, so we pick the smallest one the browser can decode.
+			//Files built with --drop-uncompressed have no plain version, so they are always sent gzipped.
+			const char *data = s_SimpleFS.data + entry->DataOffset;
+			uint32_t size = entry->FileSize;
+			const char *encoding = NULL;
+			int accepted = http_server_get_accepted_encodings(conn);
+			if (entry->Variants[kSimpleFSVariantBrotli].Size && (accepted & HTTP_ENCODING_BROTLI))
+			{
+				data = s_SimpleFS.data + entry->Variants[kSimpleFSVariantBrotli].DataOffset;
+				size = entry->Variants[kSimpleFSVariantBrotli].Size;
+				encoding = "br";
+			}
+			else if (entry->Variants[kSimpleFSVariantGzip].Size && ((accepted & HTTP_ENCODING_GZIP) || !entry->FileSize))
+			{
+				data = s_SimpleFS.data + entry->Variants[kSimpleFSVariantGzip].DataOffset;
+				size = entry->Variants[kSimpleFSVariantGzip].Size;
+				encoding = "gzip";
+			}
+			
+			//The ETag is a hash of the file computed by SimpleFSBuilder, so the browsers only download the files that have changed.
+			//Each variant gets its own strong tag ("<hash>-gzip"), so that the ranges of different variants are never mixed.
+			char variant_etag[48];
+			if (encoding)
+			{
+				snprintf(variant_etag, sizeof(variant_etag), "%.*s-%s\"", (int)strlen(etag) - 1, etag, encoding);
+				etag = variant_etag;
+				http_server_add_reply_header(conn, "Content-Encoding", encoding);
+			}
+			if (entry->Variants[kSimpleFSVariantGzip].Size || entry->Variants[kSimpleFSVariantBrotli].Size)
+				http_server_add_reply_header(conn, "Vary", "Accept-Encoding");
+			http_server_add_reply_header(conn, "ETag", etag);
+			
+			if (http_server_etag_matches(conn, etag))
+			{
+				http_server_send_not_modified(conn);
+				return true;
+			}
+			
+			//The files are sent directly from FLASH, so serving a part of the file is as cheap as serving all of it
+			uint32_t offset = 0, length = size;
+			http_server_add_reply_header(conn, "Accept-Ranges", "bytes");
+			enum http_range_status range = http_server_get_range(conn, etag, size, &offset, &length);
+			http_server_send_partial_reply(conn, range, s_SimpleFS.names + entry->ContentTypeOffset, data, offset, length, size);
 			return true;
 		}
 	}
@@ -54,74 +110,105 @@ static bool do_retrieve_file(http_connection conn, enum http_request_type type,
 	return false;
 }
 
+enum server_setting
+{
+	SETTING_HAS_PASSWORD,
+	SETTING_USE_DOMAIN,
+	SETTING_USE_SECOND_IP,
+	SETTING_DNS_IGNORES_NETWORK_SUFFIX,
+	SETTING_SSID,
+	SETTING_PASSWORD,
+	SETTING_HOSTNAME,
+	SETTING_DOMAIN,
+	SETTING_IPADDR,
+	SETTING_NETMASK,
+	SETTING_IPADDR2,
+	SETTING_COUNT,
+};
+
+static const char *const s_SettingNames[SETTING_COUNT] = {
+	"has_password", "use_domain", "use_second_ip", "dns_ignores_network_suffix", "ssid", "password",
+	"hostname", "domain", "ipaddr", "netmask", "ipaddr2",
+};
+
+static uint32_t s_SettingHashes[SETTING_COUNT];
+static http_form_keys s_SettingKeys = { s_SettingNames, SETTING_COUNT, s_SettingHashes };
+
+static bool parse_bool_setting(const char *value)
+{
+	return !strcasecmp(value, "true") || value[0] == '1';
+}
+
 static char *parse_server_settings(http_connection conn, pico_server_settings *settings)
 {
 	bool has_password = false, use_domain = false, use_second_ip = false;
 	bool bad_password = false, bad_domain = false;
 	
+	//The body is a URL-encoded form. Older pages sent one 'name=value' per line, which parses the same way.
 	for (;;)
 	{
 		char *line = http_server_read_post_line(conn);
 		if (!line)
 			break;
-				
-		char *p = strchr(line, '=');
-		if (!p)
-			continue;
-		*p++ = 0;
-		if (!strcasecmp(line, "has_password")) 
-			has_password = !strcasecmp(p, "true") || p[0] == '1';
-		else if (!strcasecmp(line, "use_domain")) 
-			use_domain = !strcasecmp(p, "true") || p[0] == '1';
-		else if (!strcasecmp(line, "use_second_ip")) 
-			use_second_ip = !strcasecmp(p, "true") || p[0] == '1';
-		else if (!strcasecmp(line, "dns_ignores_network_suffix")) 
-			settings->dns_ignores_network_suffix = !strcasecmp(p, "true") || p[0] == '1';
-		else if (!strcasecmp(line, "ssid")) 
-		{
-			if (strlen(p) >= sizeof(settings->network_name))
-				return "SSID too long";
-			if (!p[0])
-				return "missing SSID";
-			strcpy(settings->network_name, p);
-		}
-		else if (!strcasecmp(line, "password")) 
-		{
-			if (strlen(p) >= sizeof(settings->network_password))
-				bad_password = true;
-			else
-				strcpy(settings->network_password, p);
-		}
-		else if (!strcasecmp(line, "hostname")) 
-		{
-			if (strlen(p) >= sizeof(settings->hostname))
-				return "hostname too long";
-			if (!p[0])
-				return "missing hostname";
-			strcpy(settings->hostname, p);
-		}
-		else if (!strcasecmp(line, "domain")) 
-		{
-			if (strlen(p) >= sizeof(settings->domain_name))
-				bad_domain = true;
-			else
-				strcpy(settings->domain_name, p);
-		}
-		else if (!strcasecmp(line, "ipaddr")) 
-		{
-			settings->ip_address = ipaddr_addr(p);
-			if (!settings->ip_address || settings->ip_address == -1)
-				return "invalid IP address";
-		}
-		else if (!strcasecmp(line, "netmask")) 
-		{
-			settings->network_mask = ipaddr_addr(p);
-			if (!settings->network_mask || settings->network_mask == -1)
-				return "invalid network mask";
-		}
-		else if (!strcasecmp(line, "ipaddr2")) 
+		
+		http_form_field field;
+		while (http_form_next_field(&line, &field))
 		{
-			settings->secondary_address = ipaddr_addr(p);
+			char *p = field.value;
+			switch (http_form_find_key(&s_SettingKeys, &field))
+			{
+			case SETTING_HAS_PASSWORD:
+				has_password = parse_bool_setting(p);
+				break;
+			case SETTING_USE_DOMAIN:
+				use_domain = parse_bool_setting(p);
+				break;
+			case SETTING_USE_SECOND_IP:
+				use_second_ip = parse_bool_setting(p);
+				break;
+			case SETTING_DNS_IGNORES_NETWORK_SUFFIX:
+				settings->dns_ignores_network_suffix = parse_bool_setting(p);
+				break;
+			case SETTING_SSID:
+				if (strlen(p) >= sizeof(settings->network_name))
+					return "SSID too long";
+				if (!p[0])
+					return "missing SSID";
+				strcpy(settings->network_name, p);
+				break;
+			case SETTING_PASSWORD:
+				if (strlen(p) >= sizeof(settings->network_password))
+					bad_password = true;
+				else
+					strcpy(settings->network_password, p);
+				break;
+			case SETTING_HOSTNAME:
+				if (strlen(p) >= sizeof(settings->hostname))
+					return "hostname too long";
+				if (!p[0])
+					return "missing hostname";
+				strcpy(settings->hostname, p);
+				break;
+			case SETTING_DOMAIN:
+				if (strlen(p) >= sizeof(settings->domain_name))
+					bad_domain = true;
+				else
+					strcpy(settings->domain_name, p);
+				break;
+			case SETTING_IPADDR:
+				settings->ip_address = ipaddr_addr(p);
+				if (!settings->ip_address || settings->ip_address == -1)
+					return "invalid IP address";
+				break;
+			case SETTING_NETMASK:
+				settings->network_mask = ipaddr_addr(p);
+				if (!settings->network_mask || settings->network_mask == -1)
+					return "invalid network mask";
+				break;
+			case SETTING_IPADDR2:
+				settings->secondary_address = ipaddr_addr(p);
+				break;
+			}
 		}
 	}
 	
@@ -143,69 +230,238 @@ static char *parse_server_settings(http_connection conn, pico_server_settings *s
 	return NULL;
 }
 
-static bool do_handle_api_call(http_connection conn, enum http_request_type type, char *path, void *context)
+static int s_InitializedMask = 0;
+
+static bool do_read_pins(http_connection conn, enum http_request_type type, char *path, void *context)
 {
-	static int s_InitializedMask = 0;
+	http_server_set_nodelay(conn, true);	//The page polls this several times per second, so the reply should not wait for delayed ACKs
+	
+	http_json_writer json;
+	http_json_begin(&json, http_server_begin_write_reply(conn, "200 OK", "text/json"));
+	http_json_begin_object(&json, NULL);
+	http_json_string(&json, "led0v", cyw43_arch_gpio_get(0) ? "1" : "0");
+	
+	int values = gpio_get_all();
 	
-	if (!strcmp(path, "readpins"))
+	for (int i = 0; i < 29; i++)
 	{
-		http_write_handle reply = http_server_begin_write_reply(conn, "200 OK", "text/json");
-		http_server_write_reply(reply, "{\"led0v\": \"%d\"", cyw43_arch_gpio_get(0));
-		
-		int values = gpio_get_all();
+		if (i > 22 && i < 26)
+			continue;
 		
-		for (int i = 0; i < 29; i++)
+		if (s_InitializedMask & (1 << i))
 		{
-			if (i > 22 && i < 26)
-				continue;
+			//"gpioNd" and "gpioNv"
+			char key[8] = "gpio";
+			int len = 4;
+			if (i >= 10)
+				key[len++] = '0' + i / 10;
+			key[len++] = '0' + i % 10;
+			key[len + 1] = 0;
 			
-			if (s_InitializedMask & (1 << i))
-				http_server_write_reply(reply, ",\"gpio%dd\": \"%s\",\"gpio%dv\": \"%d\"", i, gpio_get_dir(i) ? "OUT" : "IN", i, (values >> i) & 1);
+			key[len] = 'd';
+			http_json_string(&json, key, gpio_get_dir(i) ? "OUT" : "IN");
+			key[len] = 'v';
+			http_json_string(&json, key, ((values >> i) & 1) ? "1" : "0");
 		}
-		
-		http_server_end_write_reply(reply, "}");
+	}
+	
+	http_json_end_object(&json);
+	http_server_end_write_reply(json.reply, NULL);
+	return true;
+}
+
+static http_event_source s_PinEvents;
+static volatile bool s_FullPinUpdateRequested;
+
+struct pin_state
+{
+	bool led;
+	uint32_t values, directions, initialized;
+};
+
+static void read_pin_state(struct pin_state *state)
+{
+	state->led = cyw43_arch_gpio_get(0);
+	state->values = gpio_get_all();
+	state->initialized = s_InitializedMask;
+	state->directions = 0;
+	for (int i = 0; i < 29; i++)
+		if (gpio_get_dir(i))
+			state->directions |= (1 << i);
+}
+
+static bool do_subscribe_pin_events(http_connection conn, enum http_request_type type, char *path, void *context)
+{
+	if (!http_server_subscribe_events(conn, s_PinEvents))
+	{
+		http_server_send_reply(conn, "503 Service Unavailable", "text/plain", "Too many subscribers", -1);
 		return true;
 	}
-	else if (!memcmp(path, "writepin/", 9))
+	
+	s_FullPinUpdateRequested = true;	//The new subscriber needs the state of all pins
+	return true;
+}
+
+//Formats the same fields as do_read_pins(), but only for the pins that differ from 'last' (all pins if it is NULL). Returns 0 if nothing has changed.
+static int format_pin_changes(char *data, int size, const struct pin_state *state, const struct pin_state *last)
+{
+	uint32_t changed = last ? (state->values ^ last->values) | (state->directions ^ last->directions) | (state->initialized ^ last->initialized) : ~0;
+	int len = 0;
+	if (!last || state->led != last->led)
+		len += snprintf(data + len, size - len, ",\"led0v\": \"%d\"", state->led);
+	
+	for (int i = 0; i < 29 && len < size; i++)
+	{
+		if (i > 22 && i < 26)
+			continue;
+		
+		if ((changed & state->initialized) & (1 << i))
+			len += snprintf(data + len, size - len, ",\"gpio%dd\": \"%s\",\"gpio%dv\": \"%d\"", i, ((state->directions >> i) & 1) ? "OUT" : "IN", i, (state->values >> i) & 1);
+	}
+	
+	if (!len || (len + 2) > size)
+		return 0;
+	
+	data[0] = '{';	//Replaces the leading comma
+	data[len++] = '}';
+	data[len] = 0;
+	return len;
+}
+
+static void pin_event_thread(void *arg)
+{
+	static char data[960];
+	struct pin_state last = { 0 };
+	TickType_t last_event = xTaskGetTickCount();
+	
+	for (;;)
 	{
-		//e.g. 'writepin/led0?v=1'
-		char *port = path + 9;
-		char *arg = strchr(port, '?');
-		if (arg)
+		vTaskDelay(pdMS_TO_TICKS(PIN_EVENT_INTERVAL_MS));
+		if (!http_event_source_get_subscriber_count(s_PinEvents))
+			continue;
+		
+		struct pin_state state;
+		read_pin_state(&state);
+		
+		bool full = s_FullPinUpdateRequested;
+		s_FullPinUpdateRequested = false;
+		
+		int len = format_pin_changes(data, sizeof(data), &state, full ? NULL : &last);
+		last = state;
+		
+		if (len)
+			http_event_source_send(s_PinEvents, "pins", data);
+		else if ((xTaskGetTickCount() - last_event) < pdMS_TO_TICKS(PIN_EVENT_PING_INTERVAL_MS))
+			continue;
+		else
+			http_event_source_send(s_PinEvents, "ping", "");
+		
+		last_event = xTaskGetTickCount();
+	}
+}
+
+//Applies a command in the 'led0?v=1' format used by the writepin API and the pin WebSocket
+static bool write_pin(char *port)
+{
+	static const char *const names[] = { "v", "d" };
+	static uint32_t hashes[2];
+	static http_form_keys keys = { names, 2, hashes };
+	
+	char *query = http_form_split_query(port);
+	int value = -1;
+	bool input = false, found = false;
+	
+	http_form_field field;
+	while (http_form_next_field(&query, &field))
+	{
+		switch (http_form_find_key(&keys, &field))
 		{
-			*arg++ = 0;
-			char *value = strchr(arg, '=');
-			*value++ = 0;
+		case 0:
+			value = field.value[0] == '1';
+			found = true;
+			break;
+		case 1:
+			input = field.value[0] == 'I';
+			found = true;
+			break;
+		}
+	}
+	
+	if (!found)
+		return false;
+
+	if (!strcmp(port, "led0"))
+		cyw43_arch_gpio_put(0, value == 1);
+	else if (!memcmp(port, "gpio", 4))
+	{
+		//GPIO23-25 are connected to the WiFi chip on Pico W, and GPIO29 is not available on the header
+		char *end;
+		int gpio = strtol(port + 4, &end, 10);
+		if (end == port + 4 || *end || gpio < 0 || gpio > 28 || (gpio >= 23 && gpio <= 25))
+			return false;
 		
-			if (!strcmp(port, "led0"))
-				cyw43_arch_gpio_put(0, value[0] == '1');
-			else if (!memcmp(port, "gpio", 4))
-			{
-				int gpio = atoi(port + 4);
-				if (!(s_InitializedMask & (1 << gpio)))
-				{
-					gpio_init(gpio);
-					s_InitializedMask |= (1 << gpio);
-				}
-
-				if (arg[0] == 'd' && value[0] == 'I')
-				{
-					gpio_set_pulls(gpio, true, false);
-					gpio_set_dir(gpio, GPIO_IN);
-				}
-				else
-				{
-					gpio_set_pulls(gpio, false, false);
-					gpio_set_dir(gpio, GPIO_OUT);
+		if (!(s_InitializedMask & (1 << gpio)))
+		{
+			gpio_init(gpio);
+			s_InitializedMask |= (1 << gpio);
+		}
 
-					if (arg[0] == 'v')
-						gpio_put(gpio, value[0] == '1');
-				}
-			}
-			
-			return true;
+		if (input)
+		{
+			gpio_set_pulls(gpio, true, false);
+			gpio_set_dir(gpio, GPIO_IN);
+		}
+		else
+		{
+			gpio_set_pulls(gpio, false, false);
+			gpio_set_dir(gpio, GPIO_OUT);
+
+			if (value >= 0)
+				gpio_put(gpio, value);
 		}
 	}
+	
+	return true;
+}
+
+/* Lets dashboards control the pins over a single connection: each text message is a writepin command,
+ * answered with the fields of the pins that have changed as a result (or an empty object). Note that
+ * the connection occupies one of the HTTP worker tasks while it is open. */
+static bool do_handle_pin_websocket(http_connection conn, enum http_request_type type, char *path, void *context)
+{
+	if (!http_server_accept_websocket(conn))
+		return false;
+	
+	for (;;)
+	{
+		char command[64], reply[128];
+		int len = http_websocket_recv(conn, command, sizeof(command) - 1, NULL);
+		if (len < 0)
+			break;
+		
+		command[len] = 0;
+		
+		struct pin_state before, after;
+		read_pin_state(&before);
+		write_pin(command);
+		read_pin_state(&after);
+		
+		len = format_pin_changes(reply, sizeof(reply), &after, &before);
+		if (!http_websocket_send(conn, false, len ? reply : "{}", -1))
+			break;
+	}
+	
+	return true;
+}
+
+static bool do_handle_api_call(http_connection conn, enum http_request_type type, char *path, void *context)
+{
+	if (!memcmp(path, "writepin/", 9))
+	{
+		//e.g. 'writepin/led0?v=1'
+		if (write_pin(path + 9))
+			return true;
+	}
 	else if (!strcmp(path, "settings"))
 	{
 		if (type == HTTP_POST)
@@ -228,25 +484,108 @@ static bool do_handle_api_call(http_connection conn, enum http_request_type type
 		else
 		{
 			const pico_server_settings *settings = get_pico_server_settings();
-			http_write_handle reply = http_server_begin_write_reply(conn, "200 OK", "text/json");
-			http_server_write_reply(reply, "{\"ssid\": \"%s\"", settings->network_name);
-			http_server_write_reply(reply, ",\"has_password\": %d, \"password\" : \"%s\"", settings->network_password[0] != 0, settings->network_password);
-			http_server_write_reply(reply, ",\"hostname\" : \"%s\"", settings->hostname);
-			http_server_write_reply(reply, ",\"use_domain\": %d, \"domain\" : \"%s\"", settings->domain_name[0] != 0, settings->domain_name);
-			http_server_write_reply(reply, ",\"ipaddr\" : \"%d.%d.%d.%d\"", (settings->ip_address >> 0) & 0xFF, (settings->ip_address >> 8) & 0xFF, (settings->ip_address >> 16) & 0xFF, (settings->ip_address >> 24) & 0xFF);
-			http_server_write_reply(reply, ",\"netmask\" : \"%d.%d.%d.%d\"", (settings->network_mask >> 0) & 0xFF, (settings->network_mask >> 8) & 0xFF, (settings->network_mask >> 16) & 0xFF, (settings->network_mask >> 24) & 0xFF);
-			http_server_write_reply(reply, ",\"use_second_ip\": %d", settings->secondary_address != 0);
-			http_server_write_reply(reply, ",\"ipaddr2\" : \"%d.%d.%d.%d\"", (settings->secondary_address >> 0) & 0xFF, (settings->secondary_address >> 8) & 0xFF, (settings->secondary_address >> 16) & 0xFF, (settings->secondary_address >> 24) & 0xFF);
-			http_server_write_reply(reply, ",\"dns_ignores_network_suffix\" : %d", !!settings->dns_ignores_network_suffix);
-
-			http_server_end_write_reply(reply, "}");
+			http_json_writer json;
+			http_json_begin(&json, http_server_begin_write_reply(conn, "200 OK", "text/json"));
+			http_json_begin_object(&json, NULL);
+			http_json_string(&json, "ssid", settings->network_name);
+			http_json_bool(&json, "has_password", settings->network_password[0] != 0);
+			http_json_string(&json, "password", settings->network_password);
+			http_json_string(&json, "hostname", settings->hostname);
+			http_json_bool(&json, "use_domain", settings->domain_name[0] != 0);
+			http_json_string(&json, "domain", settings->domain_name);
+			http_json_ipv4(&json, "ipaddr", settings->ip_address);
+			http_json_ipv4(&json, "netmask", settings->network_mask);
+			http_json_bool(&json, "use_second_ip", settings->secondary_address != 0);
+			http_json_ipv4(&json, "ipaddr2", settings->secondary_address);
+			http_json_bool(&json, "dns_ignores_network_suffix", !!settings->dns_ignores_network_suffix);
+			http_json_end_object(&json);
+			http_server_end_write_reply(json.reply, NULL);
 			return true;
 		}
 	}
+	else if (!strcmp(path, "stats"))
+	{
+		http_server_stats stats;
+		http_server_get_stats(&stats);
+		
+		http_json_writer json;
+		http_json_begin(&json, http_server_begin_write_reply(conn, "200 OK", "text/json"));
+		http_json_begin_object(&json, NULL);
+		http_json_int(&json, "connections", stats.connections);
+		http_json_int(&json, "shed_connections", stats.shed_connections);
+		http_json_int(&json, "queued_connections", stats.queued_connections);
+		http_json_int(&json, "max_queued_connections", stats.max_queued_connections);
+		http_json_int(&json, "requests", stats.requests);
+		http_json_int(&json, "queued_requests", stats.queued_requests);
+		http_json_int(&json, "shed_requests", stats.shed_requests);
+		http_json_int(&json, "idle_timeouts", stats.idle_timeouts);
+		http_json_int(&json, "idle_released", stats.idle_released);
+		http_json_int(&json, "header_timeouts", stats.header_timeouts);
+		http_json_int(&json, "body_timeouts", stats.body_timeouts);
+		http_json_int(&json, "send_timeouts", stats.send_timeouts);
+		http_json_int(&json, "websocket_timeouts", stats.websocket_timeouts);
+		
+		//Averaged since the previous request to this endpoint
+		int core_load[CPU_USAGE_MAX_CORES];
+		cpu_usage_sample(core_load);
+		http_json_begin_array(&json, "core_load");
+		for (int i = 0; i < CPU_USAGE_MAX_CORES; i++)
+			http_json_int(&json, NULL, core_load[i]);
+		http_json_end_array(&json);
+		http_json_end_object(&json);
+		http_server_end_write_reply(json.reply, NULL);
+		return true;
+	}
 	
 	return false;
 }
 
+#if ENABLE_OTA
+//Compares the whole string regardless of where the first difference is, so the response time does not reveal the secret
+static bool secret_matches(const char *value, const char *secret)
+{
+	if (!value)
+		return false;
+	
+	size_t len = strlen(secret), value_len = strlen(value);
+	uint8_t diff = value_len != len;
+	for (size_t i = 0; i < len; i++)
+		diff |= (i < value_len ? value[i] : 0) ^ secret[i];
+	return !diff;
+}
+
+/* Expects the .bin file of the new firmware as the request body, its CRC32 (as computed by zlib) in hex in the X-Image-CRC32 header,
+ * and the OTA_SECRET the firmware was built with in the X-OTA-Secret header, e.g.
+ * curl --data-binary @PicoHTTPServer.bin -H "X-Image-CRC32: $(crc32 PicoHTTPServer.bin)" -H "X-OTA-Secret: <secret>" http://picohttp.piconet.local/api/ota */
+static bool do_handle_ota(http_connection conn, enum http_request_type type, char *path, void *context)
+{
+	if (!secret_matches(http_server_get_request_header(conn, "X-OTA-Secret"), OTA_SECRET))
+	{
+		http_server_send_reply(conn, "403 Forbidden", "text/plain", "Invalid X-OTA-Secret header", -1);
+		return true;
+	}
+	
+	const char *crc = http_server_get_request_header(conn, "X-Image-CRC32");
+	int size = http_server_get_content_length(conn);
+	if (!crc)
+	{
+		http_server_send_reply(conn, "400 Bad Request", "text/plain", "Missing X-Image-CRC32 header", -1);
+		return true;
+	}
+	
+	const char *err = ota_receive_image(conn, size, strtoul(crc, NULL, 16));
+	if (err)
+	{
+		http_server_send_reply(conn, "400 Bad Request", "text/plain", err, -1);
+		return true;
+	}
+	
+	http_server_send_reply(conn, "200 OK", "text/plain", "OK", -1);
+	vTaskDelay(pdMS_TO_TICKS(500));	//Let the reply reach the client before the network goes down
+	ota_activate_image(size);
+	return true;
+}
+#endif
 
 static void set_secondary_ip_address(int address)
 {
@@ -261,6 +600,14 @@ static void set_secondary_ip_address(int address)
 	ip4_secondary_ip_address = address;
 }
 
+#if FREE_RTOS_KERNEL_SMP
+//The tcpip thread is created by cyw43_arch_init(), so it sets its affinity itself
+static void set_network_core_affinity(void *arg)
+{
+	vTaskCoreAffinitySet(NULL, NETWORK_CORE_AFFINITY);
+}
+#endif
+
 static void main_task(__unused void *params)
 {
 	
@@ -270,6 +617,10 @@ static void main_task(__unused void *params)
 		return;
 	}
 	
+#if FREE_RTOS_KERNEL_SMP
+	tcpip_callback(set_network_core_affinity, NULL);
+#endif
+	
 	extern void *_binary_www_fs_start;
 	if (!simplefs_init(&s_SimpleFS, &_binary_www_fs_start))
 	{
@@ -292,9 +643,36 @@ static void main_task(__unused void *params)
 	dns_server_init(netif->ip_addr.addr, settings->secondary_address, settings->hostname, settings->domain_name, settings->dns_ignores_network_suffix);
 	set_secondary_ip_address(settings->secondary_address);
 	http_server_instance server = http_server_create(settings->hostname, settings->domain_name, 4, 4096);
-	static http_zone zone1, zone2;
-	http_server_add_zone(server, &zone1, "", do_retrieve_file, NULL);
+	if (!server)
+	{
+		printf("failed to start the HTTP server\n");
+		return;
+	}
+	
+	static http_zone zone1, zone2, zone3, zone4, zone5;
+	http_server_add_zone_ex(server, &zone1, "", HTTP_METHOD_GET, false, do_retrieve_file, NULL);
+	
+	//A slow client downloading a large file should not delay the API calls polled by the page
+	http_server_set_zone_lane(&zone1, HTTP_LANE_BULK);
+	http_server_set_lane_limits(server, HTTP_LANE_BULK, 2, tskIDLE_PRIORITY + 1);
+	
 	http_server_add_zone(server, &zone2, "/api", do_handle_api_call, NULL);
+	http_server_add_zone_ex(server, &zone3, "/api/readpins", HTTP_METHOD_GET, true, do_read_pins, NULL);	//Polled by the web page several times per second
+	
+	//Browsers supporting server-sent events get notified about the pin changes instead of polling
+	s_PinEvents = http_server_create_event_source(PIN_EVENT_MAX_SUBSCRIBERS);
+	http_server_add_zone_ex(server, &zone4, "/api/events", HTTP_METHOD_GET, true, do_subscribe_pin_events, NULL);
+	xTaskCreate(pin_event_thread, "Pin Events", configMINIMAL_STACK_SIZE, NULL, TEST_TASK_PRIORITY, NULL);
+	
+	http_server_add_zone_ex(server, &zone5, "/api/pins", HTTP_METHOD_WEBSOCKET, true, do_handle_pin_websocket, NULL);
+	
+#if ENABLE_OTA
+	static http_zone zone6;
+	static const char *const ota_headers[] = { "X-Image-CRC32", "X-OTA-Secret", NULL };
+	http_server_add_zone_ex(server, &zone6, "/api/ota", HTTP_METHOD_POST, true, do_handle_ota, NULL);
+	http_server_capture_request_headers(server, ota_headers);
+	http_server_set_zone_max_body_size(&zone6, OTA_STAGING_SIZE);
+#endif
 	vTaskDelete(NULL);
 }
 
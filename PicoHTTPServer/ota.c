@@ -0,0 +1,264 @@
+#include <string.h>
+#include <pico/stdlib.h>
+#include <hardware/flash.h>
+#include <hardware/sync.h>
+#include <hardware/watchdog.h>
+
+#include <FreeRTOS.h>
+#include <queue.h>
+#include <semphr.h>
+#include <task.h>
+
+#include "flash_writer.h"
+#include "ota.h"
+
+/* The new image is stored in the upper half of the FLASH (see ota.h). There is no bootloader that could boot it from there,
+ * so once it has been verified, a function running from RAM copies it over the current firmware and resets the chip.
+ * Note that the settings (see server_settings.c) are a part of the image, so they are reset to the defaults of the new image. */
+#define OTA_WRITER_PRIORITY (tskIDLE_PRIORITY + 3)
+
+//With the SMP kernel, the FLASH is only accessed from core 0, while core 1 is parked
+#define OTA_FLASH_CORE 0
+#define OTA_PARKED_CORE 1
+
+extern char __flash_binary_end;
+
+static struct
+{
+	xSemaphoreHandle lock;	//Only one update at a time
+	xQueueHandle requests;
+	xSemaphoreHandle done;
+	TaskHandle_t park_task;
+} s_OTA;
+
+#if FREE_RTOS_KERNEL_SMP
+static volatile bool s_OtherCoreParked, s_ReleaseOtherCore;
+
+//Spins with the interrupts disabled, so that the core does not fetch anything from the FLASH until it is released
+static void __no_inline_not_in_flash_func(park_this_core)(void)
+{
+	uint32_t status = save_and_disable_interrupts();
+	s_OtherCoreParked = true;
+	while (!s_ReleaseOtherCore)
+		__wfe();
+	
+	s_OtherCoreParked = false;
+	restore_interrupts(status);
+}
+
+//Runs on OTA_PARKED_CORE at the highest priority, so it preempts whatever is running there once notified
+static void park_core_thread(void *arg)
+{
+	for (;;)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		park_this_core();
+	}
+}
+#endif
+
+//Must be called on OTA_FLASH_CORE
+static void park_other_core(void)
+{
+#if FREE_RTOS_KERNEL_SMP
+	s_ReleaseOtherCore = false;
+	xTaskNotifyGive(s_OTA.park_task);
+	while (!s_OtherCoreParked)
+		;
+#endif
+}
+
+static void release_other_core(void)
+{
+#if FREE_RTOS_KERNEL_SMP
+	s_ReleaseOtherCore = true;
+	__sev();
+	while (s_OtherCoreParked)
+		;
+#endif
+}
+
+struct sector_write_request
+{
+	uint32_t offset;
+	const void *data;
+};
+
+/* Programs the sectors handed over by the flash writer, so that the HTTP task can receive the next sector meanwhile.
+ * The FLASH is not accessible while it is being programmed, so the interrupts on this core are disabled, and the other core
+ * (that could be running code or sending FLASH-resident data from the tcpip thread) is parked for each sector. */
+static void ota_writer_thread(void *arg)
+{
+	struct sector_write_request request;
+	for (;;)
+	{
+		if (xQueueReceive(s_OTA.requests, &request, portMAX_DELAY) != pdTRUE)
+			continue;
+		
+		park_other_core();
+		portENTER_CRITICAL();
+		flash_range_erase(request.offset, FLASH_SECTOR_SIZE);
+		flash_range_program(request.offset, (const uint8_t *)request.data, FLASH_SECTOR_SIZE);
+		portEXIT_CRITICAL();
+		release_other_core();
+		xSemaphoreGive(s_OTA.done);
+	}
+}
+
+static void pico_write_sector(void *context, uint32_t offset, const void *data)
+{
+	struct sector_write_request request = { .offset = offset, .data = data };
+	xQueueSend(s_OTA.requests, &request, portMAX_DELAY);
+}
+
+static void pico_wait(void *context)
+{
+	xSemaphoreTake(s_OTA.done, portMAX_DELAY);
+}
+
+static const void *pico_map(void *context, uint32_t offset)
+{
+	return (const void *)(XIP_BASE + offset);
+}
+
+static const flash_writer_backend s_PicoFlashBackend = {
+	.write_sector = pico_write_sector,
+	.wait = pico_wait,
+	.map = pico_map,
+};
+
+//The boot ROM only starts an image whose first 256 bytes (the second stage bootloader) end with a valid CRC32 (non-reflected, no final XOR)
+static bool has_valid_boot2(const uint8_t *image)
+{
+	uint32_t crc = 0xFFFFFFFF, expected;
+	for (int i = 0; i < 252; i++)
+	{
+		crc ^= (uint32_t)image[i] << 24;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04C11DB7) : (crc << 1);
+	}
+	
+	memcpy(&expected, image + 252, 4);
+	return crc == expected;
+}
+
+static const char *do_receive_image(http_connection conn, uint32_t size, uint32_t expected_crc)
+{
+	if (!size)
+		return "Missing firmware image";
+	if (size > OTA_STAGING_SIZE)
+		return "Firmware image too large";
+	if ((uint32_t)&__flash_binary_end - XIP_BASE > OTA_STAGING_OFFSET)
+		return "The running firmware overlaps the staging area";
+	
+	if (!s_OTA.requests)
+	{
+		s_OTA.requests = xQueueCreate(1, sizeof(struct sector_write_request));
+		s_OTA.done = xSemaphoreCreateBinary();
+#if FREE_RTOS_KERNEL_SMP
+		xTaskCreateAffinitySet(park_core_thread, "OTA Park", configMINIMAL_STACK_SIZE, NULL, configMAX_PRIORITIES - 1, 1 << OTA_PARKED_CORE, &s_OTA.park_task);
+		xTaskCreateAffinitySet(ota_writer_thread, "OTA Writer", configMINIMAL_STACK_SIZE, NULL, OTA_WRITER_PRIORITY, 1 << OTA_FLASH_CORE, NULL);
+#else
+		xTaskCreate(ota_writer_thread, "OTA Writer", configMINIMAL_STACK_SIZE, NULL, OTA_WRITER_PRIORITY, NULL);
+#endif
+	}
+	
+	void *buffers = pvPortMalloc(2 * FLASH_WRITER_SECTOR_SIZE);
+	if (!buffers)
+		return "Not enough memory";
+	
+	flash_writer writer;
+	flash_writer_begin(&writer, &s_PicoFlashBackend, OTA_STAGING_OFFSET, OTA_STAGING_SIZE, buffers);
+	
+	//The body is read in buffer-sized slices, so the upload never has to fit into the RAM
+	const char *error = NULL;
+	for (;;)
+	{
+		int len;
+		char *chunk = http_server_read_body_chunk(conn, &len);
+		if (!chunk)
+			break;
+		
+		if (!flash_writer_write(&writer, chunk, len))
+		{
+			error = "Failed to program the FLASH";
+			break;
+		}
+	}
+	
+	if (!flash_writer_finish(&writer) && !error)
+		error = "Failed to program the FLASH";
+	vPortFree(buffers);
+	
+	if (error)
+		return error;
+	if (writer.written != size)
+		return "Incomplete firmware image";
+	if (writer.crc != expected_crc)
+		return "CRC mismatch";
+	
+	//Each sector was compared with the received data after programming. This also checks the image as a whole, the way it will be copied.
+	const uint8_t *image = (const uint8_t *)(XIP_BASE + OTA_STAGING_OFFSET);
+	if (flash_writer_crc32(0, image, size) != expected_crc)
+		return "Verification failed";
+	if (!has_valid_boot2(image))
+		return "Not a valid RP2040 firmware image";
+	
+	return NULL;
+}
+
+const char *ota_receive_image(http_connection conn, uint32_t size, uint32_t expected_crc)
+{
+	taskENTER_CRITICAL();
+	if (!s_OTA.lock)
+		s_OTA.lock = xSemaphoreCreateMutex();
+	taskEXIT_CRITICAL();
+	
+	if (!xSemaphoreTake(s_OTA.lock, 0))
+		return "Another update is in progress";
+	
+	const char *error = do_receive_image(conn, size, expected_crc);
+	xSemaphoreGive(s_OTA.lock);
+	return error;
+}
+
+/* Runs entirely from RAM: the code in the FLASH is being overwritten, so nothing (including memcpy() and the interrupt handlers)
+ * may be called from there. flash_range_erase() and flash_range_program() are RAM functions, and re-enable XIP before returning. */
+static void __no_inline_not_in_flash_func(copy_staged_image)(uint32_t size, uint32_t *buffer)
+{
+	for (uint32_t offset = 0; offset < size; offset += FLASH_SECTOR_SIZE)
+	{
+		const uint32_t *src = (const uint32_t *)(XIP_BASE + OTA_STAGING_OFFSET + offset);
+		for (int i = 0; i < FLASH_SECTOR_SIZE / 4; i++)
+			buffer[i] = src[i];
+		
+		flash_range_erase(offset, FLASH_SECTOR_SIZE);
+		flash_range_program(offset, (const uint8_t *)buffer, FLASH_SECTOR_SIZE);
+	}
+	
+	watchdog_hw->ctrl = WATCHDOG_CTRL_TRIGGER_BITS;
+	for (;;)
+		;
+}
+
+void ota_activate_image(uint32_t size)
+{
+	uint32_t *buffer = (uint32_t *)pvPortMalloc(FLASH_SECTOR_SIZE);
+	if (!buffer)
+	{
+		watchdog_reboot(0, SRAM_END, 0);	//The staged image stays unused
+		for (;;)
+			;
+	}
+	
+#if FREE_RTOS_KERNEL_SMP
+	//The other core is never released: the chip gets reset once the image has been copied
+	vTaskCoreAffinitySet(NULL, 1 << OTA_FLASH_CORE);
+	while (get_core_num() != OTA_FLASH_CORE)
+		taskYIELD();
+#endif
+	park_other_core();
+	
+	save_and_disable_interrupts();
+	copy_staged_image(size, buffer);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <hardware/flash.h>
+#include "httpserver.h"
+
+//The new image is staged in the upper half of the FLASH
+#define OTA_STAGING_OFFSET (PICO_FLASH_SIZE_BYTES / 2)
+#define OTA_STAGING_SIZE (PICO_FLASH_SIZE_BYTES - OTA_STAGING_OFFSET)
+
+/* Receives a firmware image (the .bin file produced by the build) from the POST body into the upper half of the FLASH,
+ * while the current firmware keeps running. The image is only accepted if its size and CRC32 match the expected ones after
+ * reading it back, and it starts with a valid second stage bootloader. Returns NULL on success, or the error message. */
+const char *ota_receive_image(http_connection conn, uint32_t size, uint32_t expected_crc);
+
+//Replaces the running firmware with the image received by ota_receive_image() and resets the chip. Never returns.
+void ota_activate_image(uint32_t size);
@@ -1,8 +1,5 @@
 #!/bin/bash
-mkdir -p tools/SimpleFSBuilder/build
 mkdir -p PicoHTTPServer/build
-cmake -S tools/SimpleFSBuilder -B tools/SimpleFSBuilder/build
-make -C tools/SimpleFSBuilder/build || exit 1
 
 test -d pico-sdk || git clone --recursive https://github.com/raspberrypi/pico-sdk
 test -d pico-sdk/FreeRTOS || git clone --recursive https://github.com/FreeRTOS/FreeRTOS-Kernel pico-sdk/FreeRTOS
@@ -0,0 +1,136 @@
+//The server is included directly, so that the benchmark can call find_zone()
+#include "httpserver.c"
+#include "host_test.h"
+#include "host_bench.h"
+
+#define SECTION_COUNT 20
+#define ITEMS_PER_SECTION 15
+#define ZONE_COUNT (1 + SECTION_COUNT * (1 + ITEMS_PER_SECTION))
+
+static struct _http_server_instance s_Server;
+static http_zone s_Zones[ZONE_COUNT];
+static char s_Prefixes[ZONE_COUNT][32];
+
+/* The zone list used before the sorted table was added. New zones were inserted at the head of the list,
+ * and the first zone whose prefix matched the path at a component boundary handled the request. */
+struct old_zone
+{
+	const char *prefix;
+	int prefix_len;
+	http_zone *zone;
+	struct old_zone *next;
+};
+
+static struct old_zone s_OldZones[ZONE_COUNT];
+static struct old_zone *s_FirstOldZone;
+
+static bool dummy_handler(http_connection conn, enum http_request_type type, char *path, void *context)
+{
+	return true;
+}
+
+static http_zone *old_find_zone(const char *path)
+{
+	for (struct old_zone *zone = s_FirstOldZone; zone; zone = zone->next)
+	{
+		if (strncasecmp(path, zone->prefix, zone->prefix_len))
+			continue;
+
+		int off = zone->prefix_len;
+		if (path[off] == 0 || path[off] == '/')
+			return zone->zone;
+	}
+
+	return NULL;
+}
+
+//Same lookup order as dispatch_request(): the longest matching prefix at a path component boundary first
+static http_zone *new_find_zone(const char *path)
+{
+	for (int len = strlen(path); len >= 0; len--)
+	{
+		if (path[len] && path[len] != '/')
+			continue;
+
+		int index = -1;
+		http_zone *zone = find_zone(&s_Server, path, len, HTTP_GET, &index);
+		if (zone)
+			return zone;
+	}
+
+	return NULL;
+}
+
+//Registers 'prefix' with both implementations. Parents are registered before their children, so that the old list tries the children first.
+static void add_zone(int index, const char *prefix)
+{
+	strcpy(s_Prefixes[index], prefix);
+	http_server_add_zone(&s_Server, &s_Zones[index], s_Prefixes[index], dummy_handler, NULL);
+
+	struct old_zone *zone = &s_OldZones[index];
+	zone->prefix = s_Prefixes[index];
+	zone->prefix_len = strlen(zone->prefix);
+	zone->zone = &s_Zones[index];
+	zone->next = s_FirstOldZone;
+	s_FirstOldZone = zone;
+}
+
+static const char *s_Path;
+
+static void run_old_lookup(void *arg)
+{
+	s_HostBenchSink += (uintptr_t)old_find_zone(s_Path);
+}
+
+static void run_new_lookup(void *arg)
+{
+	s_HostBenchSink += (uintptr_t)new_find_zone(s_Path);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = host_bench_iterations(argc, argv, 20000);
+	s_Server.zone_lock = xSemaphoreCreateMutex();
+
+	int count = 0;
+	char prefix[32];
+	add_zone(count++, "");
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		sprintf(prefix, "/section%d", i);
+		add_zone(count++, prefix);
+		for (int j = 0; j < ITEMS_PER_SECTION; j++)
+		{
+			sprintf(prefix, "/section%d/item%d", i, j);
+			add_zone(count++, prefix);
+		}
+	}
+
+	CHECK(s_Server.zone_count == ZONE_COUNT);
+
+	//The zones registered first are found last by the old list, so the cost of the linear scan depends on the path
+	static const char *const paths[] = {
+		"/section19/item14/status",
+		"/section10/item7",
+		"/section0/item0/data.json",
+		"/section5/readme.txt",
+		"/index.html",
+		"/unknown/path/to/file.css",
+	};
+
+	printf("%d zones\n", ZONE_COUNT);
+	for (int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+	{
+		s_Path = paths[i];
+		http_zone *zone = new_find_zone(s_Path);
+		CHECK(zone && zone == old_find_zone(s_Path));
+
+		char name[64];
+		snprintf(name, sizeof(name), "%s -> '%s'", s_Path, zone ? zone->prefix : "");
+		double new_ns = host_bench_run(run_new_lookup, NULL, iterations);
+		double old_ns = host_bench_run(run_old_lookup, NULL, iterations);
+		host_bench_report(name, "linear scan", new_ns, old_ns);
+	}
+
+	return host_test_result();
+}
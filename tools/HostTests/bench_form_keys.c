@@ -0,0 +1,93 @@
+//The server is included directly, so that the benchmark can compute the field hashes the same way as http_form_next_field()
+#include "httpserver.c"
+#include "host_test.h"
+#include "host_bench.h"
+
+//The keys of the settings form in main.c, in the same order
+static const char *const s_SettingNames[] = {
+	"has_password", "use_domain", "use_second_ip", "dns_ignores_network_suffix", "ssid", "password",
+	"hostname", "domain", "ipaddr", "netmask", "ipaddr2",
+};
+
+#define SETTING_COUNT (sizeof(s_SettingNames) / sizeof(s_SettingNames[0]))
+
+static uint32_t s_SettingHashes[SETTING_COUNT];
+static http_form_keys s_SettingKeys = { s_SettingNames, SETTING_COUNT, s_SettingHashes };
+
+//A form as submitted by the settings page
+static const char s_Form[] = "ssid=MyNetwork&has_password=true&password=secret123&hostname=picohttp&use_domain=true&domain=lan"
+	"&ipaddr=192.168.0.1&netmask=255.255.255.0&use_second_ip=false&ipaddr2=0.0.0.0&dns_ignores_network_suffix=true";
+
+static http_form_field s_Fields[SETTING_COUNT];
+static int s_FieldCount;
+
+//The strcasecmp() chain that parse_server_settings() used before the key table was added
+static int find_key_by_strcasecmp(const char *name)
+{
+	if (!strcasecmp(name, "has_password"))
+		return 0;
+	else if (!strcasecmp(name, "use_domain"))
+		return 1;
+	else if (!strcasecmp(name, "use_second_ip"))
+		return 2;
+	else if (!strcasecmp(name, "dns_ignores_network_suffix"))
+		return 3;
+	else if (!strcasecmp(name, "ssid"))
+		return 4;
+	else if (!strcasecmp(name, "password"))
+		return 5;
+	else if (!strcasecmp(name, "hostname"))
+		return 6;
+	else if (!strcasecmp(name, "domain"))
+		return 7;
+	else if (!strcasecmp(name, "ipaddr"))
+		return 8;
+	else if (!strcasecmp(name, "netmask"))
+		return 9;
+	else if (!strcasecmp(name, "ipaddr2"))
+		return 10;
+	return -1;
+}
+
+static void run_old_lookup(void *arg)
+{
+	for (int i = 0; i < s_FieldCount; i++)
+		s_HostBenchSink += find_key_by_strcasecmp(s_Fields[i].name);
+}
+
+static void run_new_lookup(void *arg)
+{
+	for (int i = 0; i < s_FieldCount; i++)
+		s_HostBenchSink += http_form_find_key(&s_SettingKeys, &s_Fields[i]);
+}
+
+//The hash is computed by http_form_next_field() while decoding the name, so the comparison is only fair with it counted as well
+static void run_new_lookup_with_hash(void *arg)
+{
+	for (int i = 0; i < s_FieldCount; i++)
+	{
+		http_form_field field = s_Fields[i];
+		field.hash = http_form_hash(field.name, strlen(field.name));
+		s_HostBenchSink += http_form_find_key(&s_SettingKeys, &field);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = host_bench_iterations(argc, argv, 20000);
+	static char form[sizeof(s_Form)];
+	memcpy(form, s_Form, sizeof(s_Form));
+
+	char *cursor = form;
+	while (s_FieldCount < SETTING_COUNT && http_form_next_field(&cursor, &s_Fields[s_FieldCount]))
+		s_FieldCount++;
+
+	CHECK(s_FieldCount == SETTING_COUNT);
+	for (int i = 0; i < s_FieldCount; i++)
+		CHECK(http_form_find_key(&s_SettingKeys, &s_Fields[i]) == find_key_by_strcasecmp(s_Fields[i].name));
+
+	double old_ns = host_bench_run(run_old_lookup, NULL, iterations) / s_FieldCount;
+	host_bench_report("settings form, lookup per field", "strcasecmp() chain", host_bench_run(run_new_lookup, NULL, iterations) / s_FieldCount, old_ns);
+	host_bench_report("settings form, hash and lookup per field", "strcasecmp() chain", host_bench_run(run_new_lookup_with_hash, NULL, iterations) / s_FieldCount, old_ns);
+	return host_test_result();
+}
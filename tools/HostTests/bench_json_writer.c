@@ -0,0 +1,126 @@
+//The server is included directly, so that the benchmark can format replies into the connection buffer without sending them
+#include "httpserver.c"
+#include "host_test.h"
+#include "host_bench.h"
+
+static struct _http_server_instance s_Server = { .buffer_size = 4096 };	//Same as the buffer size used by main.c
+
+//The state that do_read_pins() reads from the GPIO registers
+struct pin_state
+{
+	bool led;
+	uint32_t initialized, directions, values;
+};
+
+struct bench_context
+{
+	http_connection conn;
+	const struct pin_state *pins;
+};
+
+//Same calls as do_read_pins() in main.c
+static void write_pins_json(void *arg)
+{
+	struct bench_context *ctx = arg;
+	ctx->conn->buffered_size = 0;
+
+	http_json_writer json;
+	http_json_begin(&json, (http_write_handle)ctx->conn);
+	http_json_begin_object(&json, NULL);
+	http_json_string(&json, "led0v", ctx->pins->led ? "1" : "0");
+
+	for (int i = 0; i < 29; i++)
+	{
+		if (i > 22 && i < 26)
+			continue;
+
+		if (ctx->pins->initialized & (1 << i))
+		{
+			char key[8] = "gpio";
+			int len = 4;
+			if (i >= 10)
+				key[len++] = '0' + i / 10;
+			key[len++] = '0' + i % 10;
+			key[len + 1] = 0;
+
+			key[len] = 'd';
+			http_json_string(&json, key, ((ctx->pins->directions >> i) & 1) ? "OUT" : "IN");
+			key[len] = 'v';
+			http_json_string(&json, key, ((ctx->pins->values >> i) & 1) ? "1" : "0");
+		}
+	}
+
+	http_json_end_object(&json);
+	s_HostBenchSink += ctx->conn->buffered_size;
+}
+
+//The http_server_write_reply() calls that do_read_pins() used before the JSON writer was added (without the spaces after the colons, so that the output is the same)
+static void write_pins_printf(void *arg)
+{
+	struct bench_context *ctx = arg;
+	ctx->conn->buffered_size = 0;
+
+	http_write_handle reply = (http_write_handle)ctx->conn;
+	http_server_write_reply(reply, "{\"led0v\":\"%d\"", ctx->pins->led);
+	for (int i = 0; i < 29; i++)
+	{
+		if (i > 22 && i < 26)
+			continue;
+
+		if (ctx->pins->initialized & (1 << i))
+			http_server_write_reply(reply, ",\"gpio%dd\":\"%s\",\"gpio%dv\":\"%d\"", i, ((ctx->pins->directions >> i) & 1) ? "OUT" : "IN", i, (ctx->pins->values >> i) & 1);
+	}
+
+	http_server_write_reply_data(reply, "}", 1);
+	s_HostBenchSink += ctx->conn->buffered_size;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = host_bench_iterations(argc, argv, 20000);
+	static const struct pin_state states[] = {
+		{ true, 0x1C7FFFFF, 0x00F0F0F0, 0x12345678 },	//Every pin shown on the page
+		{ false, 0x00000043, 0x00000001, 0x00000041 },	//A few pins
+	};
+	static const char *const names[] = { "do_read_pins(), all pins", "do_read_pins(), 3 pins" };
+
+	struct bench_context ctx = { alloc_connection(&s_Server) };
+	static char expected[4096];
+	ctx.conn->chunked = ctx.conn->discard_body = false;
+
+	for (int i = 0; i < sizeof(states) / sizeof(states[0]); i++)
+	{
+		ctx.pins = &states[i];
+
+		//The replies fit into the buffer, so nothing gets sent and both versions can be compared there
+		write_pins_printf(&ctx);
+		int len = ctx.conn->buffered_size;
+		memcpy(expected, ctx.conn->buffer, len);
+		write_pins_json(&ctx);
+		CHECK(ctx.conn->buffered_size == len && !memcmp(ctx.conn->buffer, expected, len));
+
+		char name[64];
+		snprintf(name, sizeof(name), "%s, %d bytes", names[i], len);
+		double json_ns = host_bench_run(write_pins_json, &ctx, iterations);
+		double printf_ns = host_bench_run(write_pins_printf, &ctx, iterations);
+		host_bench_report(name, "vsnprintf", json_ns, printf_ns);
+	}
+
+	//Strings that need escaping take the slower path
+	ctx.conn->buffered_size = 0;
+	http_json_writer json;
+	http_json_begin(&json, (http_write_handle)ctx.conn);
+	http_json_begin_object(&json, NULL);
+	http_json_string(&json, "a\"b", "x\ny\\");
+	http_json_int(&json, "n", -12);
+	http_json_begin_array(&json, "list");
+	http_json_bool(&json, NULL, true);
+	http_json_string(&json, NULL, "");
+	http_json_end_array(&json);
+	http_json_ipv4(&json, "ip", 0x0100A8C0);
+	http_json_end_object(&json);
+	ctx.conn->buffer[ctx.conn->buffered_size] = 0;
+	CHECK_STR(ctx.conn->buffer, "{\"a\\\"b\":\"x\\u000ay\\\\\",\"n\":-12,\"list\":[true,\"\"],\"ip\":\"192.168.0.1\"}");
+
+	return host_test_result();
+}
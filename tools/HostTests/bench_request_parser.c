@@ -0,0 +1,284 @@
+#define _GNU_SOURCE	//memmem()
+//The server is included directly, so that the benchmark can call the parser functions
+#include "httpserver.c"
+#include "host_test.h"
+#include "host_bench.h"
+
+static struct _http_server_instance s_Server;
+
+//GET requests in the form sent by the browsers and curl when opening the pages of the server (header order and values as sent)
+static const char *const s_Requests[][2] = {
+	{ "Chrome", "GET / HTTP/1.1\r\n"
+		"Host: picohttp.local\r\n"
+		"Connection: keep-alive\r\n"
+		"Upgrade-Insecure-Requests: 1\r\n"
+		"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+		"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+		"Accept-Encoding: gzip, deflate\r\n"
+		"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+		"If-None-Match: \"5f3a2c1b00001a2f\"\r\n"
+		"\r\n" },
+	{ "Chrome (stylesheet)", "GET /style.css HTTP/1.1\r\n"
+		"Host: picohttp.local\r\n"
+		"Connection: keep-alive\r\n"
+		"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+		"Accept: text/css,*/*;q=0.1\r\n"
+		"Referer: http://picohttp.local/\r\n"
+		"Accept-Encoding: gzip, deflate\r\n"
+		"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+		"\r\n" },
+	{ "Firefox", "GET /api/readpins HTTP/1.1\r\n"
+		"Host: picohttp.local\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/119.0\r\n"
+		"Accept: */*\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate\r\n"
+		"Connection: keep-alive\r\n"
+		"Referer: http://picohttp.local/\r\n"
+		"\r\n" },
+	{ "curl", "GET /api/stats HTTP/1.1\r\n"
+		"Host: picohttp.local\r\n"
+		"User-Agent: curl/8.4.0\r\n"
+		"Accept: */*\r\n"
+		"\r\n" },
+};
+
+//Stands in for the socket: returns the request in fragments of at most 'step' bytes
+struct memory_link
+{
+	const char *data;
+	int size, pos, step;
+};
+
+static int memory_link_recv(struct memory_link *link, char *buffer, int size)
+{
+	int done = MIN(MIN(size, link->step), link->size - link->pos);
+	memcpy(buffer, link->data + link->pos, done);
+	link->pos += done;
+	return done;
+}
+
+/* The line-based parser used by the socket backend before the incremental one was added, reading from memory instead
+ * of the socket. The lines are found via strnstr() and the headers are matched by comparing each line with every prefix. */
+
+//Same as the newlib version
+static char *old_strnstr(const char *haystack, const char *needle, size_t haystack_len)
+{
+	size_t needle_len = strnlen(needle, haystack_len);
+	if (needle_len < haystack_len || !needle[needle_len])
+	{
+		char *x = memmem(haystack, haystack_len, needle, needle_len);
+		if (x && !memchr(haystack, 0, x - haystack))
+			return x;
+	}
+	return NULL;
+}
+
+static int old_recv_line(struct memory_link *link, char *buffer, int buffer_size)
+{
+	int buffer_done = 0;
+	while (buffer_done < buffer_size)
+	{
+		int done = memory_link_recv(link, buffer + buffer_done, buffer_size - buffer_done);
+		if (done <= 0)
+			return 0;
+
+		buffer_done += done;
+		char *p = old_strnstr(buffer, "\r\n", buffer_done);
+		if (p)
+			return buffer_done;
+	}
+
+	return 0;
+}
+
+static char *old_recv_next_line_buffered(struct memory_link *link, char *buffer, int buffer_size, int *buffer_used, int *offset, int *len)
+{
+	int skipped_len = 0;
+	if (*offset > *buffer_used)
+		return NULL;
+
+	for (;;)
+	{
+		char *start = buffer + *offset;
+		char *limit = buffer + *buffer_used;
+		char *p = old_strnstr(start, "\r\n", limit - start);
+		if (p)
+		{
+			*p = 0;
+			*offset = p + 2 - buffer;
+			if (skipped_len)
+				*len = -(p - start + skipped_len);
+			else
+				*len = p - start;
+			return start;
+		}
+
+		if (*offset == 0 && buffer_size == *buffer_used)
+		{
+			buffer[0] = buffer[buffer_size - 1];
+			*buffer_used = (buffer[0] == '\r') ? 1 : 0;
+			skipped_len = buffer_size - *buffer_used;
+			*offset = 0;
+		}
+		else if (start < limit && start > buffer)
+		{
+			memmove(buffer, start, limit - start);
+			*buffer_used -= *offset;
+			*offset = 0;
+		}
+
+		int buffer_avail = buffer_size - *buffer_used;
+		if (buffer_avail <= 0)
+			return NULL;
+
+		int done = memory_link_recv(link, buffer + *buffer_used, buffer_avail);
+		if (done <= 0)
+			return NULL;
+
+		*buffer_used += done;
+	}
+}
+
+static void old_parse_header_line(struct http_request_headers *headers, const char *line, int len)
+{
+	if (!strncasecmp(line, "Host: ", 6) && (len - 6) < (sizeof(headers->host) - 1))
+	{
+		memcpy(headers->host, line + 6, len - 6);
+		headers->host[len - 6] = 0;
+	}
+	else if (!strncasecmp(line, "Content-length: ", 16))
+		headers->content_length = atoi(line + 16);
+	else if (!strncasecmp(line, "Connection: ", 12))
+	{
+		if (!strncasecmp(line + 12, "close", 5))
+			headers->keep_alive = false;
+		else if (!strncasecmp(line + 12, "keep-alive", 10))
+			headers->keep_alive = true;
+	}
+	else if (!strncasecmp(line, "Upgrade: ", 9))
+		headers->upgrade_websocket = !strncasecmp(line + 9, "websocket", 9);
+	else if (!strncasecmp(line, "If-None-Match: ", 15) && (len - 15) < (sizeof(headers->if_none_match) - 1))
+	{
+		memcpy(headers->if_none_match, line + 15, len - 15);
+		headers->if_none_match[len - 15] = 0;
+	}
+	else if (!strncasecmp(line, "Accept-Encoding: ", 17))
+		headers->accepted_encodings = parse_accept_encoding(line + 17, line + len);
+	else if (!strncasecmp(line, "Range: ", 7))
+		parse_range(headers, line + 7, line + len);
+	else if (!strncasecmp(line, "If-Range: ", 10) && (len - 10) < (sizeof(headers->if_range) - 1))
+	{
+		memcpy(headers->if_range, line + 10, len - 10);
+		headers->if_range[len - 10] = 0;
+	}
+	else if (!strncasecmp(line, "Sec-WebSocket-Key: ", 19) && (len - 19) < (sizeof(headers->websocket_key) - 1))
+	{
+		memcpy(headers->websocket_key, line + 19, len - 19);
+		headers->websocket_key[len - 19] = 0;
+	}
+}
+
+//Returns the path, or NULL if the request could not be parsed
+static char *old_parse_request(struct memory_link *link, char *buffer, int buffer_size, enum http_request_type *type, struct http_request_headers *headers)
+{
+	int len = old_recv_line(link, buffer, buffer_size);
+	char *path = NULL, *header_buf = NULL;
+	int header_buf_size = 0, header_buf_pos = 0, header_buf_used = 0;
+	memset(headers, 0, sizeof(*headers));
+	*type = HTTP_GET;
+
+	char *p = len ? old_strnstr(buffer, "\r\n", len) : NULL;
+	if (p)
+	{
+		*p = 0;
+		path = parse_request_line(buffer, type, headers);
+
+		int off = p + 2 - buffer;
+		header_buf = buffer + off;
+		header_buf_size = buffer_size - off;
+		header_buf_used = len - off;
+	}
+
+	if (!path || header_buf_size < 32)
+		return NULL;
+
+	for (;;)
+	{
+		char *line = old_recv_next_line_buffered(link, header_buf, header_buf_size, &header_buf_used, &header_buf_pos, &len);
+		if (!line)
+			return NULL;
+		if (!line[0])
+			return path;
+		if (len > 0)
+			old_parse_header_line(headers, line, len);
+	}
+}
+
+struct bench_context
+{
+	const char *request;
+	int size, step;
+	char buffer[4096];	//Same as the buffer size used by main.c
+	http_request_parser parser;
+	struct http_request_headers old_headers;
+	enum http_request_type old_type;
+	char *old_path;
+};
+
+static void run_old_parser(void *arg)
+{
+	struct bench_context *ctx = arg;
+	struct memory_link link = { ctx->request, ctx->size, 0, ctx->step };
+	ctx->old_path = old_parse_request(&link, ctx->buffer, sizeof(ctx->buffer), &ctx->old_type, &ctx->old_headers);
+	s_HostBenchSink += (uintptr_t)ctx->old_path;
+}
+
+//Feeds the request in the same fragments as the old parser receives it
+static void run_new_parser(void *arg)
+{
+	struct bench_context *ctx = arg;
+	http_parser_reset(&ctx->parser, &s_Server, ctx->buffer, sizeof(ctx->buffer));
+	for (int pos = 0; pos < ctx->size && ctx->parser.state < HTTP_PARSER_DONE; pos += ctx->step)
+		http_parser_feed(&ctx->parser, ctx->request + pos, MIN(ctx->step, ctx->size - pos));
+	s_HostBenchSink += ctx->parser.state;
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = host_bench_iterations(argc, argv, 20000);
+	static const int steps[] = { 1460, 64 };	//A full segment, and a request split into small fragments
+	static struct bench_context ctx;
+
+	for (int i = 0; i < sizeof(s_Requests) / sizeof(s_Requests[0]); i++)
+	{
+		for (int j = 0; j < sizeof(steps) / sizeof(steps[0]); j++)
+		{
+			ctx.request = s_Requests[i][1];
+			ctx.size = strlen(ctx.request);
+			ctx.step = steps[j];
+
+			//Both parsers must extract the same fields from the request before their timings are compared
+			char old_path[256];
+			run_old_parser(&ctx);
+			CHECK(ctx.old_path != NULL);
+			snprintf(old_path, sizeof(old_path), "%s", ctx.old_path ? ctx.old_path : "");
+			run_new_parser(&ctx);
+			struct http_request_headers *headers = &ctx.parser.headers;
+			CHECK(ctx.parser.state == HTTP_PARSER_DONE);
+			CHECK_STR(ctx.parser.path, old_path);
+			CHECK(ctx.parser.type == ctx.old_type);
+			CHECK(!strcmp(headers->host, ctx.old_headers.host) && !strcmp(headers->if_none_match, ctx.old_headers.if_none_match));
+			CHECK(headers->keep_alive == ctx.old_headers.keep_alive && headers->http11 == ctx.old_headers.http11);
+			CHECK(headers->accepted_encodings == ctx.old_headers.accepted_encodings);
+
+			char name[64];
+			snprintf(name, sizeof(name), "%s, %d bytes in %d-byte fragments", s_Requests[i][0], ctx.size, ctx.step);
+			double new_ns = host_bench_run(run_new_parser, &ctx, iterations);
+			double old_ns = host_bench_run(run_old_parser, &ctx, iterations);
+			host_bench_report(name, "line-based parser", new_ns, old_ns);
+		}
+	}
+
+	return host_test_result();
+}
@@ -0,0 +1,114 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "httpserver.h"
+
+/* Fuzz target for the query string and form parser. With clang, fuzz_form_parser_libfuzzer links it with libFuzzer
+ * ('fuzz_form_parser_libfuzzer corpus_dir'). The fuzz_form_parser test runs it under ASan/UBSan on random inputs
+ * and on the files given on the command line, so that the build machines without libFuzzer check it too. */
+
+static const char *const s_Names[] = { "has_password", "use_domain", "ssid", "password", "v", "d", "na me", "" };
+static uint32_t s_Hashes[sizeof(s_Names) / sizeof(s_Names[0])];
+static http_form_keys s_Keys = { s_Names, sizeof(s_Names) / sizeof(s_Names[0]), s_Hashes };
+
+#define FUZZ_CHECK(cond)	\
+	do	\
+	{	\
+		if (!(cond))	\
+		{	\
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);	\
+			abort();	\
+		}	\
+	} while (0)
+
+//The expected result of http_form_find_key(): the first name equal to the field name, unless the decoded name contains a 0 byte
+static int find_key_slowly(const http_form_field *field)
+{
+	//Same hash as http_form_find_key() computes for the names
+	uint32_t hash = 2166136261U;
+	for (const char *p = field->name; *p; p++)
+		hash = (hash ^ (uint8_t)tolower((unsigned char)*p)) * 16777619U;
+	if (hash != field->hash)
+		return -1;
+
+	for (int i = 0; i < s_Keys.count; i++)
+		if (!strcasecmp(s_Names[i], field->name))
+			return i;
+	return -1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	//The parser works on NUL-terminated strings, so the input is cut at the first 0 byte like a C string would be
+	char *text = malloc(size + 1);
+	memcpy(text, data, size);
+	text[size] = 0;
+	char *end = text + strlen(text);
+
+	char *query = http_form_split_query(text);
+	FUZZ_CHECK(query >= text && query <= end);
+
+	http_form_field field;
+	char *cursor = query;
+	while (http_form_next_field(&cursor, &field))
+	{
+		FUZZ_CHECK(cursor > query && cursor <= end);
+		FUZZ_CHECK(field.name >= query && field.name < cursor);
+		FUZZ_CHECK(field.value >= field.name && field.value <= end);
+
+		//Decoding never makes the strings longer
+		FUZZ_CHECK(field.name + strlen(field.name) <= end && field.value + strlen(field.value) <= end);
+		FUZZ_CHECK(http_form_find_key(&s_Keys, &field) == find_key_slowly(&field));
+	}
+
+	FUZZ_CHECK(!http_form_next_field(&cursor, &field));
+	free(text);
+	return 0;
+}
+
+#ifndef HOST_LIBFUZZER
+static void run_file(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+	{
+		fprintf(stderr, "cannot open %s\n", path);
+		exit(1);
+	}
+
+	static uint8_t data[65536];
+	size_t size = fread(data, 1, sizeof(data), fp);
+	fclose(fp);
+	LLVMFuzzerTestOneInput(data, size);
+}
+
+int main(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++)
+		run_file(argv[i]);
+
+	//Random strings made mostly of the characters that the parser treats specially
+	static const char alphabet[] = "=&%+?a1FsSiIdD \0\x80\xff";
+	srand(1);
+	for (int i = 0; i < 200000; i++)
+	{
+		uint8_t data[64];
+		int len = rand() % sizeof(data);
+		for (int j = 0; j < len; j++)
+			data[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		LLVMFuzzerTestOneInput(data, len);
+	}
+
+	//Every key as a field name, encoded in different ways
+	static const char *const forms[] = { "has_password=1&USE_DOMAIN=&ssid", "x?v&d=%41&na+me=1&na%20me&password=%", "=&&=a&%00=b&ssid%00=c" };
+	for (int i = 0; i < sizeof(forms) / sizeof(forms[0]); i++)
+		LLVMFuzzerTestOneInput((const uint8_t *)forms[i], strlen(forms[i]));
+
+	return 0;
+}
+#endif
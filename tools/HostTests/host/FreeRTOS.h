@@ -0,0 +1,41 @@
+#pragma once
+
+/* Host replacement for the parts of FreeRTOS used by the server. The tests call the server functions from a single thread,
+ * so the synchronization primitives never block (see host_port.c). */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef void (*TaskFunction_t)(void *);
+typedef void *TaskHandle_t;
+typedef struct host_queue *QueueHandle_t;
+typedef QueueHandle_t SemaphoreHandle_t;
+typedef QueueHandle_t xQueueHandle;
+typedef SemaphoreHandle_t xSemaphoreHandle;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#if FREE_RTOS_KERNEL_SMP
+#define configNUM_CORES 2
+#endif
+
+#define configTICK_RATE_HZ 1000
+#define configMINIMAL_STACK_SIZE 256
+#define configMAX_PRIORITIES 8
+#define tskIDLE_PRIORITY 0
+
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms) * configTICK_RATE_HZ / 1000)
+
+#define taskENTER_CRITICAL()
+#define taskEXIT_CRITICAL()
+
+void *pvPortMalloc(size_t size);
+void vPortFree(void *p);
@@ -0,0 +1,5 @@
+#pragma once
+
+//Nothing on the host is memory-mapped FLASH, so all replies are copied before being sent
+#define XIP_BASE 0
+#define SRAM_BASE 0
@@ -0,0 +1,165 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "FreeRTOS.h"
+#include "queue.h"
+#include "semphr.h"
+#include "task.h"
+
+//Queues and semaphores share the same structure, same as in FreeRTOS. Semaphores have an item size of 0.
+struct host_queue
+{
+	UBaseType_t length, item_size;
+	UBaseType_t count, head;
+	char items[];
+};
+
+void *pvPortMalloc(size_t size)
+{
+	return malloc(size);
+}
+
+void vPortFree(void *p)
+{
+	free(p);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t func, const char *name, uint32_t stack_size, void *arg, UBaseType_t priority, TaskHandle_t *handle)
+{
+	return pdFAIL;
+}
+
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t priority)
+{
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (TickType_t)(ts.tv_sec * configTICK_RATE_HZ + ts.tv_nsec / (1000000000 / configTICK_RATE_HZ));
+}
+
+void vTaskSetTimeOutState(TimeOut_t *timeout)
+{
+	timeout->start = xTaskGetTickCount();
+}
+
+//Same as in FreeRTOS: returns pdTRUE once the time has passed, otherwise reduces *ticks_left by the time elapsed since the last call
+BaseType_t xTaskCheckForTimeOut(TimeOut_t *timeout, TickType_t *ticks_left)
+{
+	if (*ticks_left == portMAX_DELAY)
+		return pdFALSE;
+
+	TickType_t now = xTaskGetTickCount(), elapsed = now - timeout->start;
+	if (elapsed >= *ticks_left)
+	{
+		*ticks_left = 0;
+		return pdTRUE;
+	}
+
+	*ticks_left -= elapsed;
+	timeout->start = now;
+	return pdFALSE;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+	QueueHandle_t queue = calloc(1, sizeof(struct host_queue) + length * item_size);
+	queue->length = length;
+	queue->item_size = item_size;
+	return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+	free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t timeout)
+{
+	if (queue->count == queue->length)
+		return pdFALSE;
+
+	memcpy(queue->items + ((queue->head + queue->count) % queue->length) * queue->item_size, item, queue->item_size);
+	queue->count++;
+	return pdTRUE;
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t timeout)
+{
+	if (queue->count == queue->length)
+		return pdFALSE;
+
+	queue->head = (queue->head + queue->length - 1) % queue->length;
+	memcpy(queue->items + queue->head * queue->item_size, item, queue->item_size);
+	queue->count++;
+	return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t timeout)
+{
+	if (!queue->count)
+		return pdFALSE;
+
+	memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+	queue->head = (queue->head + 1) % queue->length;
+	queue->count--;
+	return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+	return queue->count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+	SemaphoreHandle_t semaphore = xQueueCreate(max_count, 0);
+	semaphore->count = initial_count;
+	return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return xSemaphoreCreateCounting(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t timeout)
+{
+	if (!semaphore->count)
+		return pdFALSE;
+
+	semaphore->count--;
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+	if (semaphore->count == semaphore->length)
+		return pdFALSE;
+
+	semaphore->count++;
+	return pdTRUE;
+}
+
+void debug_printf(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+void debug_write(const void *data, int size)
+{
+	fwrite(data, 1, size, stderr);
+}
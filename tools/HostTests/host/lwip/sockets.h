@@ -0,0 +1,20 @@
+#pragma once
+
+//The lwIP socket API follows BSD sockets, so the server runs on top of the host ones (e.g. a socketpair() created by the test)
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define closesocket close
+
+//lwIP follows BSD in having a length field in struct sockaddr_in, but Linux does not, so it goes into the padding
+#define sin_len sin_zero[0]
+
+//Only used to size the send workaround in httpserver.c
+#define MEM_SIZE 16384
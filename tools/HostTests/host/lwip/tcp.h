@@ -0,0 +1,81 @@
+#pragma once
+
+/* Host replacement for the lwIP raw TCP API, used by the tests built with HTTP_SERVER_USE_RAW_API. Nothing is sent over the network:
+ * the test invokes the callbacks stored in the PCB to deliver the data, and the written data is collected in the PCB (see host_lwip.c). */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef int8_t err_t;
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_VAL -6
+#define ERR_ABRT -13
+#define ERR_CLSD -15
+
+struct pbuf
+{
+	struct pbuf *next;
+	void *payload;
+	u16_t tot_len, len;
+};
+
+void pbuf_cat(struct pbuf *head, struct pbuf *tail);
+u8_t pbuf_free(struct pbuf *p);
+struct pbuf *pbuf_free_header(struct pbuf *q, u16_t size);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *data, u16_t len, u16_t offset);
+
+//Splits the data into a chain of pbufs of 'segment' bytes each
+struct pbuf *host_pbuf_chain(const char *data, int size, int segment);
+
+struct tcp_pcb;
+typedef err_t (*tcp_accept_fn)(void *arg, struct tcp_pcb *pcb, err_t err);
+typedef err_t (*tcp_recv_fn)(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err);
+typedef err_t (*tcp_sent_fn)(void *arg, struct tcp_pcb *pcb, u16_t len);
+typedef void (*tcp_err_fn)(void *arg, err_t err);
+
+struct tcp_pcb
+{
+	void *arg;
+	tcp_accept_fn accept;
+	tcp_recv_fn recv;
+	tcp_sent_fn sent;
+	tcp_err_fn errf;
+	bool listening, closed, aborted, tx_shut, nodelay;
+	int sndbuf;	//Not reduced by tcp_write(), so the test decides when the buffer is full
+	int recved;	//Total passed to tcp_recved()
+	char *output;	//Everything passed to tcp_write()
+	int output_size;
+};
+
+#ifndef TCP_MSS	//Also defined by <netinet/tcp.h>
+#define TCP_MSS 1460
+#endif
+#define TCP_PRIO_MIN 1
+#define TCP_WRITE_FLAG_COPY 0x01
+#define TCP_WRITE_FLAG_MORE 0x02
+#define IPADDR_TYPE_ANY 46
+#define IP_ANY_TYPE NULL
+
+struct tcp_pcb *tcp_new_ip_type(u8_t type);
+err_t tcp_bind(struct tcp_pcb *pcb, const void *ipaddr, u16_t port);
+struct tcp_pcb *tcp_listen_with_backlog(struct tcp_pcb *pcb, u8_t backlog);
+void tcp_arg(struct tcp_pcb *pcb, void *arg);
+void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept);
+void tcp_recv(struct tcp_pcb *pcb, tcp_recv_fn recv);
+void tcp_sent(struct tcp_pcb *pcb, tcp_sent_fn sent);
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err);
+void tcp_recved(struct tcp_pcb *pcb, u16_t len);
+err_t tcp_write(struct tcp_pcb *pcb, const void *data, u16_t len, u8_t flags);
+err_t tcp_output(struct tcp_pcb *pcb);
+err_t tcp_close(struct tcp_pcb *pcb);
+void tcp_abort(struct tcp_pcb *pcb);
+err_t tcp_shutdown(struct tcp_pcb *pcb, int shut_rx, int shut_tx);
+void tcp_setprio(struct tcp_pcb *pcb, u8_t prio);
+
+#define tcp_sndbuf(pcb) ((pcb)->sndbuf)
+#define tcp_nagle_disable(pcb) ((pcb)->nodelay = true)
+#define tcp_nagle_enable(pcb) ((pcb)->nodelay = false)
@@ -0,0 +1,5 @@
+#pragma once
+
+//The tests call the raw API from a single thread
+#define LOCK_TCPIP_CORE()
+#define UNLOCK_TCPIP_CORE()
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+//There is no FLASH to stay out of on the host
+#define __not_in_flash_func(func) func
+
+//Defined by the tests that need it, so that they can control the time
+uint32_t time_us_32(void);
@@ -0,0 +1,9 @@
+#pragma once
+#include "FreeRTOS.h"
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t timeout);
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t timeout);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t timeout);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+void vQueueDelete(QueueHandle_t queue);
@@ -0,0 +1,11 @@
+#pragma once
+#include "queue.h"
+
+//Semaphores are counters that fail instead of blocking
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t timeout);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+
+#define vSemaphoreDelete vQueueDelete
@@ -0,0 +1,26 @@
+#pragma once
+#include "FreeRTOS.h"
+
+//Same as the V202110 SMP branch used with the Pico SDK
+#define tskKERNEL_VERSION_MAJOR 10
+
+//Tasks cannot be created on the host, so http_server_create() starts no workers
+BaseType_t xTaskCreate(TaskFunction_t func, const char *name, uint32_t stack_size, void *arg, UBaseType_t priority, TaskHandle_t *handle);
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t priority);
+TickType_t xTaskGetTickCount(void);
+
+typedef struct
+{
+	TickType_t start;
+} TimeOut_t;
+
+void vTaskSetTimeOutState(TimeOut_t *timeout);
+BaseType_t xTaskCheckForTimeOut(TimeOut_t *timeout, TickType_t *ticks_left);
+
+//Defined by the tests that need them, so that they can pick the running task
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+#if FREE_RTOS_KERNEL_SMP
+TaskHandle_t *xTaskGetIdleTaskHandle(void);	//The SMP branch returns the idle task of each core
+#else
+TaskHandle_t xTaskGetIdleTaskHandle(void);
+#endif
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+/* The benchmarks are registered as tests, so that they get built and checked together with them. The numbers are
+ * measured on the build machine and only compare the implementations with each other, they are not Pico timings.
+ * The iteration count can be given on the command line (e.g. 'bench_request_parser 1000000') for more stable results. */
+
+//Results are stored here, so that the compiler cannot drop the benchmarked calls
+static volatile uintptr_t s_HostBenchSink;
+
+static inline int host_bench_iterations(int argc, char *argv[], int default_count)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 0;
+	return count > 0 ? count : default_count;
+}
+
+//Calls func(context) the specified number of times and returns the average time per call in nanoseconds
+static inline double host_bench_run(void (*func)(void *), void *context, int iterations)
+{
+	struct timespec start, end;
+	func(context);	//Warm up the caches
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < iterations; i++)
+		func(context);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	return ns / iterations;
+}
+
+static inline void host_bench_report(const char *name, const char *baseline_name, double ns, double baseline_ns)
+{
+	printf("%-52s %8.1f ns, %s: %8.1f ns (x%.2f)\n", name, ns, baseline_name, baseline_ns, baseline_ns / ns);
+}
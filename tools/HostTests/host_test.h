@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdio.h>
+
+//Failed checks are reported, but do not stop the test, so that a single run shows all of them
+static int s_HostTestFailures;
+
+#define CHECK(cond)	\
+	do	\
+	{	\
+		if (!(cond))	\
+		{	\
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);	\
+			s_HostTestFailures++;	\
+		}	\
+	} while (0)
+
+#define CHECK_STR(actual, expected) CHECK((actual) && !strcmp((actual), (expected)))
+
+static inline int host_test_result(void)
+{
+	if (s_HostTestFailures)
+		fprintf(stderr, "%d check(s) failed\n", s_HostTestFailures);
+	return s_HostTestFailures ? 1 : 0;
+}
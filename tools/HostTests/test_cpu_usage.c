@@ -0,0 +1,100 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pico/stdlib.h>
+#include <FreeRTOS.h>
+#include <task.h>
+
+#include "cpu_usage.h"
+#include "host_test.h"
+
+//The test switches the tasks by calling the hook the same way as the scheduler does, at the times it chooses
+static uint32_t s_Now;
+static TaskHandle_t s_CurrentTask;
+static TaskHandle_t s_IdleTasks[configNUM_CORES] = { (TaskHandle_t)0x100, (TaskHandle_t)0x101 };
+static const TaskHandle_t s_Worker = (TaskHandle_t)0x200, s_Network = (TaskHandle_t)0x201;
+
+uint32_t time_us_32(void)
+{
+	return s_Now;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	return s_CurrentTask;
+}
+
+TaskHandle_t *xTaskGetIdleTaskHandle(void)
+{
+	return s_IdleTasks;
+}
+
+static void switch_task(int core, TaskHandle_t task, uint32_t time)
+{
+	s_Now = time;
+	s_CurrentTask = task;
+	cpu_usage_task_switched_in(core);
+}
+
+static void check_load(uint32_t time, int core0, int core1)
+{
+	int percent[CPU_USAGE_MAX_CORES];
+	s_Now = time;
+	cpu_usage_sample(percent);
+	CHECK(percent[0] == core0);
+	CHECK(percent[1] == core1);
+}
+
+//Starts a new interval with both cores idle. The time can be close to the wraparound of the counter.
+static void reset(uint32_t time)
+{
+	switch_task(0, s_IdleTasks[0], time);
+	switch_task(1, s_IdleTasks[1], time);
+	int percent[CPU_USAGE_MAX_CORES];
+	s_Now = time;
+	cpu_usage_sample(percent);
+}
+
+static void test_load(uint32_t start)
+{
+	reset(start);
+
+	//Core 0 runs a worker for 30% of the interval, core 1 runs the network task from 20% until the sample is taken
+	switch_task(0, s_Worker, start + 1000);
+	switch_task(0, s_IdleTasks[0], start + 4000);
+	switch_task(1, s_Network, start + 2000);
+	check_load(start + 10000, 30, 80);
+
+	//The task still running at the previous sample is counted in the next interval up to its switch
+	switch_task(1, s_IdleTasks[1], start + 12000);
+	check_load(start + 20000, 0, 20);
+}
+
+//The idle task of the other core can run on this one (the SMP scheduler does not pin them), and still counts as idle
+static void test_idle_task_of_other_core(void)
+{
+	reset(0);
+	switch_task(0, s_Worker, 0);
+	switch_task(0, s_IdleTasks[1], 5000);
+	switch_task(1, s_IdleTasks[0], 0);
+	check_load(10000, 50, 0);
+}
+
+static void test_fully_busy(void)
+{
+	reset(0);
+	switch_task(0, s_Worker, 0);
+	switch_task(1, s_Network, 0);
+	switch_task(1, s_Worker, 3000);	//Switching between two busy tasks
+	check_load(10000, 100, 100);
+}
+
+int main(void)
+{
+	test_load(0);
+	test_load(UINT32_MAX - 5000);	//The microsecond counter wraps around within the interval
+	test_idle_task_of_other_core();
+	test_fully_busy();
+	return host_test_result();
+}
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "flash_writer.h"
+#include "host_test.h"
+
+#define FLASH_SIZE (1024 * 1024)
+#define IMAGE_BASE (64 * 1024)
+
+//Simulated FLASH: programming a sector replaces its contents, optionally corrupting one byte to test the verification
+static struct
+{
+	uint8_t contents[FLASH_SIZE];
+	int sectors_written;
+	int64_t corrupt_offset;
+} s_Flash;
+
+static void write_sector(void *context, uint32_t offset, const void *data)
+{
+	memcpy(s_Flash.contents + offset, data, FLASH_WRITER_SECTOR_SIZE);
+	if (offset == s_Flash.corrupt_offset)
+		s_Flash.contents[offset + 5] ^= 1;
+	s_Flash.sectors_written++;
+}
+
+static void wait(void *context)
+{
+}
+
+static const void *map(void *context, uint32_t offset)
+{
+	return s_Flash.contents + offset;
+}
+
+static const flash_writer_backend s_Backend = { write_sector, wait, map, NULL };
+
+//Reference implementation of the zlib CRC32
+static uint32_t crc32_bitwise(const uint8_t *data, uint32_t size)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	for (uint32_t i = 0; i < size; i++)
+	{
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+int main(void)
+{
+	static uint8_t image[300000], buffers[2 * FLASH_WRITER_SECTOR_SIZE];
+	srand(1);
+	for (int i = 0; i < sizeof(image); i++)
+		image[i] = rand();
+
+	CHECK(flash_writer_crc32(0, "123456789", 9) == 0xCBF43926);
+	s_Flash.corrupt_offset = -1;
+
+	//The result must not depend on how the data is split
+	for (int step = 1; step <= 70000; step = step * 7 + 3)
+	{
+		memset(s_Flash.contents, 0, sizeof(s_Flash.contents));
+		s_Flash.sectors_written = 0;
+
+		flash_writer writer;
+		flash_writer_begin(&writer, &s_Backend, IMAGE_BASE, FLASH_SIZE - IMAGE_BASE, buffers);
+		bool written = true;
+		for (int i = 0; i < sizeof(image); i += step)
+			written = written && flash_writer_write(&writer, image + i, (sizeof(image) - i < step) ? sizeof(image) - i : step);
+
+		CHECK(written && flash_writer_finish(&writer));
+		CHECK(writer.written == sizeof(image));
+		CHECK(writer.crc == crc32_bitwise(image, sizeof(image)));
+		CHECK(s_Flash.sectors_written == (sizeof(image) + FLASH_WRITER_SECTOR_SIZE - 1) / FLASH_WRITER_SECTOR_SIZE);
+		CHECK(!memcmp(s_Flash.contents + IMAGE_BASE, image, sizeof(image)));
+		CHECK(s_Flash.contents[IMAGE_BASE + sizeof(image)] == 0xFF);	//The last sector is padded
+	}
+
+	//A sector that does not read back correctly fails the write
+	s_Flash.corrupt_offset = IMAGE_BASE + 3 * FLASH_WRITER_SECTOR_SIZE;
+	flash_writer writer;
+	flash_writer_begin(&writer, &s_Backend, IMAGE_BASE, FLASH_SIZE - IMAGE_BASE, buffers);
+	flash_writer_write(&writer, image, sizeof(image));
+	CHECK(!flash_writer_finish(&writer));
+	s_Flash.corrupt_offset = -1;
+
+	//The data must fit into the region
+	flash_writer_begin(&writer, &s_Backend, IMAGE_BASE, 1000, buffers);
+	CHECK(!flash_writer_write(&writer, image, 1001));
+
+	return host_test_result();
+}
@@ -0,0 +1,98 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "httpserver.h"
+#include "host_test.h"
+
+static void test_query_string(void)
+{
+	char path[] = "led0?v=1&d=I&flag&&na%20me=a+b%2B%zz";
+	char *query = http_form_split_query(path);
+	CHECK_STR(path, "led0");
+
+	static const char *const names[] = { "V", "d", "na me", "flag" };
+	static uint32_t hashes[4];
+	static http_form_keys keys = { names, 4, hashes };
+
+	const char *expected[][2] = { { "v", "1" }, { "d", "I" }, { "flag", "" }, { "na me", "a b+%zz" } };
+	const int expected_keys[] = { 0, 1, 3, 2 };
+
+	http_form_field field;
+	int count = 0;
+	while (http_form_next_field(&query, &field))
+	{
+		if (count < 4)
+		{
+			CHECK_STR(field.name, expected[count][0]);
+			CHECK_STR(field.value, expected[count][1]);
+			CHECK(http_form_find_key(&keys, &field) == expected_keys[count]);
+		}
+		count++;
+	}
+
+	CHECK(count == 4);
+}
+
+static void test_no_query(void)
+{
+	char path[] = "settings";
+	char *query = http_form_split_query(path);
+	http_form_field field;
+	CHECK_STR(query, "");
+	CHECK(!http_form_next_field(&query, &field));
+}
+
+static void test_unknown_key(void)
+{
+	static const char *const names[] = { "ssid", "password" };
+	static uint32_t hashes[2];
+	static http_form_keys keys = { names, 2, hashes };
+
+	char form[] = "SSID=net&pass=x&PASSWORD=secret";
+	char *cursor = form;
+	http_form_field field;
+	int found[3], count = 0;
+	while (http_form_next_field(&cursor, &field) && count < 3)
+		found[count++] = http_form_find_key(&keys, &field);
+
+	CHECK(count == 3);
+	CHECK(found[0] == 0 && found[1] == -1 && found[2] == 1);
+}
+
+//Random input must not crash the parser or make it read past the end of the string
+static void test_random_input(void)
+{
+	static const char *const names[] = { "a", "1" };
+	static uint32_t hashes[2];
+	static http_form_keys keys = { names, 2, hashes };
+
+	srand(1);
+	for (int i = 0; i < 100000; i++)
+	{
+		char *text = malloc(40);
+		int len = rand() % 40;
+		for (int j = 0; j < len; j++)
+			text[j] = "a=&%+1F"[rand() % 7];
+		text[len] = 0;
+
+		char *cursor = text;
+		http_form_field field;
+		while (http_form_next_field(&cursor, &field))
+		{
+			CHECK(cursor <= text + len && field.value <= text + len);
+			http_form_find_key(&keys, &field);
+		}
+		free(text);
+	}
+}
+
+int main(void)
+{
+	test_query_string();
+	test_no_query();
+	test_unknown_key();
+	test_random_input();
+	return host_test_result();
+}
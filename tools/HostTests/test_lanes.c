@@ -0,0 +1,111 @@
+//The server is included directly, so that the test can run the worker steps without starting the worker tasks
+#include "httpserver.c"
+#include "host_test.h"
+
+static struct _http_server_instance s_Server = { .hostname = "picohttp", .domain_name = "lan", .buffer_size = 1024, .max_workers = 4 };
+
+static bool reply_with_path(http_connection conn, enum http_request_type type, char *path, void *context)
+{
+	http_server_send_reply(conn, "200 OK", "text/plain", path, -1);
+	return true;
+}
+
+//Sends the request over a socket pair and returns the socket of the client
+static int connect_client(http_connection ctx, const char *path)
+{
+	char request[256];
+	int sockets[2], len = sprintf(request, "GET %s HTTP/1.1\r\nHost: picohttp\r\n\r\n", path);
+	CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+	CHECK(send(sockets[1], request, len, 0) == len);
+	shutdown(sockets[1], SHUT_WR);
+
+	ctx->link = sockets[0];
+	ctx->detached = ctx->nodelay = false;
+	ctx->requests_served = 0;
+	return sockets[1];
+}
+
+//Compares the status line of the reply sent so far (an empty string if nothing was sent)
+static void check_status(int client, const char *expected)
+{
+	char reply[1024];
+	int len = recv(client, reply, sizeof(reply) - 1, MSG_DONTWAIT);
+	reply[len > 0 ? len : 0] = 0;
+	CHECK(!strstr(reply + 1, "HTTP/1.1 "));	//Only one reply was sent
+	char *end = strchr(reply, '\r');
+	if (end)
+		*end = 0;
+	CHECK_STR(reply, expected);
+}
+
+int main(void)
+{
+	static http_zone files, api;
+	s_Server.zone_lock = xSemaphoreCreateMutex();
+	s_Server.connection_queue = xQueueCreate(s_Server.max_workers + 1, sizeof(http_link));
+	for (int i = 0; i < HTTP_LANE_COUNT; i++)
+		s_Server.lanes[i].limit = s_Server.max_workers;
+
+	http_server_add_zone_ex(&s_Server, &files, "", HTTP_METHOD_GET, false, reply_with_path, NULL);
+	http_server_add_zone(&s_Server, &api, "/api", reply_with_path, NULL);
+	http_server_set_zone_lane(&files, HTTP_LANE_BULK);
+	http_server_set_lane_limits(&s_Server, HTTP_LANE_BULK, 1, HTTP_SERVER_WORKER_PRIORITY);
+
+	//A single spare object, so that one request can wait for its lane
+	s_Server.spare_connections = alloc_connection(&s_Server);
+	s_Server.spare_connections->next = NULL;
+
+	//A download is running in the bulk lane, so the next file request waits without holding the worker
+	http_connection worker = alloc_connection(&s_Server), queued = worker;
+	s_Server.lanes[HTTP_LANE_BULK].running = 1;
+	int file_client = connect_client(worker, "/style.css");
+	worker = serve_connection(worker, false);
+	CHECK(worker != queued && s_Server.lanes[HTTP_LANE_BULK].queue_head == queued);
+	CHECK(!s_Server.spare_connections);
+	CHECK(s_Stats.queued_requests == 1);
+	check_status(file_client, "");
+
+	//The worker keeps serving the default lane
+	int api_client = connect_client(worker, "/api/readpins");
+	CHECK(serve_connection(worker, false) == worker);
+	check_status(api_client, "HTTP/1.1 200 OK");
+	CHECK(s_Server.lanes[HTTP_LANE_DEFAULT].running == 0);
+
+	//No spare object is left to queue another file request
+	int rejected_client = connect_client(worker, "/app.js");
+	CHECK(serve_connection(worker, false) == worker);
+	check_status(rejected_client, "HTTP/1.1 503 Service Unavailable");
+	CHECK(s_Stats.shed_requests == 1);
+
+	//Nothing can be resumed while the lane is full
+	CHECK(!resume_queued_request(worker));
+	CHECK(!uxQueueMessagesWaiting(s_Server.connection_queue));
+
+	//Once the download finishes, a worker gets woken up to resume the queued request and gives its own object to the spares
+	release_lane(&s_Server, HTTP_LANE_BULK);
+	http_link link;
+	CHECK(xQueueReceive(s_Server.connection_queue, &link, 0) == pdTRUE && link == HTTP_WAKEUP_LINK);
+	s_Server.wakeup_queued = false;
+
+	http_connection resumed = resume_queued_request(worker);
+	CHECK(resumed == queued && s_Server.spare_connections == worker);
+	CHECK(s_Server.lanes[HTTP_LANE_BULK].running == 1 && !s_Server.lanes[HTTP_LANE_BULK].queue_head);
+	CHECK(serve_connection(resumed, true) == resumed);
+	check_status(file_client, "HTTP/1.1 200 OK");
+	CHECK(s_Server.lanes[HTTP_LANE_BULK].running == 0);
+	CHECK(!uxQueueMessagesWaiting(s_Server.connection_queue));
+
+	//Raising the limit of a lane resumes the requests waiting for it
+	s_Server.lanes[HTTP_LANE_BULK].running = 1;
+	worker = resumed;
+	close(file_client);
+	file_client = connect_client(worker, "/index.html");
+	worker = serve_connection(worker, false);
+	http_server_set_lane_limits(&s_Server, HTTP_LANE_BULK, 2, HTTP_SERVER_WORKER_PRIORITY);
+	CHECK(uxQueueMessagesWaiting(s_Server.connection_queue) == 1 && s_Server.wakeup_queued);
+
+	close(file_client);
+	close(api_client);
+	close(rejected_client);
+	return host_test_result();
+}
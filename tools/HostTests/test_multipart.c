@@ -0,0 +1,133 @@
+//The server is included directly, so that the test can set up a connection without starting the workers
+#include "httpserver.c"
+#include "host_test.h"
+
+#define BOUNDARY "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+
+struct upload
+{
+	char names[256];
+	char *data;	//Contents of all parts, each followed by '|'
+	int size;
+	int abort_after;	//part_data() fails after receiving this many bytes (0 to never fail)
+};
+
+static bool on_part_header(void *context, const char *name, const char *value)
+{
+	struct upload *upload = (struct upload *)context;
+	char part_name[64];
+	if (!strcasecmp(name, "Content-Disposition") && http_server_get_header_param(value, "name", part_name, sizeof(part_name)))
+	{
+		strcat(upload->names, part_name);
+		strcat(upload->names, ",");
+	}
+
+	return true;
+}
+
+static bool on_part_data(void *context, const char *data, int size, bool last)
+{
+	struct upload *upload = (struct upload *)context;
+	memcpy(upload->data + upload->size, data, size);
+	upload->size += size;
+	if (last)
+		upload->data[upload->size++] = '|';
+
+	return !upload->abort_after || upload->size < upload->abort_after;
+}
+
+/* Sends the request over a socket pair and reads its headers the same way as the socket backend
+ * (see parse_and_handle_http_request()), so that the body is read by the regular code path. */
+static bool read_multipart_request(const char *request, int request_size, int buffer_size, struct upload *upload)
+{
+	int sockets[2];
+	CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+	CHECK(send(sockets[1], request, request_size, 0) == request_size);
+	shutdown(sockets[1], SHUT_WR);
+
+	struct _http_server_instance server = { .buffer_size = buffer_size };
+	http_connection conn = calloc(1, sizeof(struct _http_connection) + buffer_size);
+	http_request_parser parser;
+	conn->server = &server;
+	conn->link = sockets[0];
+	http_parser_reset(&parser, &server, conn->buffer, buffer_size);
+
+	while (parser.state < HTTP_PARSER_DONE)
+	{
+		int avail;
+		char *p = http_parser_get_free_space(&parser, &avail);
+		int done = recv(conn->link, p, avail, 0);
+		if (done <= 0)
+			break;
+		http_parser_commit(&parser, done);
+	}
+
+	bool result = false;
+	if (parser.state == HTTP_PARSER_DONE)
+	{
+		conn->request_headers = &parser.headers;
+		begin_request_body(conn, parser.type, parser.headers.content_length, parser.header_start, parser.line_start - parser.header_start, parser.data_end - parser.header_start);
+
+		http_multipart_handler handler = { on_part_header, on_part_data, upload };
+		result = http_server_read_multipart_body(conn, &handler);
+	}
+
+	close(sockets[0]);
+	close(sockets[1]);
+	free(conn);
+	return result;
+}
+
+//Builds a form with a text field and a binary file full of CR, LF and '-', so that it contains many partial delimiters
+static int build_request(char *request, const char *file, int file_size, int declared_body_size)
+{
+	char body_start[512], body_end[64];
+	int start_len = sprintf(body_start, "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"field\"\r\n\r\nvalue1\r\n"
+		"--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"file\"; filename=\"a.bin\"\r\nContent-Type: application/octet-stream\r\n\r\n");
+	int end_len = sprintf(body_end, "\r\n--" BOUNDARY "--\r\n");
+	int body_size = start_len + file_size + end_len;
+
+	int len = sprintf(request, "POST /upload HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=" BOUNDARY "\r\nContent-Length: %d\r\n\r\n",
+		declared_body_size ? declared_body_size : body_size);
+	memcpy(request + len, body_start, start_len);
+	memcpy(request + len + start_len, file, file_size);
+	memcpy(request + len + start_len + file_size, body_end, end_len);
+	return len + body_size;
+}
+
+int main(void)
+{
+	static char file[50000], request[60000], data[60000];
+	srand(1);
+	for (int i = 0; i < sizeof(file); i++)
+		file[i] = (i % 97 == 0) ? '\r' : (i % 89 == 0) ? '\n' : (i % 1000 == 0) ? '-' : rand();
+	memcpy(file + 20000, "\r\n--" BOUNDARY, 20);	//Almost a delimiter
+
+	int request_size = build_request(request, file, sizeof(file), 0);
+	for (int buffer_size = 256; buffer_size <= 4096; buffer_size = buffer_size * 3 / 2)
+	{
+		struct upload upload = { .data = data };
+		CHECK(read_multipart_request(request, request_size, buffer_size, &upload));
+		CHECK_STR(upload.names, "field,file,");
+		CHECK(upload.size == 7 + sizeof(file) + 1);
+		CHECK(!memcmp(upload.data, "value1|", 7));
+		CHECK(!memcmp(upload.data + 7, file, sizeof(file)));
+		CHECK(upload.data[upload.size - 1] == '|');
+	}
+
+	//The body ends before the closing delimiter
+	struct upload upload = { .data = data };
+	request_size = build_request(request, file, sizeof(file), 0);
+	CHECK(!read_multipart_request(request, request_size - 10, 1024, &upload));
+
+	//A callback stops the upload
+	upload = (struct upload){ .data = data, .abort_after = 1000 };
+	CHECK(!read_multipart_request(request, request_size, 1024, &upload));
+
+	//Not a multipart request
+	const char *plain = "POST /upload HTTP/1.1\r\nContent-Type: text/plain\r\nContent-Length: 5\r\n\r\nhello";
+	upload = (struct upload){ .data = data };
+	CHECK(!read_multipart_request(plain, strlen(plain), 1024, &upload));
+
+	return host_test_result();
+}
@@ -0,0 +1,139 @@
+//Builds the server with the raw API backend, with the PCBs from host/lwip/tcp.h standing in for the lwIP ones
+#define HTTP_SERVER_USE_RAW_API 1
+#define LWIP_TCPIP_CORE_LOCKING 1
+#include "httpserver.c"
+#include "host_test.h"
+
+static bool reply_with_path(http_connection conn, enum http_request_type type, char *path, void *context)
+{
+	//The path is in the connection buffer, where the reply header goes
+	static char content[64];
+	snprintf(content, sizeof(content), "%s", path);
+	http_server_send_reply(conn, "200 OK", "text/plain", content, -1);
+	return true;
+}
+
+//Accepts a new connection the same way as lwIP does, and returns the link passed to the workers (NULL if the connection was shed)
+static http_link accept_connection(http_server_instance server, struct tcp_pcb **pcb)
+{
+	*pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+	CHECK(server->listen_pcb->accept(server->listen_pcb->arg, *pcb, ERR_OK) == ERR_OK);
+
+	http_link link = NULL;
+	xQueueReceive(server->connection_queue, &link, 0);
+	return link;
+}
+
+//Runs the steps of http_server_worker() for a connection taken from the queue
+static void serve(http_connection ctx, http_link link)
+{
+	ctx->link = link;
+	ctx->detached = ctx->nodelay = false;
+	ctx->requests_served = 0;
+	CHECK(serve_connection(ctx, false) == ctx);
+}
+
+static int count_replies(const char *output, const char *status)
+{
+	int count = 0;
+	for (const char *p = output; p && (p = strstr(p, status)); p++)
+		count++;
+	return count;
+}
+
+//Two pipelined requests, split into pbufs that don't end at the line boundaries
+static void test_pipelined_requests(http_server_instance server, http_connection ctx)
+{
+	static const char requests[] = "GET /first HTTP/1.1\r\nHost: picohttp\r\n\r\n"
+		"GET /second HTTP/1.1\r\nHost: picohttp\r\nConnection: close\r\n\r\n";
+
+	struct tcp_pcb *pcb;
+	http_link link = accept_connection(server, &pcb);
+	CHECK(link && link->pcb == pcb && pcb->recv == raw_link_recv);
+
+	//The first segments arrive together, the rest one by one
+	pcb->recv(pcb->arg, pcb, host_pbuf_chain(requests, 30, 7), ERR_OK);
+	pcb->recv(pcb->arg, pcb, host_pbuf_chain(requests + 30, sizeof(requests) - 1 - 30, 11), ERR_OK);
+	serve(ctx, link);
+
+	CHECK(pcb->output && strstr(pcb->output, "HTTP/1.1 200 OK") == pcb->output);
+	CHECK(count_replies(pcb->output, "HTTP/1.1 200 OK") == 2);
+	CHECK(strstr(pcb->output, "\r\n\r\nfirst") && strstr(pcb->output, "\r\n\r\nsecond"));
+
+	//Everything that was parsed has been acknowledged, and the link returned to the pool
+	CHECK(pcb->recved == sizeof(requests) - 1);
+	CHECK(pcb->closed && !link->pcb && !link->rx && !link->in_use);
+}
+
+//The client closes the connection after sending the request
+static void test_remote_close(http_server_instance server, http_connection ctx)
+{
+	static const char request[] = "GET /a HTTP/1.1\r\nHost: picohttp\r\n\r\n";
+	struct tcp_pcb *pcb;
+	http_link link = accept_connection(server, &pcb);
+	pcb->recv(pcb->arg, pcb, host_pbuf_chain(request, sizeof(request) - 1, 1460), ERR_OK);
+	pcb->recv(pcb->arg, pcb, NULL, ERR_OK);
+	serve(ctx, link);
+
+	CHECK(count_replies(pcb->output, "HTTP/1.1 200 OK") == 1);
+	CHECK(pcb->closed && !link->in_use);
+}
+
+//lwIP reports an error (and frees the PCB) before the request has been received completely
+static void test_reset_during_request(http_server_instance server, http_connection ctx)
+{
+	static const char request[] = "GET /a HTTP/1.1\r\nHost: pico";
+	struct tcp_pcb *pcb;
+	http_link link = accept_connection(server, &pcb);
+	pcb->recv(pcb->arg, pcb, host_pbuf_chain(request, sizeof(request) - 1, 1460), ERR_OK);
+	pcb->errf(pcb->arg, ERR_ABRT);
+	serve(ctx, link);
+
+	CHECK(!pcb->output && !pcb->closed);	//The PCB is not touched after the error
+	CHECK(!link->pcb && !link->rx && !link->in_use);
+}
+
+//Once the connection queue is full, new connections get the 503 reply without taking up a link
+static void test_shed_connection(http_server_instance server)
+{
+	struct tcp_pcb *queued[8], *pcb = NULL;
+	int count = 0;
+	for (; count < 8; count++)
+	{
+		queued[count] = tcp_new_ip_type(IPADDR_TYPE_ANY);
+		server->listen_pcb->accept(server->listen_pcb->arg, queued[count], ERR_OK);
+		if (queued[count]->output)
+		{
+			pcb = queued[count];
+			break;
+		}
+	}
+
+	CHECK(pcb && count == server->max_workers + 1);
+	CHECK(pcb && strstr(pcb->output, "HTTP/1.1 503") == pcb->output && pcb->tx_shut && !pcb->recv);
+
+	http_link link;
+	while (xQueueReceive(server->connection_queue, &link, 0) == pdTRUE)
+		link_close(link);
+	for (int i = 0; i < server->link_count; i++)
+		CHECK(!server->links[i].in_use);
+}
+
+int main(void)
+{
+	//No worker tasks can be created on the host, so the test runs their steps itself
+	http_server_instance server = http_server_create("picohttp", "lan", 2, 1024);
+	CHECK(server && server->listen_pcb && server->listen_pcb->listening);
+	if (!server)
+		return host_test_result();
+
+	static http_zone zone;
+	http_server_add_zone(server, &zone, "", reply_with_path, NULL);
+	http_connection ctx = alloc_connection(server);
+
+	test_pipelined_requests(server, ctx);
+	test_remote_close(server, ctx);
+	test_reset_during_request(server, ctx);
+	test_shed_connection(server);
+	return host_test_result();
+}
@@ -0,0 +1,198 @@
+//The server is included directly, so that the tests can call its static functions
+#include "httpserver.c"
+#include "host_test.h"
+
+static struct _http_server_instance s_Server;
+
+//Receives the request in fragments of the specified size, same as the socket backend does
+static void parse(http_request_parser *parser, char *buffer, int buffer_size, const char *request, int step)
+{
+	http_parser_reset(parser, &s_Server, buffer, buffer_size);
+	int len = strlen(request);
+	for (int pos = 0; pos < len && parser->state < HTTP_PARSER_DONE;)
+	{
+		int avail;
+		char *p = http_parser_get_free_space(parser, &avail);
+		int todo = MIN(MIN(avail, step), len - pos);
+		memcpy(p, request + pos, todo);
+		pos += todo;
+		http_parser_commit(parser, todo);
+	}
+}
+
+static void test_get_request(void)
+{
+	const char *request = "GET /index.html HTTP/1.1\r\n"
+		"Host: picohttp.local\r\n"
+		"Accept-Encoding: gzip, deflate, br;q=0\r\n"
+		"If-None-Match: \"0123456789abcdef\"\r\n"
+		"\r\n";
+
+	for (int step = 1; step <= strlen(request); step++)
+	{
+		char buffer[256];
+		http_request_parser parser;
+		parse(&parser, buffer, sizeof(buffer), request, step);
+
+		CHECK(parser.state == HTTP_PARSER_DONE);
+		CHECK(parser.type == HTTP_GET);
+		CHECK_STR(parser.path, "/index.html");
+		CHECK_STR(parser.headers.host, "picohttp.local");
+		CHECK(parser.headers.http11 && parser.headers.keep_alive);
+		CHECK(parser.headers.accepted_encodings == HTTP_ENCODING_GZIP);
+		CHECK_STR(parser.headers.if_none_match, "\"0123456789abcdef\"");
+	}
+}
+
+static void test_post_body_follows_headers(void)
+{
+	const char *request = "POST /api/settings HTTP/1.0\r\nContent-Length: 11\r\nConnection: keep-alive\r\n\r\nhello world";
+	for (int step = 1; step <= strlen(request); step++)
+	{
+		char buffer[256];
+		http_request_parser parser;
+		parse(&parser, buffer, sizeof(buffer), request, step);
+
+		CHECK(parser.state == HTTP_PARSER_DONE);
+		CHECK(parser.type == HTTP_POST);
+		CHECK(!parser.headers.http11 && parser.headers.keep_alive);
+		CHECK(parser.headers.content_length == 11);
+
+		//The part of the body received together with the headers stays in the buffer
+		int body_len = parser.data_end - parser.line_start;
+		CHECK(body_len >= 0 && body_len <= 11 && !memcmp(buffer + parser.line_start, "hello world", body_len));
+	}
+}
+
+static void test_long_header_is_skipped(void)
+{
+	char request[1024];
+	int len = sprintf(request, "GET /a HTTP/1.1\r\nUser-Agent: ");
+	memset(request + len, 'x', 500);
+	len += 500;
+	sprintf(request + len, "\r\nHost: picohttp.local\r\nConnection: close\r\n\r\n");
+
+	for (int step = 1; step <= 600; step += 37)
+	{
+		char buffer[128];
+		http_request_parser parser;
+		parse(&parser, buffer, sizeof(buffer), request, step);
+
+		CHECK(parser.state == HTTP_PARSER_DONE);
+		CHECK_STR(parser.path, "/a");
+		CHECK_STR(parser.headers.host, "picohttp.local");
+		CHECK(!parser.headers.keep_alive);
+	}
+}
+
+static void test_captured_headers(void)
+{
+	s_Server.captured_headers[0].name = "X-Image-CRC32";
+	s_Server.captured_headers[0].len = strlen(s_Server.captured_headers[0].name);
+	s_Server.captured_headers[1].name = "X-Missing";
+	s_Server.captured_headers[1].len = strlen(s_Server.captured_headers[1].name);
+	s_Server.captured_header_count = 2;
+
+	const char *request = "POST /api/ota HTTP/1.1\r\nx-image-crc32:  12345678 \r\nContent-Length: 0\r\n\r\n";
+	for (int step = 1; step <= strlen(request); step++)
+	{
+		char buffer[128];
+		http_request_parser parser;
+		parse(&parser, buffer, sizeof(buffer), request, step);
+
+		CHECK(parser.state == HTTP_PARSER_DONE);
+		CHECK_STR(parser.headers.captured[0], "12345678");
+		CHECK(!parser.headers.captured[1]);
+	}
+
+	s_Server.captured_header_count = 0;
+}
+
+static void test_websocket_upgrade(void)
+{
+	const char *request = "GET /api/pins HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+	char buffer[256];
+	http_request_parser parser;
+	parse(&parser, buffer, sizeof(buffer), request, 7);
+
+	CHECK(parser.state == HTTP_PARSER_DONE);
+	CHECK(parser.headers.upgrade_websocket);
+	CHECK_STR(parser.headers.websocket_key, "dGhlIHNhbXBsZSBub25jZQ==");
+}
+
+static void test_invalid_requests(void)
+{
+	char buffer[64];
+	http_request_parser parser;
+	parse(&parser, buffer, sizeof(buffer), "GARBAGE\r\n\r\n", 3);
+	CHECK(parser.state == HTTP_PARSER_ERROR);
+
+	//The request line must fit into the buffer
+	char request[256];
+	sprintf(request, "GET /%0200d HTTP/1.1\r\n\r\n", 0);
+	parse(&parser, buffer, sizeof(buffer), request, 16);
+	CHECK(parser.state == HTTP_PARSER_ERROR);
+}
+
+static void test_feed_stops_at_end_of_headers(void)
+{
+	//A pipelined request must stay unconsumed
+	const char *request = "GET /first HTTP/1.1\r\nHost: a\r\n\r\nGET /second HTTP/1.1\r\n\r\n";
+	char buffer[256];
+	http_request_parser parser;
+	http_parser_reset(&parser, &s_Server, buffer, sizeof(buffer));
+
+	int consumed = http_parser_feed(&parser, request, strlen(request));
+	CHECK(parser.state == HTTP_PARSER_DONE);
+	CHECK_STR(parser.path, "/first");
+	CHECK(consumed == strstr(request, "GET /second") - request);
+}
+
+static void test_etag_matches(void)
+{
+	struct http_request_headers headers = { 0 };
+	struct _http_connection conn = { .request_headers = &headers };
+
+	const char *etag = "\"abcd-gzip\"";
+	static const struct
+	{
+		const char *list;
+		bool match;
+	} cases[] = {
+		{ "\"abcd-gzip\"", true },
+		{ "\"1234\", \"abcd-gzip\"", true },
+		{ "\"1234\",\"abcd-gzip\" , \"5678\"", true },
+		{ "*", true },
+		{ "", false },
+		{ "\"abcd\"", false },
+		{ "\"abcd-gzip2\"", false },
+		{ "\"x\"abcd-gzip\"\"", false },
+		{ "W/\"abcd-gzip\"", false },
+		{ "abcd-gzip", false },
+		{ "\"abcd-gzip", false },
+	};
+
+	for (int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		strcpy(headers.if_none_match, cases[i].list);
+		CHECK(http_server_etag_matches(&conn, etag) == cases[i].match);
+	}
+
+	strcpy(headers.if_none_match, "\"1\", W/\"abcd\"");
+	CHECK(http_server_etag_matches(&conn, "W/\"abcd\""));
+}
+
+int main(void)
+{
+	s_Server.buffer_size = 256;
+
+	test_get_request();
+	test_post_body_follows_headers();
+	test_long_header_is_skipped();
+	test_captured_headers();
+	test_websocket_upgrade();
+	test_invalid_requests();
+	test_feed_stops_at_end_of_headers();
+	test_etag_matches();
+	return host_test_result();
+}
@@ -1,11 +1,28 @@
 #pragma once
 
+//Compressed variants of a file. Size is 0 if the variant is missing (e.g. it would not be smaller than the original).
 typedef struct
 {
-	uint32_t FileSize;
+	uint32_t Size;
+	uint32_t DataOffset;
+} StoredFileVariant;
+
+enum
+{
+	kSimpleFSVariantGzip,
+	kSimpleFSVariantBrotli,
+	kSimpleFSVariantCount,
+};
+
+typedef struct
+{
+	uint32_t FileSize;	//0 if only the compressed variants were kept
 	uint32_t NameOffset;
 	uint32_t ContentTypeOffset;
 	uint32_t DataOffset;
+	uint32_t ETagOffset;	//Quoted hash of the file contents (in the name block), usable as a HTTP entity tag
+	uint32_t CacheControlOffset;	//Value of the Cache-Control header (in the name block), empty if not specified
+	StoredFileVariant Variants[kSimpleFSVariantCount];
 } StoredFileEntry;
 
 typedef struct
@@ -18,5 +35,5 @@ typedef struct
 
 enum 
 {
-	kSimpleFSHeaderMagic = '1SFS',
+	kSimpleFSHeaderMagic = '4SFS',
 };
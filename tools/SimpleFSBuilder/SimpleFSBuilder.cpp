@@ -8,6 +8,12 @@
 #include <string.h>
 #include <map>
 #include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
 #include "SimpleFS.h"
 
 using namespace std;
@@ -15,12 +21,16 @@ using namespace std::filesystem;
 
 struct TemporaryFileEntry
 {
-	string PathInArchive;
+	string PathInArchive, RelativePath;
 	string FullPath, Extension;
 	uintmax_t Size;
+	string ETag;
+	std::vector<char> Contents;
+	std::vector<char> Variants[kSimpleFSVariantCount];	//Empty if not smaller than the original
 	
-	TemporaryFileEntry(const string &pathInArchive, const path &fullPath, uintmax_t size)
+	TemporaryFileEntry(const string &pathInArchive, const string &relativePath, const path &fullPath, uintmax_t size)
 		: PathInArchive(pathInArchive),
+		RelativePath(relativePath),
 		FullPath(fullPath.u8string()),
 		Extension(fullPath.extension().u8string()),
 		Size(size)
@@ -48,10 +58,11 @@ static void BuildFileListRecursively(path dir, std::list<TemporaryFileEntry> &en
 		else
 		{
 			path fn = entry.path().filename();
+			string relativePath = CombinePaths(pathBase, fn);
 			if (!strcasecmp(fn.u8string().c_str(), "index.html"))
 				fn = "";
 			
-			entries.emplace_back(CombinePaths(pathBase, fn), entry.path(), entry.file_size());
+			entries.emplace_back(CombinePaths(pathBase, fn), relativePath, entry.path(), entry.file_size());
 		}
 	}
 
@@ -72,6 +83,117 @@ void WriteIfNotMatches(std::string fn, std::vector<char> &data)
 	fs.write(data.data(), data.size());
 }
 
+static std::vector<char> CompressGzip(const std::vector<char> &data)
+{
+#ifdef HAVE_ZLIB
+	z_stream stream = {};
+	if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)	//+16 selects the gzip format
+		throw runtime_error("Failed to initialize zlib");
+	
+	std::vector<char> result(deflateBound(&stream, data.size()));
+	stream.next_in = (Bytef *)data.data();
+	stream.avail_in = data.size();
+	stream.next_out = (Bytef *)result.data();
+	stream.avail_out = result.size();
+	int status = deflate(&stream, Z_FINISH);
+	result.resize(stream.total_out);
+	deflateEnd(&stream);
+	
+	if (status != Z_STREAM_END)
+		throw runtime_error("Failed to compress data");
+	return result;
+#else
+	return std::vector<char>();	//Built without zlib
+#endif
+}
+
+static std::vector<char> CompressBrotli(const std::vector<char> &data)
+{
+#ifdef HAVE_BROTLI
+	size_t size = BrotliEncoderMaxCompressedSize(data.size());
+	std::vector<char> result(size ? size : data.size() + 1024);
+	size = result.size();
+	if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, data.size(), (const uint8_t *)data.data(), &size, (uint8_t *)result.data()))
+		throw runtime_error("Failed to compress data");
+	result.resize(size);
+	return result;
+#else
+	return std::vector<char>();	//Built without the brotli library
+#endif
+}
+
+//64-bit FNV-1a is enough to tell the versions of the same file apart, so it is used for the ETags instead of a cryptographic hash
+static std::string ComputeETag(const char *data, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= (uint8_t)data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	
+	char buf[32];
+	snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)hash);
+	return buf;
+}
+
+//'*' matches any sequence of characters (including '/'), '?' matches any single character
+static bool MatchesPattern(const char *pattern, const char *str)
+{
+	for (;; pattern++, str++)
+	{
+		if (*pattern == '*')
+		{
+			for (const char *p = str;; p++)
+			{
+				if (MatchesPattern(pattern + 1, p))
+					return true;
+				if (!*p)
+					return false;
+			}
+		}
+		
+		if (!*pattern || !*str)
+			return *pattern == *str;
+		if (*pattern != '?' && tolower(*pattern) != tolower(*str))
+			return false;
+	}
+}
+
+struct CacheRule
+{
+	std::string Pattern, Value;
+};
+
+/* Each line of the rules file is a pattern followed by the Cache-Control value, e.g.:
+ *		img/*		max-age=31536000, immutable
+ * The first matching rule applies. Empty lines and lines starting with '#' are ignored. */
+static std::vector<CacheRule> LoadCacheRules(const char *fn)
+{
+	std::vector<CacheRule> rules;
+	ifstream ifs(fn);
+	if (!ifs)
+		throw runtime_error(string("Cannot open ") + fn);
+	
+	string line;
+	while (getline(ifs, line))
+	{
+		size_t start = line.find_first_not_of(" \t\r");
+		if (start == string::npos || line[start] == '#')
+			continue;
+		
+		size_t end = line.find_first_of(" \t", start);
+		size_t valueStart = end == string::npos ? string::npos : line.find_first_not_of(" \t", end);
+		if (valueStart == string::npos)
+			throw runtime_error("Missing Cache-Control value: " + line);
+		
+		size_t valueEnd = line.find_last_not_of(" \t\r");
+		rules.push_back({ line.substr(start, end - start), line.substr(valueStart, valueEnd + 1 - valueStart) });
+	}
+	
+	return rules;
+}
+
 struct ContentType
 {
 	std::string Value;
@@ -85,18 +207,68 @@ struct ContentType
 
 int main(int argc, char *argv[])
 {
+	//With --drop-uncompressed, files that have a smaller gzip variant are only stored compressed.
+	//Such files will then be sent compressed even to the clients that don't declare gzip support.
+	//With --brotli, the brotli variants are stored as well. Browsers only accept brotli over HTTPS,
+	//so they are off by default, as the server only speaks plain HTTP.
+	bool dropUncompressed = false, brotli = false;
+	for (; argc > 1 && !strncmp(argv[1], "--", 2); argv++, argc--)
+	{
+		if (!strcmp(argv[1], "--drop-uncompressed"))
+			dropUncompressed = true;
+		else if (!strcmp(argv[1], "--brotli"))
+			brotli = true;
+		else
+		{
+			cout << "Unknown option: " << argv[1] << endl;
+			return 1;
+		}
+	}
+	
 	if (argc < 3)
 	{
-		cout << "Usage: SimpleFSBuilder <directory> <FS image>" << endl;
+		cout << "Usage: SimpleFSBuilder [--drop-uncompressed] [--brotli] <directory> <FS image> [Cache-Control rules file]" << endl;
 		return 1;
 	}
 	
+#ifndef HAVE_BROTLI
+	if (brotli)
+		cout << "Warning: SimpleFSBuilder was built without the brotli library, brotli variants will not be generated" << endl;
+#endif
+	
 	try
 	{
 		std::list<TemporaryFileEntry> entries;
 		BuildFileListRecursively(argv[1], entries, "");
 		GlobalFSHeader hdr = { kSimpleFSHeaderMagic, };
 		
+		std::vector<CacheRule> cacheRules;
+		if (argc > 3)
+			cacheRules = LoadCacheRules(argv[3]);
+		
+		//Each distinct Cache-Control value is stored once, same as the content types
+		map<string, int> cacheControlValues = { { "", 0 } };
+		for (const auto &rule : cacheRules)
+			cacheControlValues[rule.Value] = 0;
+		
+		for (auto &entry : entries)
+		{
+			entry.Contents.resize(entry.Size);
+			ifstream ifs(entry.FullPath, ios::in | ios::binary);
+			ifs.read(entry.Contents.data(), entry.Contents.size());
+			entry.ETag = ComputeETag(entry.Contents.data(), entry.Contents.size());
+			
+			entry.Variants[kSimpleFSVariantGzip] = CompressGzip(entry.Contents);
+			if (brotli)
+				entry.Variants[kSimpleFSVariantBrotli] = CompressBrotli(entry.Contents);
+			for (auto &variant : entry.Variants)
+				if (variant.size() >= entry.Contents.size())
+					variant.clear();
+			
+			if (dropUncompressed && !entry.Variants[kSimpleFSVariantGzip].empty())
+				entry.Contents.clear();
+		}
+		
 		map<string, ContentType> contentTypes = {
 			{ ".txt", "text/plain" },
 			{ ".htm", "text/html" },
@@ -111,11 +283,16 @@ int main(int argc, char *argv[])
 		{
 			hdr.EntryCount++;
 			hdr.NameBlockSize += entry.PathInArchive.size() + 1;
-			hdr.DataBlockSize += entry.Size;
+			hdr.NameBlockSize += entry.ETag.size() + 1;
+			hdr.DataBlockSize += entry.Contents.size();
+			for (const auto &variant : entry.Variants)
+				hdr.DataBlockSize += variant.size();
 		}
 		
 		for (const auto &kv : contentTypes)
 			hdr.NameBlockSize += kv.second.Value.size() + 1;
+		for (const auto &kv : cacheControlValues)
+			hdr.NameBlockSize += kv.first.size() + 1;
 	
 		std::vector<char> buffer(sizeof(GlobalFSHeader) + hdr.EntryCount * sizeof(StoredFileEntry) + hdr.NameBlockSize + hdr.DataBlockSize);
 	
@@ -132,10 +309,17 @@ int main(int argc, char *argv[])
 			memcpy(names + nameOff, kv.second.Value.c_str(), kv.second.Value.size() + 1);
 			nameOff += kv.second.Value.size() + 1;
 		}
+		
+		for (auto &kv : cacheControlValues)
+		{
+			kv.second = nameOff;
+			memcpy(names + nameOff, kv.first.c_str(), kv.first.size() + 1);
+			nameOff += kv.first.size() + 1;
+		}
 	
 		for (const auto &entry : entries)
 		{
-			storedEntries[i].FileSize = entry.Size;
+			storedEntries[i].FileSize = entry.Contents.size();
 			storedEntries[i].NameOffset = nameOff;
 			storedEntries[i].DataOffset = dataOff;
 			
@@ -145,15 +329,35 @@ int main(int argc, char *argv[])
 			
 			storedEntries[i].ContentTypeOffset = it->second.Offset;
 			
+			storedEntries[i].CacheControlOffset = cacheControlValues[""];
+			for (const auto &rule : cacheRules)
+			{
+				if (MatchesPattern(rule.Pattern.c_str(), entry.RelativePath.c_str()))
+				{
+					storedEntries[i].CacheControlOffset = cacheControlValues[rule.Value];
+					break;
+				}
+			}
+			
+			memcpy(data + dataOff, entry.Contents.data(), entry.Contents.size());
+			dataOff += entry.Contents.size();
+			
+			for (int j = 0; j < kSimpleFSVariantCount; j++)
+			{
+				storedEntries[i].Variants[j].Size = entry.Variants[j].size();
+				storedEntries[i].Variants[j].DataOffset = dataOff;
+				memcpy(data + dataOff, entry.Variants[j].data(), entry.Variants[j].size());
+				dataOff += entry.Variants[j].size();
+			}
+			
 			i++;
 		
-			ifstream ifs(entry.FullPath, ios::in | ios::binary);
-			ifs.read(data + dataOff, entry.Size);
-		
 			memcpy(names + nameOff, entry.PathInArchive.c_str(), entry.PathInArchive.size() + 1);
-		
 			nameOff += entry.PathInArchive.size() + 1;
-			dataOff += entry.Size;
+			
+			storedEntries[i - 1].ETagOffset = nameOff;
+			memcpy(names + nameOff, entry.ETag.c_str(), entry.ETag.size() + 1);
+			nameOff += entry.ETag.size() + 1;
 		}
 	
 		if (nameOff != hdr.NameBlockSize)